@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <sys/stat.h>
+#include "assetcache.h"
+
+AssetCacheClass::AssetCacheClass(size_t limit, size_t max_file)
+{
+	this->limit = limit;
+	this->max_file = max_file;
+	total = 0;
+	hits = 0;
+	misses = 0;
+	
+} /* AssetCacheClass::AssetCacheClass */
+
+AssetCacheClass::~AssetCacheClass()
+{
+	
+} /* AssetCacheClass::~AssetCacheClass */
+
+void AssetCacheClass::Times(const struct stat& attr, struct timespec* mtime,
+	struct timespec* ctime)
+{
+#ifndef __WIN32__
+	*mtime = attr.st_mtim;
+	*ctime = attr.st_ctim;
+#else
+	mtime->tv_sec = attr.st_mtime;
+	mtime->tv_nsec = 0;
+	ctime->tv_sec = attr.st_ctime;
+	ctime->tv_nsec = 0;
+#endif
+	
+} /* AssetCacheClass::Times */
+
+AssetCacheClass::Data AssetCacheClass::Get(const std::string& path,
+	const struct stat& attr, std::function<FILE*()> open)
+{
+	if( !S_ISREG( attr.st_mode ) || ( attr.st_size > max_file ) )
+	{
+		return Data();
+	}
+	
+	std::lock_guard<std::mutex> guard( lock );
+	
+	struct timespec mtime, ctime;
+	
+	Times( attr, &mtime, &ctime );
+	
+	auto it = entries.find( path );
+	
+	if( it != entries.end() )
+	{
+		if( ( it->second.size == attr.st_size ) &&
+			( it->second.ino == (long long)attr.st_ino ) &&
+			( it->second.mtime.tv_sec == mtime.tv_sec ) &&
+			( it->second.mtime.tv_nsec == mtime.tv_nsec ) &&
+			( it->second.ctime.tv_sec == ctime.tv_sec ) &&
+			( it->second.ctime.tv_nsec == ctime.tv_nsec ) )
+		{
+			lru.splice( lru.begin(), lru, it->second.lru );
+			hits++;
+			return it->second.data;
+		}
+		
+		// Stale, file was rewritten since
+		total -= it->second.data->size();
+		lru.erase( it->second.lru );
+		entries.erase( it );
+	}
+	
+	misses++;
+	
+	FILE* fp = open();
+	
+	if( fp == nullptr )
+	{
+		return Data();
+	}
+	
+	std::vector<char>* buff = new std::vector<char>( attr.st_size );
+	
+	if( fread( buff->data(), 1, attr.st_size, fp ) != attr.st_size )
+	{
+		delete buff;
+		fclose( fp );
+		return Data();
+	}
+	
+	fclose( fp );
+	
+	ENTRY entry;
+	
+	entry.data = Data( buff );
+	entry.size = attr.st_size;
+	entry.ino = attr.st_ino;
+	entry.mtime = mtime;
+	entry.ctime = ctime;
+	
+	lru.push_front( path );
+	entry.lru = lru.begin();
+	entries[path] = entry;
+	total += attr.st_size;
+	
+	// Make room, never evicting what we just loaded
+	while( ( total > limit ) && ( lru.size() > 1 ) )
+	{
+		auto old = entries.find( lru.back() );
+		
+		total -= old->second.data->size();
+		entries.erase( old );
+		lru.pop_back();
+	}
+	
+	return entry.data;
+	
+} /* AssetCacheClass::Get */
+
+void AssetCacheClass::Flush()
+{
+	std::lock_guard<std::mutex> guard( lock );
+	
+	entries.clear();
+	lru.clear();
+	total = 0;
+	
+} /* AssetCacheClass::Flush */
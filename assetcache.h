@@ -0,0 +1,62 @@
+#ifndef _ASSETCACHE_H
+#define _ASSETCACHE_H
+
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <sys/stat.h>
+
+/* Read-only file content cache shared by all sessions. Entries are keyed
+ * by path and revalidated against the file's size, inode and modification
+ * and change times to the nanosecond on every lookup so rebuilt assets are
+ * picked up right away, even when rewritten within a second. Least
+ * recently used entries are dropped once the cache outgrows its limit. */
+
+class AssetCacheClass {
+public:
+	typedef std::shared_ptr<const std::vector<char> > Data;
+	
+	AssetCacheClass(size_t limit = 64*1024*1024, size_t max_file = 8*1024*1024);
+	virtual ~AssetCacheClass();
+	
+	/* Returns the contents of a file or an empty pointer if the file cannot
+	 * be read or is too big to be worth caching. key is the host path of
+	 * the file, attr its current attributes and open is only called to
+	 * load the file on a miss. */
+	Data Get(const std::string& key, const struct stat& attr,
+		std::function<FILE*()> open);
+	
+	void Flush();
+	
+	unsigned int	hits;
+	unsigned int	misses;
+	
+private:
+	
+	typedef struct {
+		Data		data;
+		long long	size;
+		long long	ino;
+		struct timespec mtime;
+		struct timespec ctime;
+		std::list<std::string>::iterator lru;
+	} ENTRY;
+	
+	static void Times(const struct stat& attr, struct timespec* mtime,
+		struct timespec* ctime);
+	
+	std::mutex		lock;
+	std::map<std::string, ENTRY> entries;
+	std::list<std::string> lru;
+	size_t			total;
+	size_t			limit;
+	size_t			max_file;
+};
+
+#endif // _ASSETCACHE_H
@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include "bufpool.h"
+
+BufferPoolClass::Lease::Lease()
+{
+	pool = nullptr;
+	buff = nullptr;
+	cls = 0;
+	
+} /* BufferPoolClass::Lease::Lease */
+
+BufferPoolClass::Lease::Lease(Lease&& other)
+{
+	pool = other.pool;
+	buff = other.buff;
+	cls = other.cls;
+	other.buff = nullptr;
+	
+} /* BufferPoolClass::Lease::Lease */
+
+BufferPoolClass::Lease& BufferPoolClass::Lease::operator=(Lease&& other)
+{
+	if( this != &other )
+	{
+		Release();
+		pool = other.pool;
+		buff = other.buff;
+		cls = other.cls;
+		other.buff = nullptr;
+	}
+	
+	return *this;
+	
+} /* BufferPoolClass::Lease::operator= */
+
+BufferPoolClass::Lease::~Lease()
+{
+	Release();
+	
+} /* BufferPoolClass::Lease::~Lease */
+
+void BufferPoolClass::Lease::Release()
+{
+	if( buff )
+	{
+		pool->Put( buff, cls );
+		buff = nullptr;
+	}
+	
+} /* BufferPoolClass::Lease::Release */
+
+BufferPoolClass::BufferPoolClass(size_t max_request, int keep)
+{
+	this->max_request = max_request;
+	this->keep = keep;
+	allocs = 0;
+	reuses = 0;
+	
+} /* BufferPoolClass::BufferPoolClass */
+
+BufferPoolClass::~BufferPoolClass()
+{
+	for( int i=0; i<BUFPOOL_CLASSES; i++ )
+	{
+		for( int j=0; j<free_list[i].size(); j++ )
+		{
+			free( free_list[i][j] );
+		}
+	}
+	
+} /* BufferPoolClass::~BufferPoolClass */
+
+BufferPoolClass::Lease BufferPoolClass::Get(size_t size)
+{
+	Lease lease;
+	int cls = 0;
+	
+	if( size > max_request )
+	{
+		return lease;
+	}
+	
+	while( ( cls < BUFPOOL_CLASSES-1 ) && ( ((size_t)1<<(cls+BUFPOOL_MIN_SHIFT)) < size ) )
+	{
+		cls++;
+	}
+	
+	if( !free_list[cls].empty() )
+	{
+		lease.buff = free_list[cls].back();
+		free_list[cls].pop_back();
+		reuses++;
+	}
+	else
+	{
+		lease.buff = (char*)malloc( (size_t)1<<(cls+BUFPOOL_MIN_SHIFT) );
+		allocs++;
+	}
+	
+	if( lease.buff )
+	{
+		lease.pool = this;
+		lease.cls = cls;
+	}
+	
+	return lease;
+	
+} /* BufferPoolClass::Get */
+
+void BufferPoolClass::Put(char* buff, int cls)
+{
+	if( free_list[cls].size() < keep )
+	{
+		free_list[cls].push_back( buff );
+		return;
+	}
+	
+	free( buff );
+	
+} /* BufferPoolClass::Put */
@@ -0,0 +1,61 @@
+#ifndef _BUFPOOL_H
+#define _BUFPOOL_H
+
+#include <stddef.h>
+#include <vector>
+
+/* Transfer buffers for a SIOFS session. Buffers come in power of two
+ * size classes and go back to the pool when their lease goes out of
+ * scope, so serving requests does not touch the heap once the pool has
+ * warmed up and early returns cannot leak. Requests above max_request
+ * are refused, whatever length the target sent. */
+
+#define BUFPOOL_MIN_SHIFT	12		// Smallest class is 4KB
+#define BUFPOOL_CLASSES		20		// Up to 2GB, max_request caps it anyway
+
+class BufferPoolClass {
+public:
+	
+	class Lease {
+	public:
+		Lease();
+		Lease(Lease&& other);
+		Lease& operator=(Lease&& other);
+		~Lease();
+		
+		Lease(const Lease&) = delete;
+		Lease& operator=(const Lease&) = delete;
+		
+		char* Data() const { return buff; }
+		explicit operator bool() const { return buff != nullptr; }
+		
+		/* Hands the buffer back early */
+		void Release();
+		
+	private:
+		friend class BufferPoolClass;
+		
+		BufferPoolClass* pool;
+		char*	buff;
+		int		cls;
+	};
+	
+	BufferPoolClass(size_t max_request = 8*1024*1024, int keep = 2);
+	virtual ~BufferPoolClass();
+	
+	/* An empty lease if size is above max_request */
+	Lease Get(size_t size);
+	
+	size_t			max_request;
+	unsigned int	allocs;
+	unsigned int	reuses;
+	
+private:
+	
+	void Put(char* buff, int cls);
+	
+	std::vector<char*> free_list[BUFPOOL_CLASSES];
+	int				keep;
+};
+
+#endif // _BUFPOOL_H
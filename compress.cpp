@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include "compress.h"
+#include "upload.h"
+
+#define HASH_BITS		16
+#define HASH_SIZE		(1<<HASH_BITS)
+
+static inline unsigned int readWord( const unsigned char* p )
+{
+	return p[0]|(p[1]<<8)|(p[2]<<16)|((unsigned int)p[3]<<24);
+
+} /* readWord */
+
+static inline unsigned int hashWord( unsigned int v )
+{
+	return (v*2654435761U)>>(32-HASH_BITS);
+
+} /* hashWord */
+
+static unsigned char* putCount( unsigned char* out, int count )
+{
+	while( count >= 255 )
+	{
+		*out++ = 255;
+		count -= 255;
+	}
+	*out++ = count;
+
+	return out;
+
+} /* putCount */
+
+static unsigned char* putBlock( unsigned char* out, const unsigned char* lit,
+	int lit_len, int offset, int match_len )
+{
+	unsigned char* token = out++;
+	int mlen = 0;
+
+	if( match_len )
+	{
+		mlen = match_len-MLZ_MIN_MATCH;
+	}
+
+	*token = ((lit_len >= 15) ? 15 : lit_len)<<4;
+
+	if( lit_len >= 15 )
+	{
+		out = putCount( out, lit_len-15 );
+	}
+
+	memcpy( out, lit, lit_len );
+	out += lit_len;
+
+	if( !match_len )
+	{
+		return out;
+	}
+
+	*out++ = offset&0xff;
+	*out++ = (offset>>8)&0xff;
+
+	*token |= (mlen >= 15) ? 15 : mlen;
+
+	if( mlen >= 15 )
+	{
+		out = putCount( out, mlen-15 );
+	}
+
+	return out;
+
+} /* putBlock */
+
+int mlzBound( int size )
+{
+	return size+(size/255)+16;
+
+} /* mlzBound */
+
+int mlzCompress( const void* src, int size, void* dst )
+{
+	const unsigned char* in = (const unsigned char*)src;
+	const unsigned char* anchor = in;
+	const unsigned char* ip = in;
+	const unsigned char* in_end = in+size;
+	const unsigned char* match_limit = in_end-MLZ_MIN_MATCH;
+	unsigned char* out = (unsigned char*)dst;
+
+	int* table = (int*)malloc( sizeof(int)*HASH_SIZE );
+
+	for( int i=0; i<HASH_SIZE; i++ )
+	{
+		table[i] = -1;
+	}
+
+	while( ip < match_limit )
+	{
+		unsigned int h = hashWord( readWord( ip ) );
+		int ref = table[h];
+
+		table[h] = (int)(ip-in);
+
+		if( ( ref < 0 ) || ( (ip-in)-ref > MLZ_MAX_OFFSET ) ||
+			( readWord( in+ref ) != readWord( ip ) ) )
+		{
+			ip++;
+			continue;
+		}
+
+		// Extend the match as far as it goes
+		const unsigned char* mp = in+ref+MLZ_MIN_MATCH;
+		const unsigned char* ep = ip+MLZ_MIN_MATCH;
+
+		while( ( ep < in_end ) && ( *ep == *mp ) )
+		{
+			ep++;
+			mp++;
+		}
+
+		out = putBlock( out, anchor, (int)(ip-anchor),
+			(int)((ip-in)-ref), (int)(ep-ip) );
+
+		// Seed the table with the tail of the match so runs chain nicely
+		if( ep-2 > ip && ep-2 < match_limit )
+		{
+			table[hashWord( readWord( ep-2 ) )] = (int)((ep-2)-in);
+		}
+
+		ip = ep;
+		anchor = ip;
+	}
+
+	// Trailing literals
+	if( anchor < in_end )
+	{
+		out = putBlock( out, anchor, (int)(in_end-anchor), 0, 0 );
+	}
+
+	free( table );
+
+	return (int)(out-(unsigned char*)dst);
+
+} /* mlzCompress */
+
+int mlzDecompress( const void* src, int size, void* dst, int dst_size )
+{
+	const unsigned char* ip = (const unsigned char*)src;
+	const unsigned char* in_end = ip+size;
+	unsigned char* op = (unsigned char*)dst;
+	unsigned char* out_end = op+dst_size;
+
+	while( op < out_end )
+	{
+		int len, offset;
+
+		if( ip >= in_end )
+		{
+			return -1;
+		}
+
+		int token = *ip++;
+
+		// Literals
+		len = token>>4;
+		if( len == 15 )
+		{
+			int c;
+			do
+			{
+				if( ip >= in_end )
+				{
+					return -1;
+				}
+				c = *ip++;
+				len += c;
+			} while( c == 255 );
+		}
+
+		if( ( ip+len > in_end ) || ( op+len > out_end ) )
+		{
+			return -1;
+		}
+
+		memcpy( op, ip, len );
+		op += len;
+		ip += len;
+
+		if( op >= out_end )
+		{
+			break;
+		}
+
+		// Match
+		if( ip+2 > in_end )
+		{
+			return -1;
+		}
+
+		offset = ip[0]|(ip[1]<<8);
+		ip += 2;
+
+		len = token&0xf;
+		if( len == 15 )
+		{
+			int c;
+			do
+			{
+				if( ip >= in_end )
+				{
+					return -1;
+				}
+				c = *ip++;
+				len += c;
+			} while( c == 255 );
+		}
+		len += MLZ_MIN_MATCH;
+
+		if( ( offset == 0 ) || ( op-offset < (unsigned char*)dst ) ||
+			( op+len > out_end ) )
+		{
+			return -1;
+		}
+
+		// Byte by byte since matches may overlap the output
+		const unsigned char* mp = op-offset;
+		while( len-- )
+		{
+			*op++ = *mp++;
+		}
+	}
+
+	return (int)(op-(unsigned char*)dst);
+
+} /* mlzDecompress */
+
+void* mlzCompressCached( const void* data, int size, unsigned int crc,
+	int* packed_size )
+{
+	char name[32];
+	void* packed;
+	FILE* fp;
+
+	sprintf( name, "%08x-%08x.mlz", crc, size );
+	std::string path = cachePath( name );
+
+	// Try the cache first
+	if( !path.empty() && ( fp = fopen( path.c_str(), "rb" ) ) )
+	{
+		fseek( fp, 0, SEEK_END );
+		int len = ftell( fp );
+		fseek( fp, 0, SEEK_SET );
+
+		packed = malloc( len );
+
+		if( ( len > 0 ) && ( fread( packed, 1, len, fp ) == len ) )
+		{
+			// Make sure a stale or truncated entry never gets uploaded
+			void* check = malloc( size );
+			int ok = ( mlzDecompress( packed, len, check, size ) == size ) &&
+				( crc32( check, size, 0xFFFFFFFF ) == crc );
+			free( check );
+
+			if( ok )
+			{
+				fclose( fp );
+				*packed_size = len;
+				return packed;
+			}
+		}
+
+		free( packed );
+		fclose( fp );
+	}
+
+	packed = malloc( mlzBound( size ) );
+	*packed_size = mlzCompress( data, size, packed );
+
+	// Store it for next time, failing that is harmless
+	if( !path.empty() && ( fp = fopen( path.c_str(), "wb" ) ) )
+	{
+		if( fwrite( packed, 1, *packed_size, fp ) != *packed_size )
+		{
+			fclose( fp );
+			remove( path.c_str() );
+		}
+		else
+		{
+			fclose( fp );
+		}
+	}
+
+	return packed;
+
+} /* mlzCompressCached */
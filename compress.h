@@ -0,0 +1,36 @@
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+/* MLZ is a byte aligned LZ77 format kept simple enough for the loader to
+ * decode on a R3000 without any bit twiddling. A stream is a sequence of
+ * blocks, each starting with a token byte:
+ *
+ *   bits 4-7 - Literal count (15 = more count bytes follow).
+ *   bits 0-3 - Match length minus MLZ_MIN_MATCH (15 = more count bytes).
+ *
+ * followed by the extra literal count bytes, the literals themselves, a
+ * 16-bit little endian match offset (1-65535) and finally the extra match
+ * length bytes. Extra count bytes are added together until a byte other
+ * than 255 is read. The stream ends once the decoder has produced the
+ * uncompressed size given in the upload parameters, so the last block only
+ * carries literals. See liteload/unmlz.c for the reference decoder.
+ */
+
+#define MLZ_MIN_MATCH	4
+#define MLZ_MAX_OFFSET	65535
+
+/* Returns worst case compressed size for a given input size */
+int mlzBound( int size );
+
+/* Compresses src into dst, returns compressed size */
+int mlzCompress( const void* src, int size, void* dst );
+
+/* Decompresses src into dst, returns decompressed size or -1 on error */
+int mlzDecompress( const void* src, int size, void* dst, int dst_size );
+
+/* Returns a malloc'd compressed copy of data, taken from the compression
+ * cache if the same data has been compressed before */
+void* mlzCompressCached( const void* data, int size, unsigned int crc,
+	int* packed_size );
+
+#endif // _COMPRESS_H
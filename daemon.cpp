@@ -0,0 +1,567 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#ifndef __WIN32__
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#include "daemon.h"
+#include "upload.h"
+#include "seriallog.h"
+#include "ring.h"
+
+/* main.cpp */
+void enable_raw_mode();
+void disable_raw_mode();
+extern RingClass console;
+
+static double timeNow()
+{
+	return std::chrono::duration<double>(
+		std::chrono::steady_clock::now().time_since_epoch() ).count();
+
+} /* timeNow */
+
+static void splitArgs( const std::string& line, std::vector<std::string>& args )
+{
+	const char* sep = strchr( line.c_str(), '\t' ) ? "\t" : " ";
+	size_t pos = 0;
+
+	args.clear();
+
+	while( pos <= line.size() )
+	{
+		size_t end = line.find_first_of( sep, pos );
+
+		if( end == std::string::npos )
+			end = line.size();
+
+		if( end > pos )
+			args.push_back( line.substr( pos, end-pos ) );
+
+		pos = end+1;
+	}
+
+} /* splitArgs */
+
+std::string daemonSocketPath( const std::string& device )
+{
+	size_t pos = device.find_last_of( "/\\" );
+	std::string name = ( pos == std::string::npos ) ? device : device.substr( pos+1 );
+
+	return "/tmp/mcomms-"+name+".sock";
+
+} /* daemonSocketPath */
+
+DaemonClass::DaemonClass()
+{
+	listen_fd = -1;
+	sessions = nullptr;
+
+} /* DaemonClass::DaemonClass */
+
+DaemonClass::~DaemonClass()
+{
+	Close();
+
+} /* DaemonClass::~DaemonClass */
+
+int DaemonClass::Open( const char* sock_path, std::vector<SessionClass*>* list )
+{
+#ifndef __WIN32__
+
+	struct sockaddr_un addr;
+
+	if( strlen( sock_path ) >= sizeof(addr.sun_path) )
+	{
+		return -1;
+	}
+
+	Close();
+
+	listen_fd = socket( AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0 );
+
+	if( listen_fd < 0 )
+	{
+		return -1;
+	}
+
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	strcpy( addr.sun_path, sock_path );
+
+	// A socket left behind by a daemon that did not exit cleanly refuses
+	// connections and can be cleared out, a live one belongs to another
+	// daemon
+	int probe = socket( AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0 );
+
+	if( probe >= 0 )
+	{
+		int live = ( connect( probe, (struct sockaddr*)&addr, sizeof(addr) ) == 0 );
+
+		close( probe );
+
+		if( live )
+		{
+			close( listen_fd );
+			listen_fd = -1;
+			return -2;
+		}
+	}
+
+	unlink( sock_path );
+
+	if( ( bind( listen_fd, (struct sockaddr*)&addr, sizeof(addr) ) < 0 ) ||
+		( listen( listen_fd, 4 ) < 0 ) )
+	{
+		close( listen_fd );
+		listen_fd = -1;
+		return -1;
+	}
+
+	path = sock_path;
+	sessions = list;
+	started = timeNow();
+
+	return 0;
+
+#else
+
+	return -1;
+
+#endif
+
+} /* DaemonClass::Open */
+
+void DaemonClass::Close()
+{
+#ifndef __WIN32__
+
+	for( int i=0; i<clients.size(); i++ )
+	{
+		close( clients[i].fd );
+	}
+	clients.clear();
+
+	if( listen_fd >= 0 )
+	{
+		close( listen_fd );
+		unlink( path.c_str() );
+		listen_fd = -1;
+	}
+
+#endif
+
+} /* DaemonClass::Close */
+
+void DaemonClass::Reply( CLIENT* client, const char* fmt, ... )
+{
+#ifndef __WIN32__
+
+	char buff[512];
+	va_list ap;
+
+	va_start( ap, fmt );
+	int len = vsnprintf( buff, sizeof(buff)-1, fmt, ap );
+	va_end( ap );
+
+	if( len > sizeof(buff)-2 )
+		len = sizeof(buff)-2;
+
+	buff[len++] = '\n';
+	send( client->fd, buff, len, MSG_NOSIGNAL );
+
+#endif
+
+} /* DaemonClass::Reply */
+
+int DaemonClass::Command( CLIENT* client, std::vector<std::string>& args )
+{
+	int ret;
+
+	if( args.empty() )
+	{
+		Reply( client, "ERROR Empty command" );
+		return 0;
+	}
+
+	printf( "\n---\nControl: %s\n", args[0].c_str() );
+
+	if( args[0] == "run" )
+	{
+		if( args.size() < 2 )
+		{
+			Reply( client, "ERROR Missing filename" );
+			return 0;
+		}
+
+		ret = Upload( UPLOAD_EXE, args[1].c_str(), 0 );
+
+	}
+	else if( ( args[0] == "up" ) || ( args[0] == "patch" ) )
+	{
+		unsigned int addr = 0;
+		int patch = ( args[0] == "patch" );
+
+		if( ( args.size() < 2 ) || ( !patch && ( args.size() < 3 ) ) )
+		{
+			Reply( client, "ERROR Missing parameters" );
+			return 0;
+		}
+
+		if( !patch )
+		{
+			sscanf( args[2].c_str(), "%x", &addr );
+		}
+
+		ret = Upload( patch ? UPLOAD_PATCH : UPLOAD_BIN, args[1].c_str(), addr );
+
+	}
+	else if( args[0] == "stats" )
+	{
+		int viewers = 0;
+		for( int i=0; i<clients.size(); i++ )
+		{
+			viewers += clients[i].attached;
+		}
+
+		Reply( client, "uptime %d", (int)(timeNow()-started) );
+		Reply( client, "viewers %d", viewers );
+		Reply( client, "console_ring_high %d", (int)console.high_water );
+		Reply( client, "console_ring_dropped %llu", (unsigned long long)console.dropped );
+		
+		for( int i=0; i<sessions->size(); i++ )
+		{
+			SessionClass* session = (*sessions)[i];
+			
+			Reply( client, "port%d.device %s", i, session->serial.device.c_str() );
+			Reply( client, "port%d.rx_bytes %llu", i, session->serial.rx_bytes );
+			Reply( client, "port%d.tx_bytes %llu", i, session->serial.tx_bytes );
+			
+			if( session->serial.ring )
+			{
+				Reply( client, "port%d.rx_ring_high %d", i, (int)session->serial.ring->high_water );
+				Reply( client, "port%d.rx_ring_dropped %llu", i,
+					(unsigned long long)session->serial.ring->dropped );
+			}
+			
+			Reply( client, "port%d.siofs_commands %u", i, session->siofs.queries );
+			Reply( client, "port%d.siofs_write_bytes %llu", i, session->siofs.write_bytes );
+			Reply( client, "port%d.siofs_write_calls %llu", i, (unsigned long long)session->siofs.write_calls );
+			Reply( client, "port%d.siofs_stream_packets %llu", i, session->siofs.stream_packets );
+			Reply( client, "port%d.siofs_stream_late %llu", i, session->siofs.stream_late );
+			Reply( client, "port%d.siofs_stream_late_max_us %u", i, session->siofs.stream_late_max );
+			Reply( client, "port%d.uploads %u", i, session->uploads );
+			Reply( client, "port%d.upload_errors %u", i, session->upload_errors );
+		}
+		
+		Reply( client, "OK" );
+		return 0;
+
+	}
+	else if( args[0] == "metrics" )
+	{
+		std::vector<std::string> lines;
+		
+		for( int i=0; i<sessions->size(); i++ )
+		{
+			lines.clear();
+			(*sessions)[i]->siofs.Metrics( lines );
+			
+			for( int j=0; j<lines.size(); j++ )
+			{
+				Reply( client, "port%d.%s", i, lines[j].c_str() );
+			}
+		}
+		
+		Reply( client, "OK" );
+		return 0;
+		
+	}
+	else if( args[0] == "attach" )
+	{
+		client->attached = true;
+		return 0;
+
+	}
+	else if( args[0] == "quit" )
+	{
+		Reply( client, "OK" );
+		return 1;
+
+	}
+	else
+	{
+		Reply( client, "ERROR Unknown command %s", args[0].c_str() );
+		return 0;
+	}
+
+	// Uploads end up here
+	printf( "---\n" );
+
+	if( ret < 0 )
+	{
+		Reply( client, "ERROR Upload failed" );
+		return 0;
+	}
+
+	Reply( client, "OK" );
+
+	return 0;
+
+} /* DaemonClass::Command */
+
+int DaemonClass::Upload( int type, const char* file, unsigned int addr )
+{
+	int ret = 0;
+
+	for( int i=0; i<sessions->size(); i++ )
+	{
+		if( (*sessions)[i]->Upload( type, file, addr ) < 0 )
+		{
+			ret = -1;
+		}
+	}
+
+	return ret;
+
+} /* DaemonClass::Upload */
+
+int DaemonClass::Poll()
+{
+#ifndef __WIN32__
+
+	std::vector<std::string> args;
+	char buff[256];
+	int quit = false;
+	int fd;
+
+	if( listen_fd < 0 )
+	{
+		return 0;
+	}
+
+	while( ( fd = accept4( listen_fd, nullptr, nullptr, SOCK_NONBLOCK|SOCK_CLOEXEC ) ) >= 0 )
+	{
+		CLIENT client;
+
+		client.fd = fd;
+		client.attached = false;
+		clients.push_back( client );
+	}
+
+	for( int i=0; i<clients.size(); )
+	{
+		CLIENT* client = &clients[i];
+		int done = false;
+		int len;
+
+		while( ( len = recv( client->fd, buff, sizeof(buff), 0 ) ) > 0 )
+		{
+			// Viewers type straight into the console
+			if( client->attached )
+			{
+				(*sessions)[0]->serial.Mark( SERIAL_LOG_SKIP );
+				(*sessions)[0]->serial.SendBytes( buff, len );
+				(*sessions)[0]->serial.Mark( SERIAL_LOG_RESUME );
+				continue;
+			}
+
+			client->line.append( buff, len );
+		}
+
+		if( len == 0 )
+		{
+			done = true;
+		}
+
+		size_t eol;
+		if( !done && !client->attached &&
+			( ( eol = client->line.find( '\n' ) ) != std::string::npos ) )
+		{
+			std::string line = client->line.substr( 0, eol );
+
+			if( !line.empty() && ( line[line.size()-1] == '\r' ) )
+				line.erase( line.size()-1 );
+
+			splitArgs( line, args );
+			quit |= Command( client, args );
+
+			// Everything but attach is one command per connection
+			done = !client->attached;
+		}
+
+		if( done )
+		{
+			close( client->fd );
+			clients.erase( clients.begin()+i );
+			continue;
+		}
+
+		i++;
+	}
+
+	return quit;
+
+#else
+
+	return 0;
+
+#endif
+
+} /* DaemonClass::Poll */
+
+void DaemonClass::Broadcast( const void* data, int len )
+{
+#ifndef __WIN32__
+
+	for( int i=0; i<clients.size(); i++ )
+	{
+		if( clients[i].attached )
+		{
+			send( clients[i].fd, data, len, MSG_NOSIGNAL|MSG_DONTWAIT );
+		}
+	}
+
+#endif
+
+} /* DaemonClass::Broadcast */
+
+#ifndef __WIN32__
+
+static volatile int ctl_quit;
+
+static void ctl_term( int signum )
+{
+	ctl_quit = 1;
+
+} /* ctl_term */
+
+#endif
+
+int daemonControl( const char* sock_path, int argc, char** argv )
+{
+#ifndef __WIN32__
+
+	struct sockaddr_un addr;
+	std::string line;
+	char buff[1024];
+	int len;
+
+	if( argc < 1 )
+	{
+		printf( "Missing daemon command.\n" );
+		return( EXIT_FAILURE );
+	}
+
+	int fd = socket( AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0 );
+
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	strncpy( addr.sun_path, sock_path, sizeof(addr.sun_path)-1 );
+
+	if( ( fd < 0 ) || ( connect( fd, (struct sockaddr*)&addr, sizeof(addr) ) < 0 ) )
+	{
+		printf( "ERROR: Unable to connect to daemon at %s.\n", sock_path );
+		if( fd >= 0 )
+			close( fd );
+		return( EXIT_FAILURE );
+	}
+
+	// The daemon does not share our working directory
+	for( int i=0; i<argc; i++ )
+	{
+		char* full = nullptr;
+
+		if( i == 1 )
+		{
+			full = realpath( argv[i], nullptr );
+		}
+
+		if( i > 0 )
+			line += '\t';
+
+		line += full ? full : argv[i];
+		free( full );
+	}
+	line += '\n';
+
+	send( fd, line.c_str(), line.size(), MSG_NOSIGNAL );
+
+	if( strcmp( argv[0], "attach" ) )
+	{
+		int ok = false;
+
+		while( ( len = recv( fd, buff, sizeof(buff)-1, 0 ) ) > 0 )
+		{
+			buff[len] = 0;
+			fwrite( buff, 1, len, stdout );
+			ok = ( strstr( buff, "OK\n" ) != nullptr );
+		}
+
+		close( fd );
+
+		return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	// Console viewer
+	struct sigaction st;
+	struct pollfd fds[2];
+
+	printf( "Attached to %s, press Ctrl+C to detach...\n---\n", sock_path );
+
+	ctl_quit = 0;
+	st.sa_handler = ctl_term;
+	sigemptyset( &st.sa_mask );
+	st.sa_flags = 0;
+	sigaction( SIGINT, &st, NULL );
+
+	enable_raw_mode();
+
+	fds[0].fd = 0;
+	fds[0].events = POLLIN;
+	fds[1].fd = fd;
+	fds[1].events = POLLIN;
+
+	while( !ctl_quit )
+	{
+		if( poll( fds, 2, -1 ) < 0 )
+			continue;
+
+		if( fds[0].revents & POLLIN )
+		{
+			if( ( len = read( 0, buff, sizeof(buff) ) ) > 0 )
+				send( fd, buff, len, MSG_NOSIGNAL );
+		}
+
+		if( fds[1].revents & (POLLIN|POLLHUP) )
+		{
+			if( ( len = recv( fd, buff, sizeof(buff), 0 ) ) <= 0 )
+				break;
+
+			fwrite( buff, 1, len, stdout );
+			fflush( stdout );
+		}
+	}
+
+	disable_raw_mode();
+	close( fd );
+
+	printf( "\nDetached.\n" );
+
+	return( EXIT_SUCCESS );
+
+#else
+
+	printf( "Daemon mode is not supported on this platform.\n" );
+	return( EXIT_FAILURE );
+
+#endif
+
+} /* daemonControl */
@@ -0,0 +1,67 @@
+#ifndef _DAEMON_H
+#define _DAEMON_H
+
+#include <string>
+#include <vector>
+#include "session.h"
+
+/* Control socket for daemon mode. Clients connect to a Unix socket and send
+ * one command per line, fields separated by tabs (or spaces if the line has
+ * no tabs):
+ *
+ *   run <file>          - Upload and execute a PS-EXE.
+ *   up <file> <addr>    - Upload a binary to a hex address.
+ *   patch <file>        - Upload a patch binary.
+ *   stats               - Query statistics of every port.
+ *   attach              - Turn the connection into a console viewer.
+ *   quit                - Shut down the daemon.
+ *
+ * Every command except attach is answered with any number of info lines
+ * followed by either "OK" or "ERROR <reason>", then the connection is
+ * closed. Uploads go to every port the daemon serves. An attached viewer
+ * receives everything the consoles print, bytes it sends are forwarded to
+ * the first port and closing the connection detaches it.
+ */
+
+class DaemonClass {
+public:
+	DaemonClass();
+	virtual ~DaemonClass();
+	
+	/* Listens on path, returns -2 if another daemon is already listening
+	 * there and -1 on other errors */
+	int Open(const char* path, std::vector<SessionClass*>* list);
+	void Close();
+	
+	/* Accepts clients and services pending commands, returns 1 if a client
+	 * asked the daemon to quit */
+	int Poll();
+	
+	/* Sends console output to all attached viewers */
+	void Broadcast(const void* data, int len);
+	
+	int listen_fd;
+	
+private:
+	
+	typedef struct {
+		int fd;
+		int attached;
+		std::string line;
+	} CLIENT;
+	
+	int Command(CLIENT* client, std::vector<std::string>& args);
+	int Upload(int type, const char* file, unsigned int addr);
+	void Reply(CLIENT* client, const char* fmt, ...);
+	
+	std::string		path;
+	std::vector<SessionClass*>* sessions;
+	std::vector<CLIENT>	clients;
+	
+	double			started;
+};
+
+std::string daemonSocketPath(const std::string& device);
+int daemonControl(const char* path, int argc, char** argv);
+
+#endif // _DAEMON_H
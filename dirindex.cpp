@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef __WIN32__
+#include <sys/inotify.h>
+#endif
+#include "dirindex.h"
+
+#define WATCH_EVENTS	(IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ATTRIB|\
+	IN_MODIFY|IN_CLOSE_WRITE|IN_DELETE_SELF|IN_MOVE_SELF)
+
+DirIndexClass::DirIndexClass(int max_dirs, int max_stats)
+{
+	this->max_dirs = max_dirs;
+	this->max_stats = max_stats;
+	hits = 0;
+	misses = 0;
+	
+#ifndef __WIN32__
+	fd = inotify_init1( IN_NONBLOCK|IN_CLOEXEC );
+#else
+	fd = -1;
+#endif
+	
+} /* DirIndexClass::DirIndexClass */
+
+DirIndexClass::~DirIndexClass()
+{
+	if( fd >= 0 )
+	{
+		close( fd );
+	}
+	
+} /* DirIndexClass::~DirIndexClass */
+
+void DirIndexClass::Drop(std::map<std::string, INDEX>::iterator it)
+{
+#ifndef __WIN32__
+	inotify_rm_watch( fd, it->second.wd );
+#endif
+	watches.erase( it->second.wd );
+	lru.erase( it->second.lru );
+	dirs.erase( it );
+	
+} /* DirIndexClass::Drop */
+
+void DirIndexClass::Poll()
+{
+#ifndef __WIN32__
+	
+	char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int len;
+	
+	while( ( len = read( fd, buff, sizeof(buff) ) ) > 0 )
+	{
+		for( char* p = buff; p < buff+len; )
+		{
+			struct inotify_event* ev = (struct inotify_event*)p;
+			
+			// Events were lost, any directory may have changed
+			if( ev->mask & IN_Q_OVERFLOW )
+			{
+				while( !dirs.empty() )
+				{
+					Drop( dirs.begin() );
+				}
+			}
+			
+			auto w = watches.find( ev->wd );
+			
+			// Anything happening in a directory voids all its listings
+			if( w != watches.end() )
+			{
+				auto it = dirs.find( w->second );
+				
+				if( it != dirs.end() )
+				{
+					Drop( it );
+				}
+			}
+			
+			p += sizeof(struct inotify_event)+ev->len;
+		}
+	}
+	
+#endif
+	
+} /* DirIndexClass::Poll */
+
+DirIndexClass::Records DirIndexClass::Get(const std::string& dir,
+	const std::string& pattern)
+{
+	if( fd < 0 )
+	{
+		return Records();
+	}
+	
+	std::lock_guard<std::mutex> guard( lock );
+	
+	Poll();
+	
+	auto it = dirs.find( dir );
+	
+	if( it != dirs.end() )
+	{
+		auto l = it->second.lists.find( pattern );
+		
+		if( l != it->second.lists.end() )
+		{
+			lru.splice( lru.begin(), lru, it->second.lru );
+			hits++;
+			return l->second;
+		}
+	}
+	
+	misses++;
+	
+	// Watch from now on so changes made while the caller lists the
+	// directory are not missed
+	Watch( dir );
+	
+	return Records();
+	
+} /* DirIndexClass::Get */
+
+std::map<std::string, DirIndexClass::INDEX>::iterator DirIndexClass::Watch(
+	const std::string& dir)
+{
+	auto it = dirs.find( dir );
+	
+	if( it != dirs.end() )
+	{
+		return it;
+	}
+	
+#ifndef __WIN32__
+	
+	INDEX index;
+	
+	index.wd = inotify_add_watch( fd, dir.c_str(), WATCH_EVENTS );
+	
+	if( index.wd < 0 )
+	{
+		return dirs.end();
+	}
+	
+	// Two paths to the same directory share a watch descriptor
+	auto w = watches.find( index.wd );
+	if( w != watches.end() )
+	{
+		auto old = dirs.find( w->second );
+		if( old != dirs.end() )
+		{
+			watches.erase( w );
+			lru.erase( old->second.lru );
+			dirs.erase( old );
+		}
+	}
+	
+	lru.push_front( dir );
+	index.lru = lru.begin();
+	it = dirs.insert( std::make_pair( dir, index ) ).first;
+	watches[index.wd] = dir;
+	
+	while( dirs.size() > max_dirs )
+	{
+		Drop( dirs.find( lru.back() ) );
+	}
+	
+#endif
+	
+	return it;
+	
+} /* DirIndexClass::Watch */
+
+void DirIndexClass::Put(const std::string& dir, const std::string& pattern,
+	Records records)
+{
+	if( fd < 0 )
+	{
+		return;
+	}
+	
+	std::lock_guard<std::mutex> guard( lock );
+	
+	// Gone if the directory changed since Get() came up empty
+	Poll();
+	
+	auto it = dirs.find( dir );
+	
+	if( it != dirs.end() )
+	{
+		it->second.lists[pattern] = records;
+	}
+	
+} /* DirIndexClass::Put */
+
+int DirIndexClass::GetStat(const std::string& dir, const std::string& name,
+	struct stat* attr)
+{
+	if( fd < 0 )
+	{
+		return STAT_MISS;
+	}
+	
+	std::lock_guard<std::mutex> guard( lock );
+	
+	Poll();
+	
+	auto it = dirs.find( dir );
+	
+	if( it != dirs.end() )
+	{
+		auto s = it->second.stats.find( name );
+		
+		if( s != it->second.stats.end() )
+		{
+			lru.splice( lru.begin(), lru, it->second.lru );
+			hits++;
+			
+			if( s->second.st_mode == 0 )
+			{
+				return STAT_NOTFOUND;
+			}
+			
+			*attr = s->second;
+			return STAT_FOUND;
+		}
+	}
+	
+	misses++;
+	
+	Watch( dir );
+	
+	return STAT_MISS;
+	
+} /* DirIndexClass::GetStat */
+
+void DirIndexClass::PutStat(const std::string& dir, const std::string& name,
+	const struct stat* attr)
+{
+	struct stat missing;
+	
+	if( fd < 0 )
+	{
+		return;
+	}
+	
+	std::lock_guard<std::mutex> guard( lock );
+	
+	Poll();
+	
+	auto it = dirs.find( dir );
+	
+	if( it == dirs.end() )
+	{
+		return;
+	}
+	
+	if( attr && S_ISDIR( attr->st_mode ) )
+	{
+		it->second.stats.erase( name );
+		return;
+	}
+	
+	// Someone probing a huge directory file by file, start over
+	if( it->second.stats.size() >= max_stats )
+	{
+		it->second.stats.clear();
+	}
+	
+	if( attr == nullptr )
+	{
+		memset( &missing, 0x0, sizeof(missing) );
+		attr = &missing;
+	}
+	
+	it->second.stats[name] = *attr;
+	
+} /* DirIndexClass::PutStat */
+
+DirIndexClass::Names DirIndexClass::GetNames(const std::string& dir)
+{
+	if( fd < 0 )
+	{
+		return Names();
+	}
+	
+	std::lock_guard<std::mutex> guard( lock );
+	
+	Poll();
+	
+	auto it = dirs.find( dir );
+	
+	if( ( it != dirs.end() ) && it->second.names )
+	{
+		lru.splice( lru.begin(), lru, it->second.lru );
+		hits++;
+		return it->second.names;
+	}
+	
+	misses++;
+	
+	Watch( dir );
+	
+	return Names();
+	
+} /* DirIndexClass::GetNames */
+
+void DirIndexClass::PutNames(const std::string& dir, Names names)
+{
+	if( fd < 0 )
+	{
+		return;
+	}
+	
+	std::lock_guard<std::mutex> guard( lock );
+	
+	Poll();
+	
+	auto it = dirs.find( dir );
+	
+	if( it != dirs.end() )
+	{
+		it->second.names = names;
+	}
+	
+} /* DirIndexClass::PutNames */
+
+void DirIndexClass::Invalidate(const std::string& dir)
+{
+	std::lock_guard<std::mutex> guard( lock );
+	
+	auto it = dirs.find( dir );
+	
+	if( it != dirs.end() )
+	{
+		Drop( it );
+	}
+	
+} /* DirIndexClass::Invalidate */
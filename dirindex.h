@@ -0,0 +1,101 @@
+#ifndef _DIRINDEX_H
+#define _DIRINDEX_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <sys/stat.h>
+#include "taskpool.h"
+
+/* Cache of prebuilt directory listings shared by all sessions. A listing
+ * is an array of fixed size records for one directory and wildcard, kept
+ * until inotify reports a change in that directory. Without inotify (Win32
+ * or when it cannot be initialized) nothing is cached.
+ *
+ * Records start out with only what readdir() gave away, the file
+ * attributes are filled in by whoever first sends a record and flagged in
+ * ready[], so hold the list's lock while touching either.
+ *
+ * The attributes of single files looked up by ~FST and ~FSM are kept the
+ * same way, under their parent directory, missing files included. Those
+ * of directories are not kept, their mtime changes with every entry made,
+ * removed or renamed inside them, which the parent's watch does not see.
+ *
+ * For case insensitive lookups the names in a directory can be kept too,
+ * folded to lower case and mapped to how they are actually spelled. */
+
+class DirIndexClass {
+public:
+	
+	struct List {
+		std::vector<char>	records;
+		std::vector<char>	ready;
+		std::mutex			lock;
+	};
+	
+	typedef std::shared_ptr<List> Records;
+	typedef std::shared_ptr<const std::unordered_map<std::string, std::string> > Names;
+	
+	DirIndexClass(int max_dirs = 64, int max_stats = 4096);
+	virtual ~DirIndexClass();
+	
+	/* Returns the cached listing of dir for pattern if still valid. A
+	 * miss starts watching dir, Put() only keeps what it is given if
+	 * nothing changed in between. */
+	Records Get(const std::string& dir, const std::string& pattern);
+	
+	/* Stores a freshly built listing */
+	void Put(const std::string& dir, const std::string& pattern, Records records);
+	
+	/* Cached attributes of name in dir, STAT_MISS if not known */
+	int GetStat(const std::string& dir, const std::string& name, struct stat* attr);
+	
+	/* Stores the attributes of name in dir, nullptr if it does not exist */
+	void PutStat(const std::string& dir, const std::string& name, const struct stat* attr);
+	
+	/* Folded names of dir, same rules as Get() and Put() */
+	Names GetNames(const std::string& dir);
+	void PutNames(const std::string& dir, Names names);
+	
+	void Invalidate(const std::string& dir);
+	
+	enum {
+		STAT_MISS,
+		STAT_FOUND,
+		STAT_NOTFOUND
+	};
+	
+	unsigned int	hits;
+	unsigned int	misses;
+	
+	/* For stating cold pages in parallel */
+	TaskPoolClass	pool;
+	
+private:
+	
+	typedef struct {
+		int wd;
+		std::map<std::string, Records> lists;
+		std::map<std::string, struct stat> stats;	// st_mode 0 if missing
+		Names names;
+		std::list<std::string>::iterator lru;
+	} INDEX;
+	
+	void Poll();
+	std::map<std::string, INDEX>::iterator Watch(const std::string& dir);
+	void Drop(std::map<std::string, INDEX>::iterator it);
+	
+	std::mutex		lock;
+	int				fd;
+	int				max_dirs;
+	int				max_stats;
+	std::map<std::string, INDEX> dirs;
+	std::map<int, std::string> watches;
+	std::list<std::string> lru;
+};
+
+#endif // _DIRINDEX_H
@@ -0,0 +1,148 @@
+#include <string.h>
+#include "hexdump.h"
+
+/* Both digits of every byte value, two characters per entry */
+static const char hexPairs[] =
+	"000102030405060708090a0b0c0d0e0f"
+	"101112131415161718191a1b1c1d1e1f"
+	"202122232425262728292a2b2c2d2e2f"
+	"303132333435363738393a3b3c3d3e3f"
+	"404142434445464748494a4b4c4d4e4f"
+	"505152535455565758595a5b5c5d5e5f"
+	"606162636465666768696a6b6c6d6e6f"
+	"707172737475767778797a7b7c7d7e7f"
+	"808182838485868788898a8b8c8d8e8f"
+	"909192939495969798999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+	"b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+	"d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+	"f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+/* Longest -hexdump line: 16 digits of offset and a space, 16 bytes at a
+ * space and two digits each, one more space in the middle and two before
+ * the ASCII column, which is between bars, and the newline */
+#define DUMP_LINE	( 16+1+16*3+1+2+1+16+1+1 )
+
+static inline char* putHex(char* out, unsigned char val)
+{
+	memcpy( out, hexPairs+val*2, 2 );
+	return out+2;
+	
+} /* putHex */
+
+int hexSize(int len)
+{
+	int list = len*3+( len/4 )+4;
+	int dump = ( ( len+15 )/16 )*DUMP_LINE;
+	
+	return( ( list > dump ) ? list : dump );
+	
+} /* hexSize */
+
+static int formatList(char* out, const unsigned char* data, int len)
+{
+	char* p = out;
+	int i = 0;
+	
+	// Whole lines of four without looking at the count in between
+	for( ; i+4 <= len; i+=4 )
+	{
+		p = putHex( p, data[i] );
+		*p++ = ',';
+		p = putHex( p, data[i+1] );
+		*p++ = ',';
+		p = putHex( p, data[i+2] );
+		*p++ = ',';
+		p = putHex( p, data[i+3] );
+		*p++ = ',';
+		*p++ = '\n';
+	}
+	
+	for( ; i<len; i++ )
+	{
+		p = putHex( p, data[i] );
+		*p++ = ',';
+	}
+	
+	memcpy( p, "\n--\n", 4 );
+	p += 4;
+	
+	return p-out;
+	
+} /* formatList */
+
+static int formatDump(char* out, const unsigned char* data, int len,
+	unsigned long long offset)
+{
+	char* p = out;
+	
+	for( int i=0; i<len; i+=16 )
+	{
+		int count = ( len-i < 16 ) ? len-i : 16;
+		unsigned long long pos = offset+i;
+		int digits = 8;
+		
+		// Eight digits of offset like hexdump -C, more once past 4GB
+		while( ( digits < 16 ) && ( pos>>( digits*4 ) ) )
+		{
+			digits += 2;
+		}
+		
+		for( int d=digits-2; d>=0; d-=2 )
+		{
+			p = putHex( p, ( pos>>( d*4 ) )&0xff );
+		}
+		
+		*p++ = ' ';
+		
+		for( int j=0; j<16; j++ )
+		{
+			if( j == 8 )
+			{
+				*p++ = ' ';
+			}
+			
+			*p++ = ' ';
+			
+			if( j < count )
+			{
+				p = putHex( p, data[i+j] );
+			}
+			else
+			{
+				*p++ = ' ';
+				*p++ = ' ';
+			}
+		}
+		
+		*p++ = ' ';
+		*p++ = ' ';
+		*p++ = '|';
+		
+		for( int j=0; j<count; j++ )
+		{
+			unsigned char c = data[i+j];
+			*p++ = ( ( c >= 0x20 ) && ( c < 0x7f ) ) ? c : '.';
+		}
+		
+		*p++ = '|';
+		*p++ = '\n';
+	}
+	
+	return p-out;
+	
+} /* formatDump */
+
+int hexFormat(int layout, char* out, const void* data, int len,
+	unsigned long long offset)
+{
+	if( layout == HEX_DUMP )
+	{
+		return formatDump( out, (const unsigned char*)data, len, offset );
+	}
+	
+	return formatList( out, (const unsigned char*)data, len );
+	
+} /* hexFormat */
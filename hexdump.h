@@ -0,0 +1,20 @@
+#ifndef _HEXDUMP_H
+#define _HEXDUMP_H
+
+/* Formats received bytes for -hex and -hexdump. Both work on a whole
+ * chunk at a time into a buffer of at least hexSize() bytes, so printing a
+ * chunk costs one write no matter how long it is. */
+
+#define HEX_LIST	1	// -hex: "xx," four to a line, "--" after each chunk
+#define HEX_DUMP	2	// -hexdump: offset, 16 bytes and their ASCII per line
+
+/* Largest output for len bytes in either layout */
+int hexSize(int len);
+
+/* Format len bytes in the given layout, returns the output length. For
+ * HEX_DUMP offset is where data starts in the stream, each chunk starts
+ * a line of its own. */
+int hexFormat(int layout, char* out, const void* data, int len,
+	unsigned long long offset);
+
+#endif // _HEXDUMP_H
@@ -0,0 +1,81 @@
+/* Reference MLZ decoder for LITELOAD.
+ *
+ * Decodes an MLZ stream as produced by mcomms' mlzCompress() (see
+ * compress.h for the format). Written to be dropped into the loader as is,
+ * no library calls and only byte accesses so unaligned destinations such as
+ * binary uploads work fine on the R3000.
+ *
+ * Returns the number of bytes decoded or -1 if the stream is corrupt.
+ */
+
+#include "unmlz.h"
+
+#define MLZ_MIN_MATCH	4
+
+int unmlz(const unsigned char *src, int src_size,
+	unsigned char *dst, int dst_size) {
+	
+	const unsigned char *ip = src;
+	const unsigned char *ip_end = src+src_size;
+	unsigned char *op = dst;
+	unsigned char *op_end = dst+dst_size;
+	const unsigned char *mp;
+	int token, len, c;
+	
+	while( op < op_end ) {
+		
+		if ( ip >= ip_end )
+			return -1;
+		
+		token = *ip++;
+		
+		/* literal run */
+		len = token>>4;
+		if ( len == 15 ) {
+			do {
+				if ( ip >= ip_end )
+					return -1;
+				c = *ip++;
+				len += c;
+			} while( c == 255 );
+		}
+		
+		if ( ( len > ip_end-ip ) || ( len > op_end-op ) )
+			return -1;
+		
+		while( len-- )
+			*op++ = *ip++;
+		
+		if ( op >= op_end )
+			break;
+		
+		/* match */
+		if ( ip+2 > ip_end )
+			return -1;
+		
+		mp = op-(ip[0]|(ip[1]<<8));
+		ip += 2;
+		
+		len = token&0xf;
+		if ( len == 15 ) {
+			do {
+				if ( ip >= ip_end )
+					return -1;
+				c = *ip++;
+				len += c;
+			} while( c == 255 );
+		}
+		len += MLZ_MIN_MATCH;
+		
+		if ( ( mp < dst ) || ( mp >= op ) || ( len > op_end-op ) )
+			return -1;
+		
+		/* byte copy, matches may overlap the output */
+		while( len-- )
+			*op++ = *mp++;
+		
+	}
+	
+	return (int)(op-dst);
+	
+}
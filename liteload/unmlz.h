@@ -0,0 +1,7 @@
+#ifndef _UNMLZ_H
+#define _UNMLZ_H
+
+int unmlz(const unsigned char *src, int src_size,
+	unsigned char *dst, int dst_size);
+
+#endif /* _UNMLZ_H */
@@ -7,18 +7,34 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <malloc.h>
 #include <iostream>
 #include <iomanip>
 #include <vector>
+#include <thread>
 
 #include "serial.h"
 #include "upload.h"
 #include "siofs.h"
+#include "session.h"
+#include "assetcache.h"
+#include "pack.h"
+#include "watch.h"
+#include "daemon.h"
+#include "seriallog.h"
+#include "ring.h"
+#include "hexdump.h"
+#include "trace.h"
+#include "sigblock.h"
 
 #define VERSION "0.87"
 
+/* Console text waiting for the terminal */
+#define CONSOLE_RING_SIZE	(1024*1024)
+
 #ifdef __WIN32__
 #define SERIAL_DEFAULT "COM1"
 #else
@@ -26,6 +42,7 @@
 #endif
 
 std::string serial_device = SERIAL_DEFAULT;
+std::vector<std::string> serial_devices;
 int serial_baud = 115200;
 
 std::string psexe_file;
@@ -34,15 +51,294 @@ std::string pat_file;
 unsigned int bin_addr;
 
 int old_protocol = false;
+int compress_upload = false;
+int delta_upload = false;
 int terminal_mode = false;
 int no_console = false;
 int hex_mode = false;
+int watch_mode = false;
+int daemon_mode = false;
+std::string sock_path;
+std::string jail_path;
+int write_behind = false;
+int siofs_metrics = false;
+std::string record_file;
+std::string replay_file;
+int replay_fast = false;
 extern int fs_messages;
+extern int fs_sync;
 
 int do_quit;
+volatile int do_metrics;
+
+AssetCacheClass	assets;
+DirIndexClass	dirindex;
+PackClass		packs;
+WriteBehindClass writer;
+std::vector<SessionClass*> sessions;
+WatchClass		watch;
+DaemonClass		control;
+RingClass		console( CONSOLE_RING_SIZE );
+std::thread		console_writer;
+std::atomic<int>	console_stop;
+FILE*			console_stdout;
+
+void closeSessions()
+{
+	for( int i=0; i<sessions.size(); i++ )
+	{
+		sessions[i]->Close();
+	}
+	
+} /* closeSessions */
+
+void dumpMetrics()
+{
+	std::vector<std::string> lines;
+	
+	printf( "\n---\nSIOFS metrics:\n" );
+	
+	for( int i=0; i<sessions.size(); i++ )
+	{
+		lines.clear();
+		sessions[i]->siofs.Metrics( lines );
+		
+		for( int j=0; j<lines.size(); j++ )
+		{
+			printf( "port%d.%s\n", i, lines[j].c_str() );
+		}
+	}
+	
+	printf( "---\n" );
+	
+} /* dumpMetrics */
+
+void ringReport( int always )
+{
+	for( int i=0; i<sessions.size(); i++ )
+	{
+		RingClass* ring = sessions[i]->serial.ring;
+		
+		if( ring && ( always || ring->dropped ) )
+		{
+			printf( "%s: receive ring high-water %d of %d bytes, %llu dropped.\n",
+				sessions[i]->serial.device.c_str(), (int)ring->high_water,
+				ring->Size(), (unsigned long long)ring->dropped );
+		}
+	}
+	
+	if( always || console.dropped )
+	{
+		printf( "Console ring high-water %d of %d bytes, %llu dropped.\n",
+			(int)console.high_water, console.Size(),
+			(unsigned long long)console.dropped );
+	}
+	
+} /* ringReport */
 
-SerialClass		serial;
-SiofsClass		siofs;	
+int replayReport( SessionClass* session )
+{
+	SerialReplayClass* replay = session->serial.replay;
+	
+	printf( "Replay of %s:\n", session->serial.device.c_str() );
+	printf( "  %llu bytes compared, %llu differ\n", replay->checked, replay->differ );
+	printf( "  %llu bytes missing, %llu extra, %llu skipped (uploads and keys)\n",
+		replay->missing, replay->extra, replay->skipped );
+	
+	if( replay->first_diff < 0 )
+	{
+		printf( "Replies match the log.\n" );
+		return( EXIT_SUCCESS );
+	}
+	
+	printf( "First difference %.6f seconds into the log.\n", replay->first_diff/1e6 );
+	
+	return( EXIT_FAILURE );
+	
+} /* replayReport */
+
+int uploadSessions( int type, const char* file, unsigned int addr )
+{
+	int ret = 0;
+	
+	for( int i=0; i<sessions.size(); i++ )
+	{
+		if( sessions.size() > 1 )
+		{
+			printf( "%s:\n", sessions[i]->serial.device.c_str() );
+		}
+		
+		if( sessions[i]->Upload( type, file, addr ) < 0 )
+		{
+			ret = -1;
+		}
+	}
+	
+	return ret;
+	
+} /* uploadSessions */
+
+void consoleWrite( const char* data, int len )
+{
+#ifndef __WIN32__
+	// A slow terminal only holds up the writer thread
+	if( console_writer.joinable() )
+	{
+		console.Write( data, len );
+		return;
+	}
+#endif
+	
+	fwrite( data, 1, len, stdout );
+	fflush( stdout );
+	
+} /* consoleWrite */
+
+#ifndef __WIN32__
+
+void consoleWriter()
+{
+	char buff[16384];
+	
+	while( 1 )
+	{
+		int stopping = console_stop;
+		int len = console.Read( buff, sizeof(buff) );
+		
+		if( len == 0 )
+		{
+			if( stopping )
+				break;
+			
+			console.Wait( 100 );
+			continue;
+		}
+		
+		for( int done=0; done<len; )
+		{
+			int n = write( 1, buff+done, len-done );
+			
+			if( n <= 0 )
+			{
+				if( ( n < 0 ) && ( errno == EINTR ) )
+					continue;
+				break;
+			}
+			
+			done += n;
+		}
+	}
+	
+} /* consoleWriter */
+
+static ssize_t consoleCookieWrite( void* cookie, const char* data, size_t len )
+{
+	consoleWrite( data, len );
+	
+	return len;
+	
+} /* consoleCookieWrite */
+
+void consoleStart()
+{
+	cookie_io_functions_t funcs = { nullptr, consoleCookieWrite, nullptr, nullptr };
+	
+	fflush( stdout );
+	
+	console_stop = false;
+	
+	{
+		SignalBlockClass block;
+		console_writer = std::thread( consoleWriter );
+	}
+	
+	// Everything printed from here on queues up behind received text, a
+	// line at a time
+	FILE* fp = fopencookie( nullptr, "w", funcs );
+	
+	if( fp )
+	{
+		setvbuf( fp, NULL, _IOLBF, BUFSIZ );
+		console_stdout = stdout;
+		stdout = fp;
+	}
+	
+} /* consoleStart */
+
+void consoleStop()
+{
+	if( console_stdout )
+	{
+		FILE* fp = stdout;
+		
+		stdout = console_stdout;
+		console_stdout = nullptr;
+		fclose( fp );
+	}
+	
+	console_stop = true;
+	console_writer.join();
+	
+} /* consoleStop */
+
+#endif
+
+void printConsole( SessionClass* session, char* buffer, int len )
+{
+	std::string out;
+	
+	// Tag output with the port it came from when serving several
+	if( ( sessions.size() > 1 ) && !hex_mode )
+	{
+		int start = 0;
+		
+		for( int i=0; i<len; i++ )
+		{
+			if( session->line_start )
+			{
+				out += "[" + session->serial.device + "] ";
+				session->line_start = false;
+			}
+			
+			if( buffer[i] == '\n' )
+			{
+				out.append( buffer+start, (i+1)-start );
+				start = i+1;
+				session->line_start = true;
+			}
+		}
+		
+		out.append( buffer+start, len-start );
+		consoleWrite( out.data(), out.size() );
+		return;
+	}
+	
+	if ( !hex_mode )
+	{
+		consoleWrite( buffer, len );
+	}
+	else
+	{
+		static std::vector<char> hex;
+		std::string tag;
+		
+		if( sessions.size() > 1 )
+		{
+			tag = "[" + session->serial.device + "]\n";
+		}
+		
+		// The whole chunk in one go, tag included
+		hex.resize( tag.size()+hexSize( len ) );
+		memcpy( hex.data(), tag.data(), tag.size() );
+		
+		int size = tag.size()+hexFormat( hex_mode, hex.data()+tag.size(),
+			buffer, len, session->hex_offset );
+		
+		session->hex_offset += len;
+		consoleWrite( hex.data(), size );
+	}
+	
+} /* printConsole */
 
 #ifndef __WIN32__
 
@@ -79,17 +375,29 @@ void term_func(int signum)
 {
 	if( do_quit )
 	{
-		printf("Ok, I will kill myself.\n");
-		disable_raw_mode();
-		exit( 0 );
+		// Straight to the terminal, the console writer may never get to
+		// anything queued from here on
+		static const char msg[] = "Ok, I will kill myself.\n";
+		ssize_t ret = write( STDOUT_FILENO, msg, sizeof(msg)-1 );
+		(void)ret;
+		if( !daemon_mode )
+			disable_raw_mode();
+		// Not through exit(), the console writer may still be running
+		_exit( 0 );
 	}
 	printf("Catching SIGINT...\n");
-	serial.ClosePort();
+	closeSessions();
 	
 	do_quit = 1;
 	
 } /* term_func */
 
+void metrics_func(int signum)
+{
+	do_metrics = 1;
+	
+} /* metrics_func */
+
 #else
 
 BOOL WINAPI term_func(DWORD dwCtrlType)
@@ -101,7 +409,7 @@ BOOL WINAPI term_func(DWORD dwCtrlType)
 	}
 	
 	printf("Catching Ctrl+C...\n");
-	serial.ClosePort();
+	closeSessions();
 	
 	putchar('\n');
 	do_quit = 1;
@@ -117,6 +425,7 @@ int main( int argc, char** argv )
 	
 	int quit = false;
 	int hshake = false;
+	int ctl_arg = 0;
 	
 	printf( "MCOMMS " VERSION " for LITELOAD and n00bROM by Lameguy64 (SIOFS Revision %d.%d)\n",
 		SIOFS_MAJOR, SIOFS_MINOR );
@@ -129,18 +438,46 @@ int main( int argc, char** argv )
 		{
 			printf( "Usage:\n" );
 			printf( "  mcomms [-dev <device>] [-baud <rate>] [-dir <path>] [-term] [-fsmsg]\n" );
-			printf( "  [up <file> <addr>] [run <exefile>]\n\n" );
+			printf( "  [up <file> <addr>] [run <exefile>]\n" );
+			printf( "  mcomms [-dev <device>] [-sock <path>] -ctl <command>\n\n" );
 
 			printf( "    -dev <device> - Specify serial port device (default: " SERIAL_DEFAULT ").\n" );
+			printf( "                    Can be given several times to serve multiple consoles.\n" );
 			printf( "    -baud <rate>  - Specify serial console baud rate (default: 115200).\n" );
 			printf( "                    Note: PS-EXE and binary uploads still use 115200 baud.\n" );
 			printf( "    -dir <path>   - Specify initial directory for SIOFS.\n" );
+			printf( "    -jail <path>  - Keep SIOFS from accessing anything outside of path.\n" );
+			printf( "    -pack <file>  - Serve the files in a pack (ZIP or MCPK) over the SIOFS\n" );
+			printf( "                    directories, can be given several times.\n" );
+			printf( "    -cd <image>   - Serve the files on a CD image (.iso, .bin or .cue) the\n" );
+			printf( "                    same way and its sectors through ~FCR.\n" );
+			printf( "    -wb           - Acknowledge SIOFS writes before they hit the disk.\n" );
+			printf( "    -sync <mode>  - When SIOFS writes are synced to disk: none (default),\n" );
+			printf( "                    close or write.\n" );
 			//printf( "    -term         - Enable terminal mode (forward keystrokes to serial).\n" );
 			printf( "    -hex          - Output received bytes in hex.\n" );
+			printf( "    -hexdump      - Same with offsets and ASCII, like hexdump -C.\n" );
 			printf( "    -fsmsg        - Output SIOFS messages.\n" );
+			printf( "    -metrics      - Keep per command SIOFS metrics, printed on exit and\n" );
+			printf( "                    on SIGUSR1.\n" );
+			printf( "    -record <file> - Log all serial traffic of the first port to file.\n" );
+			printf( "    -replay <file> - Serve SIOFS to a logged session instead of a port and\n" );
+			printf( "                    check the replies against the log.\n" );
+			printf( "    -fast         - Replay as fast as possible instead of in real time.\n" );
 			printf( "    -nocons       - Upload only, no console mode.\n" );
+			printf( "    -watch        - Re-upload the PS-EXE given to run whenever it is rebuilt\n" );
+			printf( "                    (combine with -delta or -z for faster turnaround).\n" );
 			printf( "    -hshake       - Enable serial flow control, DTR and RTS always set otherwise.\n" );
-			printf( "    -old          - Use old LITELOAD 1.0 protocol.\n\n" );
+			printf( "    -daemon       - Keep running and accept commands on a control socket.\n" );
+			printf( "    -sock <path>  - Control socket path (default: /tmp/mcomms-<device>.sock).\n" );
+			printf( "    -ctl <cmd>    - Send a command to a running daemon, one of run <file>,\n" );
+			printf( "                    up <file> <addr>, patch <file>, attach, stats,\n" );
+			printf( "                    metrics or quit.\n" );
+			printf( "    -old          - Use old LITELOAD 1.0 protocol.\n" );
+			printf( "    -z            - Compress PS-EXE and binary uploads (MEXZ/MBNZ).\n" );
+			printf( "    -delta        - Only upload PS-EXE blocks that differ from the console.\n" );
+			printf( "    -trust        - Like -delta but trust the last upload to this device\n" );
+			printf( "                    instead of querying the console for block hashes.\n\n" );
 
 			printf( "  LITELOAD Commands (catflap inspired):\n" );
 			printf( "    up <file> <addr> - Upload a file to specified address.\n" );
@@ -152,6 +489,7 @@ int main( int argc, char** argv )
 			printf( "    MC_DEVICE - Serial device.\n" );
 			printf( "    MC_BAUD   - Baud rate.\n" );
 			printf( "    MC_HSHAKE - Hardware handshake (specify true or false).\n" );
+			printf( "    MC_CACHE  - Upload cache directory (default: ~/.cache/mcomms).\n" );
 
 			return( EXIT_SUCCESS );
 		}
@@ -189,7 +527,7 @@ int main( int argc, char** argv )
 				printf( "Missing device parameter.\n" );
 				return( EXIT_FAILURE );
 			}
-			serial_device = argv[i];	
+			serial_devices.push_back( argv[i] );
 		}
 		else if ( strcmp( "-baud", argv[i] ) == 0 )
 		{
@@ -218,22 +556,148 @@ int main( int argc, char** argv )
 				return( EXIT_FAILURE );
 			}
 		}
+		else if( strcmp( "-jail", argv[i] ) == 0 )
+		{
+			i++;
+			if( i >= argc )
+			{
+				printf( "Missing path parameter.\n" );
+				return( EXIT_FAILURE );
+			}
+			jail_path = argv[i];
+		}
+		else if( strcmp( "-pack", argv[i] ) == 0 )
+		{
+			i++;
+			if( i >= argc )
+			{
+				printf( "Missing pack file parameter.\n" );
+				return( EXIT_FAILURE );
+			}
+			
+			int skipped = packs.skipped;
+			int files = packs.Mount( argv[i] );
+			
+			if( files < 0 )
+			{
+				printf( "ERROR: Unable to mount pack %s.\n", argv[i] );
+				return( EXIT_FAILURE );
+			}
+			
+			printf( "Mounted %s, %d files.\n", argv[i], files );
+			
+			if( packs.skipped > skipped )
+			{
+				printf( "WARNING: %d compressed files in %s left out, only stored\n"
+					"         files can be served.\n", packs.skipped-skipped, argv[i] );
+			}
+		}
+		else if( strcmp( "-cd", argv[i] ) == 0 )
+		{
+			i++;
+			if( i >= argc )
+			{
+				printf( "Missing image file parameter.\n" );
+				return( EXIT_FAILURE );
+			}
+			
+			int files = packs.MountDisc( argv[i] );
+			
+			if( files < 0 )
+			{
+				printf( "ERROR: Unable to mount CD image %s.\n", argv[i] );
+				return( EXIT_FAILURE );
+			}
+			
+			printf( "Mounted %s, %d files.\n", argv[i], files );
+		}
+		else if( strcmp( "-wb", argv[i] ) == 0 )
+		{
+			write_behind = true;
+		}
+		else if( strcmp( "-sync", argv[i] ) == 0 )
+		{
+			i++;
+			if( i >= argc )
+			{
+				printf( "Missing sync mode parameter.\n" );
+				return( EXIT_FAILURE );
+			}
+			
+			if( strcmp( "none", argv[i] ) == 0 )
+			{
+				fs_sync = FS_SYNC_NONE;
+			}
+			else if( strcmp( "close", argv[i] ) == 0 )
+			{
+				fs_sync = FS_SYNC_CLOSE;
+			}
+			else if( strcmp( "write", argv[i] ) == 0 )
+			{
+				fs_sync = FS_SYNC_WRITE;
+			}
+			else
+			{
+				printf( "Unknown sync mode %s.\n", argv[i] );
+				return( EXIT_FAILURE );
+			}
+		}
 		else if( strcmp( "-term", argv[i] ) == 0 )
 		{
 			terminal_mode = true;
 		}
 		else if( strcmp( "-hex", argv[i] ) == 0 )
 		{
-			hex_mode = true;
+			hex_mode = HEX_LIST;
+		}
+		else if( strcmp( "-hexdump", argv[i] ) == 0 )
+		{
+			hex_mode = HEX_DUMP;
 		}
 		else if( strcmp( "-nocons", argv[i] ) == 0 )
 		{
 			no_console = true;
 		}
+		else if( strcmp( "-watch", argv[i] ) == 0 )
+		{
+			watch_mode = true;
+		}
+		else if( strcmp( "-daemon", argv[i] ) == 0 )
+		{
+			daemon_mode = true;
+		}
+		else if( strcmp( "-sock", argv[i] ) == 0 )
+		{
+			i++;
+			if( i >= argc )
+			{
+				printf( "Missing socket path parameter.\n" );
+				return( EXIT_FAILURE );
+			}
+			sock_path = argv[i];
+		}
+		else if( strcmp( "-ctl", argv[i] ) == 0 )
+		{
+			// Everything that follows is for the daemon
+			ctl_arg = i+1;
+			break;
+		}
 		else if( strcmp( "-old", argv[i] ) == 0 )
 		{
 			old_protocol = true;	
 		}
+		else if( strcmp( "-z", argv[i] ) == 0 )
+		{
+			compress_upload = true;
+		}
+		else if( strcmp( "-delta", argv[i] ) == 0 )
+		{
+			delta_upload = DELTA_QUERY;
+		}
+		else if( strcmp( "-trust", argv[i] ) == 0 )
+		{
+			delta_upload = DELTA_TRUST;
+		}
 		else if( strcmp( "-hshake", argv[i] ) == 0 )
 		{
 			hshake = true;
@@ -242,6 +706,31 @@ int main( int argc, char** argv )
 		{
 			fs_messages = true;
 		}
+		else if( strcmp( "-metrics", argv[i] ) == 0 )
+		{
+			siofs_metrics = true;
+		}
+		else if( ( strcmp( "-record", argv[i] ) == 0 ) ||
+			( strcmp( "-replay", argv[i] ) == 0 ) )
+		{
+			int record = ( strcmp( "-record", argv[i] ) == 0 );
+			
+			i++;
+			if( i >= argc )
+			{
+				printf( "Missing log file parameter.\n" );
+				return( EXIT_FAILURE );
+			}
+			
+			if( record )
+				record_file = argv[i];
+			else
+				replay_file = argv[i];
+		}
+		else if( strcmp( "-fast", argv[i] ) == 0 )
+		{
+			replay_fast = true;
+		}
 		else if( strcmp( "run", argv[i] ) == 0 )
 		{
 			i++;
@@ -291,21 +780,140 @@ int main( int argc, char** argv )
 		
 	}
 
+	if( !replay_file.empty() )
+	{
+		if( !psexe_file.empty() || !bin_file.empty() || !pat_file.empty() ||
+			daemon_mode || !record_file.empty() )
+		{
+			printf( "Replays only serve SIOFS, no uploads, daemon or recording.\n" );
+			return( EXIT_FAILURE );
+		}
+		
+		// Replays are there to time the host side
+		serial_devices.assign( 1, replay_file );
+		siofs_metrics = true;
+	}
+	else
+	{
+		replay_fast = false;
+	}
+	
+	if( serial_devices.empty() )
+	{
+		serial_devices.push_back( serial_device );
+	}
+	
+	if( sock_path.empty() )
+	{
+		sock_path = daemonSocketPath( serial_devices[0] );
+	}
+	
+	if( ctl_arg )
+	{
+		return daemonControl( sock_path.c_str(), argc-ctl_arg, argv+ctl_arg );
+	}
+	
+	if( watch_mode && psexe_file.empty() )
+	{
+		printf( "Watch mode requires an executable to run.\n" );
+		return( EXIT_FAILURE );
+	}
+
+	traceStart();
+	
+	// Open serial ports
+	for( int i=0; i<serial_devices.size(); i++ )
+	{
+		const char* device = serial_devices[i].c_str();
+		SessionClass* session = new SessionClass;
+		
+		if( !replay_file.empty() )
+		{
+			int records = session->serial.Replay( device, !replay_fast );
+			
+			if( records < 0 )
+			{
+				printf( "ERROR: Unable to read serial log %s.\n", device );
+				delete session;
+				return( EXIT_FAILURE );
+			}
+			
+			printf( "Replaying %s, %d records%s...\n", device, records,
+				replay_fast ? " as fast as possible" : "" );
+		}
+		else
+		{
 #ifdef __WIN32
-	printf( "Using %s...\n", serial_device.c_str() );
+			printf( "Using %s...\n", device );
 #else
-	printf( "Using serial device %s...\n", serial_device.c_str() );
+			printf( "Using serial device %s...\n", device );
 #endif
-
-	// Open serial port
-	switch( serial.OpenPort( serial_device.c_str(), serial_baud, hshake ) )
+			
+			switch( session->Open( device, serial_baud, hshake ) )
+			{
+			case SerialClass::ERROR_OPENING:
+				printf( "ERROR: Unable to open %s.\n", device );
+				delete session;
+				closeSessions();
+				return( EXIT_FAILURE );
+			case SerialClass::ERROR_CONFIG:
+				printf( "ERROR: Unable to configure %s.\n", device );
+				delete session;
+				closeSessions();
+				return( EXIT_FAILURE );
+			}
+			
+			// Keeps the port drained while SIOFS or the terminal is busy
+			session->serial.StartReader();
+		}
+		
+		session->siofs.SetCache( &assets );
+		session->siofs.SetIndex( &dirindex );
+		session->siofs.SetPack( &packs );
+		
+		if( siofs_metrics )
+		{
+			session->serial.timing = true;
+			session->siofs.EnableMetrics();
+		}
+		
+		if( write_behind )
+		{
+			session->siofs.SetWriter( &writer );
+		}
+		
+		sessions.push_back( session );
+		
+		if( !jail_path.empty() )
+		{
+			char workdir[256];
+			
+			if( session->siofs.SetRoot( jail_path.c_str() ) )
+			{
+				printf( "ERROR: Unable to use %s as jail root.\n", jail_path.c_str() );
+				closeSessions();
+				return( EXIT_FAILURE );
+			}
+			
+			// Starts at the jail root unless -dir points somewhere inside
+			if( getcwd( workdir, 256 ) )
+			{
+				session->siofs.SetDir( workdir );
+			}
+		}
+	}
+	
+	if( !record_file.empty() )
 	{
-	case SerialClass::ERROR_OPENING:
-		printf( "ERROR: Unable to open %s.\n", serial_device.c_str() );
-		return( EXIT_FAILURE );
-	case SerialClass::ERROR_CONFIG:
-		printf( "ERROR: Unable to configure %s.\n", serial_device.c_str() );
-		return( EXIT_FAILURE );
+		if( sessions[0]->serial.Record( record_file.c_str() ) < 0 )
+		{
+			printf( "ERROR: Unable to create serial log %s.\n", record_file.c_str() );
+			closeSessions();
+			return( EXIT_FAILURE );
+		}
+		
+		printf( "Recording %s to %s.\n", sessions[0]->serial.device.c_str(),
+			record_file.c_str() );
 	}
 	
 	// Upload patch data
@@ -313,15 +921,10 @@ int main( int argc, char** argv )
 	{
 		printf( "Uploading patch file...\n" );
 		
-		if( uploadBIN( pat_file.c_str(), 0, &serial, 1 ) < 0 )
-		{
-			serial.ClosePort();
-			return( EXIT_FAILURE );
-		}
+		int ret = uploadSessions( UPLOAD_PATCH, pat_file.c_str(), 0 );
+		closeSessions();
 		
-		serial.ClosePort();
-		
-		return( EXIT_SUCCESS );
+		return( ( ret < 0 ) ? EXIT_FAILURE : EXIT_SUCCESS );
 	}
 	
 	// Upload binary file if specified
@@ -329,14 +932,10 @@ int main( int argc, char** argv )
 	{
 		printf( "Uploading binary file...\n" );
 		
-		if( uploadBIN( bin_file.c_str(), bin_addr, &serial, 0 ) < 0 )
-		{
-			serial.ClosePort();
-			return( EXIT_FAILURE );
-		}
+		int ret = uploadSessions( UPLOAD_BIN, bin_file.c_str(), bin_addr );
+		closeSessions();
 		
-		serial.ClosePort();
-		return( EXIT_SUCCESS );
+		return( ( ret < 0 ) ? EXIT_FAILURE : EXIT_SUCCESS );
 	}
 	
 	// Upload executable if specified
@@ -344,19 +943,53 @@ int main( int argc, char** argv )
 	{
 		printf( "Uploading executable...\n" );
 		
-		if ( uploadEXE(psexe_file.c_str(), &serial) < 0 )
+		// Keep going in watch mode, the next build may fix things
+		if ( ( uploadSessions( UPLOAD_EXE, psexe_file.c_str(), 0 ) < 0 ) &&
+			!watch_mode )
 		{
-			serial.ClosePort();
+			closeSessions();
 			return( EXIT_FAILURE );
 		}
 	}
 	
-	if( no_console )
+	if( watch_mode )
+	{
+		if( watch.Open( psexe_file.c_str() ) < 0 )
+		{
+			printf( "ERROR: Unable to watch %s.\n", psexe_file.c_str() );
+			closeSessions();
+			return( EXIT_FAILURE );
+		}
+		
+		printf( "Watching %s for changes.\n", psexe_file.c_str() );
+	}
+	else if( no_console && !daemon_mode )
 	{
-		serial.ClosePort();
+		closeSessions();
 		return( EXIT_SUCCESS );
 	}
 	
+	if( daemon_mode )
+	{
+		int ret = control.Open( sock_path.c_str(), &sessions );
+		
+		if( ret == -2 )
+		{
+			printf( "ERROR: Another daemon is already using %s.\n", sock_path.c_str() );
+			closeSessions();
+			return( EXIT_FAILURE );
+		}
+		
+		if( ret < 0 )
+		{
+			printf( "ERROR: Unable to create control socket %s.\n", sock_path.c_str() );
+			closeSessions();
+			return( EXIT_FAILURE );
+		}
+		
+		printf( "Control socket at %s.\n", sock_path.c_str() );
+	}
+	
 	printf( "Listening at %d baud.\n", serial_baud );
 	printf( "Press Ctrl+C to quit...\n---\n" );
 	
@@ -367,8 +1000,16 @@ int main( int argc, char** argv )
 	sigemptyset( &st.sa_mask );
 	st.sa_flags = SA_RESTART;
 	sigaction( SIGINT, &st, NULL );
+	sigaction( SIGTERM, &st, NULL );
+	
+	st.sa_handler = metrics_func;
+	sigaction( SIGUSR1, &st, NULL );
 	
-	enable_raw_mode();
+	// A daemon gets its keystrokes from attached viewers instead
+	if( !daemon_mode )
+	{
+		enable_raw_mode();
+	}
 	
 #else
 
@@ -379,6 +1020,10 @@ int main( int argc, char** argv )
 	unsigned char keypress[4] = {0};
 	int keylen = 0;
 	
+#ifndef __WIN32__
+	consoleStart();
+#endif
+	
 	while( (!quit) && (!do_quit) )
 	{
 		char buffer[256];
@@ -393,74 +1038,111 @@ int main( int argc, char** argv )
 			keylen++;
 		}
 #else
-		if( _kbhit() )
+		if( !daemon_mode && _kbhit() )
 		{
 			if( read( 0, &keypress[keylen], 1 ) > 0 )
 				keylen++;
 		}
 #endif
 		
-		if( keylen > 0 )
+		// Keystrokes go to the first port
+		if( ( keylen > 0 ) && replay_file.empty() )
 		{
-			serial.SendBytes( keypress, keylen );
+			sessions[0]->serial.Mark( SERIAL_LOG_SKIP );
+			sessions[0]->serial.SendBytes( keypress, keylen );
+			sessions[0]->serial.Mark( SERIAL_LOG_RESUME );
 		}
 		
-		memset( buffer, 0, 256 );
+		// Re-upload executable once the linker is done with it
+		if( watch_mode && watch.Poll() )
+		{
+			printf( "\n---\n%s changed, uploading...\n", psexe_file.c_str() );
+			uploadSessions( UPLOAD_EXE, psexe_file.c_str(), 0 );
+			printf( "---\n" );
+		}
 		
-		if ( serial.PendingBytes() )
+		// Control socket requests are serviced between SIOFS commands
+		if( daemon_mode && control.Poll() )
 		{
-			int len = serial.ReceiveBytes( buffer, 256 );
+			quit = true;
+		}
+		
+		if( do_metrics )
+		{
+			do_metrics = 0;
+			dumpMetrics();
+			ringReport( true );
+		}
+		
+		for( int i=0; i<sessions.size(); i++ )
+		{
+			int len = sessions[i]->Service( buffer, 256 );
 			
 			if( len > 0 )
 			{
-				// if it contains a tilde, check if it is a SIOFS command
-				if( strchr( buffer, '~' ) )
+				if( daemon_mode )
 				{
-					if( siofs.Query( strchr( buffer, '~' ), &serial ) )
-					{
-						// if command was recognized, trim off the command
-						*strchr( buffer, '~' ) = 0x0;
-						len -= 4;
-					}
+					control.Broadcast( buffer, len );
 				}
-
+				
 				// output received text
-				if ( !hex_mode )
-				{
-					fwrite( buffer, 1, len, stdout );
-					fflush( stdout );
-				}
-				else
-				{
-					for( int i=0; i<len; i++ )
-					{
-						
-						int val = *((unsigned char*)&buffer[i]);
-						printf( "%02x,", val );
-						
-						if( (i%4) == 3 )
-						{
-							putchar( '\n' );
-						}
-						
-					}
-					printf( "\n--\n" );
-				}
+				printConsole( sessions[i], buffer, len );
 			}
 		}
 		
+		// Replays end with the log
+		if( !replay_file.empty() && sessions[0]->serial.replay->Done() )
+		{
+			quit = true;
+		}
+		
 #ifndef __WIN32__
-		usleep( 1000 );
+		// A lone port wakes the loop up as soon as something comes in
+		if( ( sessions.size() == 1 ) && sessions[0]->serial.ring )
+		{
+			sessions[0]->serial.ring->Wait( 1 );
+		}
+		else if( !replay_fast )
+		{
+			usleep( 1000 );
+		}
 #endif
 	
 	}
 
 #ifndef __WIN32__
-	disable_raw_mode();
+	if( !daemon_mode )
+	{
+		disable_raw_mode();
+	}
 #endif
 	
-	serial.ClosePort();
+	control.Close();
+	
+	if( console_writer.joinable() )
+	{
+		consoleStop();
+	}
+	
+	ringReport( false );
+	
+	if( siofs_metrics )
+	{
+		dumpMetrics();
+	}
+	
+	int ret = EXIT_SUCCESS;
+	
+	if( !replay_file.empty() )
+	{
+		ret = replayReport( sessions[0] );
+	}
+	
+	for( int i=0; i<sessions.size(); i++ )
+	{
+		delete sessions[i];
+	}
 	
-	return( EXIT_SUCCESS );
+	return( ret );
 	
 } /* main */
@@ -0,0 +1,758 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <strings.h>
+#include <ctype.h>
+#include <algorithm>
+#ifndef __WIN32__
+#include <sys/mman.h>
+#endif
+#include "pack.h"
+
+#define ZIP_EOCD_SIG	0x06054b50
+#define ZIP_CDIR_SIG	0x02014b50
+#define ZIP_FILE_SIG	0x04034b50
+
+#define ISO_SECTOR		2048
+#define ISO_RAW_SECTOR	2352
+#define ISO_MAX_DEPTH	32
+
+static const unsigned char cdSync[12] = {
+	0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00
+};
+
+static unsigned int get16( const unsigned char* p )
+{
+	return p[0]|(p[1]<<8);
+
+} /* get16 */
+
+static unsigned int get32( const unsigned char* p )
+{
+	return p[0]|(p[1]<<8)|(p[2]<<16)|((unsigned int)p[3]<<24);
+
+} /* get32 */
+
+static time_t dosTime( unsigned int date, unsigned int time )
+{
+	struct tm t;
+
+	memset( &t, 0, sizeof(t) );
+	t.tm_year	= (date>>9)+80;
+	t.tm_mon	= ((date>>5)&15)-1;
+	t.tm_mday	= date&31;
+	t.tm_hour	= time>>11;
+	t.tm_min	= (time>>5)&63;
+	t.tm_sec	= (time&31)*2;
+	t.tm_isdst	= -1;
+
+	return mktime( &t );
+
+} /* dosTime */
+
+static time_t isoTime( const unsigned char* p )
+{
+	struct tm t;
+
+	memset( &t, 0, sizeof(t) );
+	t.tm_year	= p[0];
+	t.tm_mon	= p[1]-1;
+	t.tm_mday	= p[2];
+	t.tm_hour	= p[3];
+	t.tm_min	= p[4];
+	t.tm_sec	= p[5];
+
+	// Recorded in local time with the offset from GMT in 15 minute units
+#ifdef __WIN32__
+	return _mkgmtime( &t )-((signed char)p[6])*15*60;
+#else
+	return timegm( &t )-((signed char)p[6])*15*60;
+#endif
+
+} /* isoTime */
+
+PackClass::PackClass()
+{
+	skipped = 0;
+
+} /* PackClass::PackClass */
+
+PackClass::~PackClass()
+{
+#ifndef __WIN32__
+	for( int i=0; i<maps.size(); i++ )
+	{
+		munmap( maps[i].first, maps[i].second );
+	}
+#endif
+
+} /* PackClass::~PackClass */
+
+const unsigned char* PackClass::Map( const char* file, size_t* size )
+{
+#ifndef __WIN32__
+
+	struct stat attr;
+	int fd = open( file, O_RDONLY|O_CLOEXEC );
+
+	if( fd < 0 )
+	{
+		return nullptr;
+	}
+
+	if( ( fstat( fd, &attr ) < 0 ) || !S_ISREG( attr.st_mode ) ||
+		( attr.st_size < 4 ) )
+	{
+		close( fd );
+		return nullptr;
+	}
+
+	// The mapping outlives the fd
+	void* map = mmap( nullptr, attr.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+
+	if( map == MAP_FAILED )
+	{
+		return nullptr;
+	}
+
+	*size = attr.st_size;
+
+	return (const unsigned char*)map;
+
+#else
+
+	return nullptr;
+
+#endif
+
+} /* PackClass::Map */
+
+int PackClass::Mount( const char* file )
+{
+	size_t size;
+	int ret;
+
+	const unsigned char* base = Map( file, &size );
+
+	if( base == nullptr )
+	{
+		return -1;
+	}
+
+	if( memcmp( base, "MCPK", 4 ) == 0 )
+	{
+		ret = ParseToc( base, size );
+	}
+	else
+	{
+		ret = ParseZip( base, size );
+	}
+
+#ifndef __WIN32__
+	if( ret < 0 )
+	{
+		munmap( (void*)base, size );
+		return -1;
+	}
+#endif
+
+	maps.push_back( std::make_pair( (void*)base, size ) );
+
+	return ret;
+
+} /* PackClass::Mount */
+
+int PackClass::MountDisc( const char* file )
+{
+	std::string image = file;
+	size_t size;
+
+	// A cue sheet only matters for the name of the image file
+	if( ( image.size() > 4 ) &&
+		( strcasecmp( image.c_str()+image.size()-4, ".cue" ) == 0 ) )
+	{
+		FILE* fp = fopen( file, "r" );
+		char line[512];
+		char name[512];
+
+		if( fp == nullptr )
+		{
+			return -1;
+		}
+
+		name[0] = 0;
+
+		while( fgets( line, sizeof(line), fp ) )
+		{
+			if( ( sscanf( line, " FILE \"%511[^\"]\"", name ) == 1 ) ||
+				( sscanf( line, " FILE %511s", name ) == 1 ) )
+			{
+				break;
+			}
+		}
+
+		fclose( fp );
+
+		if( name[0] == 0 )
+		{
+			return -1;
+		}
+
+		// Relative to the cue sheet
+		size_t sep = image.find_last_of( "/\\" );
+
+		if( ( name[0] == '/' ) || ( sep == std::string::npos ) )
+		{
+			image = name;
+		}
+		else
+		{
+			image = image.substr( 0, sep+1 )+name;
+		}
+	}
+
+	const unsigned char* base = Map( image.c_str(), &size );
+
+	if( base == nullptr )
+	{
+		return -1;
+	}
+
+	DISC disc;
+
+	disc.base = base;
+
+	// Raw images have a sync pattern at the start of every sector, the mode
+	// of the one with the volume descriptor says where the data starts
+	const unsigned char* pvd = base+16*ISO_RAW_SECTOR;
+
+	if( ( size >= 17*ISO_RAW_SECTOR ) && ( memcmp( pvd, cdSync, 12 ) == 0 ) )
+	{
+		disc.sector_size = ISO_RAW_SECTOR;
+		disc.data_offset = ( pvd[15] == 2 ) ? 24 : 16;
+	}
+	else
+	{
+		disc.sector_size = ISO_SECTOR;
+		disc.data_offset = 0;
+	}
+
+	disc.sectors = size/disc.sector_size;
+	discs.push_back( disc );
+
+	int ret = ParseIso( discs.size()-1 );
+
+	if( ret < 0 )
+	{
+		discs.pop_back();
+#ifndef __WIN32__
+		munmap( (void*)base, size );
+#endif
+		return -1;
+	}
+
+	maps.push_back( std::make_pair( (void*)base, size ) );
+
+	return ret;
+
+} /* PackClass::MountDisc */
+
+const unsigned char* PackClass::Sector( const DISC& disc, unsigned int lba )
+{
+	if( lba >= disc.sectors )
+	{
+		return nullptr;
+	}
+
+	return disc.base+(size_t)lba*disc.sector_size+disc.data_offset;
+
+} /* PackClass::Sector */
+
+int PackClass::ParseIso( int n )
+{
+	typedef struct {
+		std::string		path;
+		unsigned int	lba;
+		unsigned int	size;
+		int				depth;
+	} WALK;
+
+	const DISC& disc = discs[n];
+	const unsigned char* pvd = Sector( disc, 16 );
+
+	if( ( pvd == nullptr ) || ( pvd[0] != 1 ) || memcmp( pvd+1, "CD001", 5 ) )
+	{
+		return -1;
+	}
+
+	std::vector<WALK> stack;
+	std::vector<unsigned int> walked;
+	int files = 0;
+
+	WALK root = { "", get32( pvd+156+2 ), get32( pvd+156+10 ), 0 };
+	stack.push_back( root );
+
+	while( !stack.empty() )
+	{
+		WALK dir = stack.back();
+		stack.pop_back();
+
+		// Broken images can have directories pointing back up the tree
+		if( ( dir.depth > ISO_MAX_DEPTH ) || ( std::find( walked.begin(),
+			walked.end(), dir.lba ) != walked.end() ) )
+		{
+			continue;
+		}
+
+		walked.push_back( dir.lba );
+
+		for( unsigned int pos = 0; pos < dir.size; )
+		{
+			const unsigned char* sector = Sector( disc, dir.lba+pos/ISO_SECTOR );
+
+			if( sector == nullptr )
+			{
+				break;
+			}
+
+			const unsigned char* rec = sector+(pos%ISO_SECTOR);
+			int len = rec[0];
+
+			// Records never cross sectors, the rest of this one is padding
+			if( len == 0 )
+			{
+				pos = (pos/ISO_SECTOR+1)*ISO_SECTOR;
+				continue;
+			}
+
+			if( ( len < 34 ) || ( (pos%ISO_SECTOR)+len > ISO_SECTOR ) ||
+				( 33+rec[32] > len ) )
+			{
+				break;
+			}
+
+			pos += len;
+
+			// Skip the . and .. entries
+			if( ( rec[32] == 1 ) && ( rec[33] <= 1 ) )
+			{
+				continue;
+			}
+
+			std::string name( (const char*)rec+33, rec[32] );
+
+			// Version suffix and the dot of names without an extension
+			size_t semi = name.find( ';' );
+
+			if( semi != std::string::npos )
+			{
+				name.erase( semi );
+			}
+
+			if( !name.empty() && ( name[name.size()-1] == '.' ) )
+			{
+				name.erase( name.size()-1 );
+			}
+
+			if( name.empty() )
+			{
+				continue;
+			}
+
+			ENTRY entry;
+
+			entry.data	= nullptr;
+			entry.lba	= get32( rec+2 );
+			entry.size	= get32( rec+10 );
+			entry.mtime	= isoTime( rec+18 );
+			entry.dir	= ( rec[25]&2 ) != 0;
+			entry.disc	= n;
+
+			std::string full = dir.path.empty() ? name : dir.path+"/"+name;
+
+			if( entry.dir )
+			{
+				WALK sub = { full, entry.lba, entry.size, dir.depth+1 };
+				stack.push_back( sub );
+				entry.size = 0;
+			}
+			else
+			{
+				if( (unsigned long long)entry.lba+
+					((unsigned long long)entry.size+ISO_SECTOR-1)/ISO_SECTOR > disc.sectors )
+				{
+					continue;
+				}
+
+				// Plain images hold files in one piece
+				if( ( disc.sector_size == ISO_SECTOR ) || ( entry.size == 0 ) )
+				{
+					entry.data = (const char*)Sector( disc, entry.lba );
+				}
+
+				files++;
+			}
+
+			Add( full, entry );
+		}
+	}
+
+	return files;
+
+} /* PackClass::ParseIso */
+
+int PackClass::ParseToc( const unsigned char* base, size_t size )
+{
+	if( size < 8 )
+	{
+		return -1;
+	}
+
+	unsigned int count = get32( base+4 );
+	size_t pos = 8;
+
+	for( unsigned int i=0; i<count; i++ )
+	{
+		if( pos+13 > size )
+		{
+			return -1;
+		}
+
+		unsigned int offset = get32( base+pos );
+		unsigned int length = get32( base+pos+4 );
+		int namelen = base[pos+12];
+
+		if( ( pos+13+namelen > size ) || ( (size_t)offset+length > size ) )
+		{
+			return -1;
+		}
+
+		ENTRY entry;
+
+		entry.data	= (const char*)base+offset;
+		entry.size	= length;
+		entry.mtime	= get32( base+pos+8 );
+		entry.dir	= false;
+		entry.disc	= -1;
+		entry.lba	= 0;
+
+		Add( std::string( (const char*)base+pos+13, namelen ), entry );
+
+		pos += 13+namelen;
+	}
+
+	return count;
+
+} /* PackClass::ParseToc */
+
+int PackClass::ParseZip( const unsigned char* base, size_t size )
+{
+	size_t eocd = 0;
+	int found = false;
+
+	// The end of central directory record is followed by a comment of at
+	// most 64KB
+	if( size < 22 )
+	{
+		return -1;
+	}
+
+	for( size_t pos = size-22; ; pos-- )
+	{
+		if( get32( base+pos ) == ZIP_EOCD_SIG )
+		{
+			eocd = pos;
+			found = true;
+			break;
+		}
+
+		if( ( pos == 0 ) || ( size-pos >= 22+65535 ) )
+		{
+			break;
+		}
+	}
+
+	if( !found )
+	{
+		return -1;
+	}
+
+	unsigned int count = get16( base+eocd+10 );
+	size_t pos = get32( base+eocd+16 );
+	int files = 0;
+
+	for( unsigned int i=0; i<count; i++ )
+	{
+		if( ( pos+46 > size ) || ( get32( base+pos ) != ZIP_CDIR_SIG ) )
+		{
+			return -1;
+		}
+
+		const unsigned char* hdr = base+pos;
+		unsigned int csize = get32( hdr+20 );
+		unsigned int usize = get32( hdr+24 );
+		size_t local = get32( hdr+42 );
+		int namelen = get16( hdr+28 );
+
+		pos += 46+namelen+get16( hdr+30 )+get16( hdr+32 );
+
+		if( pos > size )
+		{
+			return -1;
+		}
+
+		std::string name( (const char*)hdr+46, namelen );
+		ENTRY entry;
+
+		entry.data	= nullptr;
+		entry.size	= 0;
+		entry.mtime	= dosTime( get16( hdr+14 ), get16( hdr+12 ) );
+		entry.dir	= ( !name.empty() && ( name[name.size()-1] == '/' ) );
+		entry.disc	= -1;
+		entry.lba	= 0;
+
+		if( !entry.dir )
+		{
+			// Only stored entries can be served from the mapping
+			if( ( get16( hdr+10 ) != 0 ) || ( csize != usize ) )
+			{
+				skipped++;
+				continue;
+			}
+
+			if( ( local+30 > size ) || ( get32( base+local ) != ZIP_FILE_SIG ) )
+			{
+				return -1;
+			}
+
+			size_t data = local+30+get16( base+local+26 )+get16( base+local+28 );
+
+			if( data+usize > size )
+			{
+				return -1;
+			}
+
+			entry.data = (const char*)base+data;
+			entry.size = usize;
+			files++;
+		}
+
+		Add( name, entry );
+	}
+
+	return files;
+
+} /* PackClass::ParseZip */
+
+/* Lower-cased path with a trailing dot dropped from every component, so
+ * DATA/LEVEL1.TIM matches data/Level1.tim */
+static std::string foldPath( const std::string& name )
+{
+	std::string ret;
+
+	for( int i=0; i<name.size(); i++ )
+	{
+		if( ( name[i] == '.' ) && ( i > 0 ) && ( name[i-1] != '/' ) &&
+			( ( i+1 == name.size() ) || ( name[i+1] == '/' ) ) )
+		{
+			continue;
+		}
+
+		ret += tolower( (unsigned char)name[i] );
+	}
+
+	return ret;
+
+} /* foldPath */
+
+void PackClass::Add( std::string name, const ENTRY& entry )
+{
+	for( int i=0; i<name.size(); i++ )
+	{
+		if( name[i] == '\\' )
+			name[i] = '/';
+	}
+
+	while( !name.empty() && ( name[0] == '/' ) )
+		name.erase( 0, 1 );
+
+	while( !name.empty() && ( name[name.size()-1] == '/' ) )
+		name.erase( name.size()-1 );
+
+	if( name.empty() )
+	{
+		return;
+	}
+
+	if( entries.find( name ) == entries.end() )
+	{
+		size_t sep = name.find_last_of( '/' );
+		std::string parent = ( sep == std::string::npos ) ? "" : name.substr( 0, sep );
+
+		dirs[parent].push_back( name.substr( sep+1 ) );
+
+		// Directories are implied by the files in them
+		if( !parent.empty() && ( entries.find( parent ) == entries.end() ) )
+		{
+			ENTRY dir;
+
+			dir.data	= nullptr;
+			dir.size	= 0;
+			dir.mtime	= entry.mtime;
+			dir.dir		= true;
+			dir.disc	= entry.disc;
+			dir.lba		= 0;
+
+			Add( parent, dir );
+		}
+	}
+
+	// Empty directories still list
+	if( entry.dir )
+	{
+		dirs[name];
+	}
+
+	entries[name] = entry;
+	folded[foldPath( name )] = name;
+
+} /* PackClass::Add */
+
+const PackClass::ENTRY* PackClass::Find( const std::string& name )
+{
+	auto it = entries.find( name );
+
+	if( it == entries.end() )
+	{
+		auto spelled = folded.find( foldPath( name ) );
+
+		if( spelled == folded.end() )
+		{
+			return nullptr;
+		}
+
+		it = entries.find( spelled->second );
+	}
+
+	return &it->second;
+
+} /* PackClass::Find */
+
+const char* PackClass::Data( const ENTRY* entry )
+{
+	if( entry->data || entry->dir )
+	{
+		return entry->data;
+	}
+
+	// Raw images have sector headers in between, put the file together
+	std::lock_guard<std::mutex> guard( lock );
+
+	auto it = extracted.find( entry );
+
+	if( it != extracted.end() )
+	{
+		return it->second.data();
+	}
+
+	std::vector<char>& buff = extracted[entry];
+	const DISC& disc = discs[entry->disc];
+
+	buff.resize( entry->size );
+
+	for( unsigned int pos = 0; pos < entry->size; pos += ISO_SECTOR )
+	{
+		int len = ( entry->size-pos > ISO_SECTOR ) ? ISO_SECTOR : entry->size-pos;
+		const unsigned char* sector = Sector( disc, entry->lba+pos/ISO_SECTOR );
+
+		if( sector == nullptr )
+		{
+			extracted.erase( entry );
+			return nullptr;
+		}
+
+		memcpy( buff.data()+pos, sector, len );
+	}
+
+	return buff.data();
+
+} /* PackClass::Data */
+
+int PackClass::Sectors( unsigned int lba, int count, int raw, char* buffer,
+	const char** data )
+{
+	if( discs.empty() )
+	{
+		return -1;
+	}
+
+	const DISC& disc = discs.back();
+
+	if( lba >= disc.sectors )
+	{
+		return -2;
+	}
+
+	if( raw && ( disc.sector_size != ISO_RAW_SECTOR ) )
+	{
+		return -3;
+	}
+
+	if( count > disc.sectors-lba )
+	{
+		count = disc.sectors-lba;
+	}
+
+	if( raw || ( disc.sector_size == ISO_SECTOR ) )
+	{
+		*data = (const char*)disc.base+(size_t)lba*disc.sector_size;
+		return count*disc.sector_size;
+	}
+
+	for( int i=0; i<count; i++ )
+	{
+		memcpy( buffer+i*ISO_SECTOR, Sector( disc, lba+i ), ISO_SECTOR );
+	}
+
+	*data = buffer;
+
+	return count*ISO_SECTOR;
+
+} /* PackClass::Sectors */
+
+const std::vector<std::string>* PackClass::List( const std::string& dir )
+{
+	auto it = dirs.find( dir );
+
+	if( it == dirs.end() )
+	{
+		auto spelled = folded.find( foldPath( dir ) );
+
+		if( spelled == folded.end() )
+		{
+			return nullptr;
+		}
+
+		it = dirs.find( spelled->second );
+
+		if( it == dirs.end() )
+		{
+			return nullptr;
+		}
+	}
+
+	return &it->second;
+
+} /* PackClass::List */
+
+void PackClass::Stat( const ENTRY* entry, struct stat* attr )
+{
+	memset( attr, 0, sizeof(struct stat) );
+
+	attr->st_mode	= entry->dir ? (S_IFDIR|0555) : (S_IFREG|0444);
+	attr->st_size	= entry->size;
+	attr->st_mtime	= entry->mtime;
+
+} /* PackClass::Stat */
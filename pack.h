@@ -0,0 +1,110 @@
+#ifndef _PACK_H
+#define _PACK_H
+
+#include <time.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+/* Read-only pack files laid over the initial SIOFS directory. A pack is
+ * mapped into memory whole and indexed once when mounted, lookups are a
+ * single hash probe by path and file data is served straight out of the
+ * mapping. Paths inside a pack are relative to the initial directory with
+ * '/' separators.
+ *
+ * Two formats are understood, ZIP archives (stored entries only, zip -0)
+ * and this simple one, all little endian:
+ *
+ *	 0	"MCPK"
+ *	 4	u32 number of files
+ *	 8	per file: u32 data offset, u32 size, u32 modification time
+ *		(seconds since 1970), u8 name length, name
+ *
+ * File data may be anywhere in the pack. CD images (.iso with 2048 byte
+ * sectors, .bin with raw 2352 byte Mode 1 or Mode 2 sectors, or the .cue
+ * sheet of one) are mounted the same way, their ISO9660 tree is walked
+ * once and files are looked up like any other. Files on raw images are
+ * not contiguous in the image and are put together on first use.
+ *
+ * Names that are not in a pack as spelled are looked up again ignoring
+ * case and a trailing dot on each component, the same as host names.
+ *
+ * Packs mounted later take precedence over earlier ones. Only supported
+ * on Linux. */
+
+class PackClass {
+public:
+
+	typedef struct {
+		const char*		data;
+		unsigned int	size;
+		time_t			mtime;
+		int				dir;
+		int				disc;
+		unsigned int	lba;
+	} ENTRY;
+
+	PackClass();
+	virtual ~PackClass();
+
+	/* Maps and indexes a pack, returns the number of files in it or -1 if
+	 * it cannot be read or is in neither format */
+	int Mount(const char* file);
+	int MountDisc(const char* file);
+
+	int Empty() { return entries.empty(); }
+
+	/* Looks up a file or directory, nullptr if the packs have neither */
+	const ENTRY* Find(const std::string& name);
+
+	/* Contents of a file, always use this instead of entry->data. nullptr
+	 * if the image does not hold all of it */
+	const char* Data(const ENTRY* entry);
+
+	/* Reads count sectors off the last mounted CD image, 2048 bytes of user
+	 * data each or 2352 if raw is set. data points into the image when the
+	 * sectors are contiguous in it, otherwise into buffer which must hold
+	 * count*2048 bytes. Returns the number of bytes read, shorter at the
+	 * end of the disc, -1 if no image is mounted, -2 if lba is past the
+	 * end and -3 if the image has no raw sectors. */
+	int Sectors(unsigned int lba, int count, int raw, char* buffer,
+		const char** data);
+
+	/* Names directly below a directory, nullptr if it is not in a pack */
+	const std::vector<std::string>* List(const std::string& dir);
+
+	/* Fills in mode, size and mtime the way a host file would have them */
+	static void Stat(const ENTRY* entry, struct stat* attr);
+
+	/* Compressed ZIP entries left out of mounted packs */
+	int skipped;
+
+private:
+
+	typedef struct {
+		const unsigned char* base;
+		unsigned int	sectors;
+		int				sector_size;
+		int				data_offset;
+	} DISC;
+
+	const unsigned char* Map(const char* file, size_t* size);
+	const unsigned char* Sector(const DISC& disc, unsigned int lba);
+	void Add(std::string name, const ENTRY& entry);
+	int ParseToc(const unsigned char* base, size_t size);
+	int ParseZip(const unsigned char* base, size_t size);
+	int ParseIso(int disc);
+
+	std::vector<std::pair<void*, size_t> > maps;
+	std::vector<DISC> discs;
+	std::mutex		lock;
+	std::map<const ENTRY*, std::vector<char> > extracted;
+	std::unordered_map<std::string, ENTRY> entries;
+	std::unordered_map<std::string, std::string> folded;
+	std::unordered_map<std::string, std::vector<std::string> > dirs;
+};
+
+#endif // _PACK_H
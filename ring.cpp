@@ -0,0 +1,128 @@
+#include <string.h>
+#include <chrono>
+#include "ring.h"
+
+RingClass::RingClass(int size)
+{
+	int bytes = 1;
+
+	while( bytes < size )
+	{
+		bytes <<= 1;
+	}
+
+	buffer.resize( bytes );
+	mask = bytes-1;
+
+	head = 0;
+	tail = 0;
+	waiting = false;
+	high_water = 0;
+	dropped = 0;
+
+} /* RingClass::RingClass */
+
+RingClass::~RingClass()
+{
+} /* RingClass::~RingClass */
+
+int RingClass::Write(const void* data, int len)
+{
+	const char* p = (const char*)data;
+	unsigned int pos = head.load( std::memory_order_relaxed );
+	unsigned int used = pos-tail.load( std::memory_order_acquire );
+	int space = Size()-used;
+
+	if( len > space )
+	{
+		dropped += len-space;
+		len = space;
+	}
+
+	if( len <= 0 )
+	{
+		return 0;
+	}
+
+	// In up to two pieces, the second one from the start of the buffer
+	int first = Size()-( pos&mask );
+
+	if( first > len )
+	{
+		first = len;
+	}
+
+	memcpy( buffer.data()+( pos&mask ), p, first );
+	memcpy( buffer.data(), p+first, len-first );
+
+	head.store( pos+len, std::memory_order_seq_cst );
+
+	if( (int)used+len > high_water.load( std::memory_order_relaxed ) )
+	{
+		high_water.store( used+len, std::memory_order_relaxed );
+	}
+
+	// Seen after the head moved or the reader saw the new head itself
+	if( waiting.load( std::memory_order_seq_cst ) )
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		ready.notify_one();
+	}
+
+	return len;
+
+} /* RingClass::Write */
+
+int RingClass::Read(void* data, int len)
+{
+	char* p = (char*)data;
+	unsigned int pos = tail.load( std::memory_order_relaxed );
+	int avail = head.load( std::memory_order_acquire )-pos;
+
+	if( len > avail )
+	{
+		len = avail;
+	}
+
+	if( len <= 0 )
+	{
+		return 0;
+	}
+
+	int first = Size()-( pos&mask );
+
+	if( first > len )
+	{
+		first = len;
+	}
+
+	memcpy( p, buffer.data()+( pos&mask ), first );
+	memcpy( p+first, buffer.data(), len-first );
+
+	tail.store( pos+len, std::memory_order_release );
+
+	return len;
+
+} /* RingClass::Read */
+
+int RingClass::Pending()
+{
+	return head.load( std::memory_order_acquire )-tail.load( std::memory_order_relaxed );
+
+} /* RingClass::Pending */
+
+int RingClass::Wait(int msec)
+{
+	std::unique_lock<std::mutex> guard( lock );
+
+	waiting.store( true, std::memory_order_seq_cst );
+
+	ready.wait_for( guard, std::chrono::milliseconds( msec ), [this]() {
+		return head.load( std::memory_order_seq_cst ) != tail.load( std::memory_order_relaxed );
+	});
+
+	waiting.store( false, std::memory_order_relaxed );
+
+	return Pending();
+
+} /* RingClass::Wait */
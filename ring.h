@@ -0,0 +1,50 @@
+#ifndef _RING_H
+#define _RING_H
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+/* Byte ring between exactly one writing and one reading thread. Neither
+ * side takes a lock to move data, the reader only does to sleep in Wait()
+ * and the writer to wake it. What does not fit is cut off and counted as
+ * dropped instead of holding up the writer. */
+
+class RingClass {
+public:
+	/* size is rounded up to a power of two */
+	RingClass(int size);
+	virtual ~RingClass();
+
+	/* Writer side, returns how much of data went in */
+	int Write(const void* data, int len);
+
+	/* Reader side, returns how much was read, 0 if the ring is empty */
+	int Read(void* data, int len);
+	int Pending();
+
+	/* Waits up to msec for something to read, returns Pending() */
+	int Wait(int msec);
+
+	int Size() { return mask+1; }
+
+	/* Most bytes ever waiting to be read and bytes that did not fit */
+	std::atomic<int> high_water;
+	std::atomic<unsigned long long> dropped;
+
+private:
+
+	std::vector<char> buffer;
+	unsigned int	mask;
+
+	// Apart so the two sides do not share a cache line
+	alignas(64) std::atomic<unsigned int> head;
+	alignas(64) std::atomic<unsigned int> tail;
+
+	std::atomic<int> waiting;
+	std::mutex		lock;
+	std::condition_variable ready;
+};
+
+#endif // _RING_H
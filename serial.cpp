@@ -4,12 +4,28 @@
 #include <string.h>
 #include <unistd.h>
 #include <iostream>
+#include <chrono>
 #ifndef __WIN32__
+#include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <termios.h>
 #include <bits/time.h>
+#else
+#include <io.h>
 #endif
 #include "serial.h"
+#include "seriallog.h"
+#include "ring.h"
+#include "trace.h"
+#include "sigblock.h"
+
+static unsigned long long nsecNow()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch() ).count();
+
+} /* nsecNow */
 
 SerialClass::SerialClass()
 {
@@ -18,11 +34,31 @@ SerialClass::SerialClass()
 #else
 	hComm = -1;
 #endif
+	rx_bytes = 0;
+	tx_bytes = 0;
+	rx_timeouts = 0;
+	io_nsec = 0;
+	timing = false;
+	log = nullptr;
+	replay = nullptr;
+	ring = nullptr;
+	stop = false;
 
 } /* SerialClass::SerialClass */
 
 SerialClass::~SerialClass()
 {	
+	stop = true;
+	
+	if( reader.joinable() )
+	{
+		reader.join();
+	}
+	
+	delete log;
+	delete replay;
+	delete ring;
+	
 #ifdef __WIN32__
 	if ( hComm != INVALID_HANDLE_VALUE ) {
 		CloseHandle( hComm );
@@ -37,6 +73,8 @@ SerialClass::~SerialClass()
 
 SerialClass::ErrorType SerialClass::OpenPort(const char* name, int rate, int handshake)
 {	
+	device = name;
+	
 #ifdef __WIN32__
 
 	/* serial device open for Win32 */
@@ -210,8 +248,134 @@ SerialClass::ErrorType SerialClass::SetRate(int rate) {
 	return( OK );
 }
 
+int SerialClass::Record(const char* file)
+{
+	SerialLogClass* created = new SerialLogClass;
+	
+	if( created->Create( file ) < 0 )
+	{
+		delete created;
+		return -1;
+	}
+	
+	delete log;
+	log = created;
+	
+	return 0;
+	
+} /* SerialClass::Record */
+
+int SerialClass::Replay(const char* file, int timed)
+{
+	SerialReplayClass* loaded = new SerialReplayClass;
+	int count = loaded->Load( file, timed );
+	
+	if( count < 0 )
+	{
+		delete loaded;
+		return -1;
+	}
+	
+	delete replay;
+	replay = loaded;
+	device = file;
+	
+	return count;
+	
+} /* SerialClass::Replay */
+
+void SerialClass::Mark(int kind)
+{
+	if( log )
+	{
+		log->Write( kind, nullptr, 0 );
+	}
+	
+} /* SerialClass::Mark */
+
+int SerialClass::StartReader()
+{
+#ifndef __WIN32__
+	
+	if( ( hComm < 0 ) || ring )
+	{
+		return -1;
+	}
+	
+	// A descriptor of its own, ClosePort() may close hComm under it
+	int fd = dup( hComm );
+	
+	if( fd < 0 )
+	{
+		return -1;
+	}
+	
+	ring = new RingClass( SERIAL_RING_SIZE );
+	SignalBlockClass block;
+	
+	reader = std::thread( &SerialClass::Reader, this, fd );
+	
+	return 0;
+	
+#else
+	
+	// Reads and writes of a port opened without overlapped I/O would
+	// queue up behind each other
+	return -1;
+	
+#endif
+	
+} /* SerialClass::StartReader */
+
+void SerialClass::Reader(int fd)
+{
+#ifndef __WIN32__
+	
+	char buff[SERIAL_READ_CHUNK];
+	struct pollfd pfd;
+	
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	
+	while( !stop )
+	{
+		// Wakes up now and then to see if it should stop
+		if( ( poll( &pfd, 1, 100 ) <= 0 ) || stop )
+		{
+			continue;
+		}
+		
+		// Hung up or closed, wait for the main thread to notice
+		if( !( pfd.revents & POLLIN ) )
+		{
+			usleep( 100000 );
+			continue;
+		}
+		
+		int n = read( fd, buff, SERIAL_READ_CHUNK );
+		
+		if( n > 0 )
+		{
+			ring->Write( buff, n );
+		}
+	}
+	
+	close( fd );
+	
+#endif
+	
+} /* SerialClass::Reader */
+
 int SerialClass::PendingBytes()
 {
+	if ( replay ) {
+		return replay->Pending();
+	}
+	
+	if ( ring ) {
+		return ring->Pending();
+	}
+	
 #ifdef __WIN32__
 	
 	DWORD dwErrorFlags;
@@ -234,68 +398,222 @@ int SerialClass::PendingBytes()
 
 int SerialClass::SendBytes(void* data, int length)
 {	
-#ifdef __WIN32__
-	DWORD bytesWritten;
+	unsigned long long start = timing ? nsecNow() : 0;
+	int bytesWritten;
 	
-	if ( !WriteFile( hComm, data, length, &bytesWritten, NULL ) ) {
-		return -1;
-	}
+	if ( replay ) {
+		
+		bytesWritten = replay->Send(data, length);
+		
+	} else {
 	
+#ifdef __WIN32__
+		DWORD written;
+		
+		if ( !WriteFile( hComm, data, length, &written, NULL ) ) {
+			return -1;
+		}
+		
+		bytesWritten = written;
 #else
+		bytesWritten = write(hComm, data, length);
+#endif
+		
+		if ( log && ( bytesWritten > 0 ) ) {
+			log->Write(SERIAL_LOG_TX, data, bytesWritten);
+		}
+		
+	}
 	
-	int bytesWritten;
+	if ( bytesWritten > 0 ) {
+		tx_bytes += bytesWritten;
+	}
 	
-	bytesWritten = write(hComm, data, length);
+	if ( timing ) {
+		io_nsec += nsecNow()-start;
+	}
 	
-#endif
+	TRACE( TRACE_IO, "serial: send %lld -> %lld", length, bytesWritten );
 	
 	return( bytesWritten );
 	
 } /* SerialClass::SendBytes */
 
-int SerialClass::ReceiveBytes(void* data, int bytes)
+int SerialClass::SendFile(int fd, long long offset, int length)
 {
-#ifdef __WIN32__
-
-	DWORD bytesReceived;
+	int sent = 0;
+	
+#ifndef __WIN32__
+	
+	// Straight from the page cache to the port when the kernel allows it,
+	// logs and replays need to see the data
+	unsigned long long start = timing ? nsecNow() : 0;
+	off_t pos = offset;
 	
-	if( !ReadFile( hComm, data, bytes, &bytesReceived, NULL )  )
+	while( ( sent < length ) && !log && !replay )
 	{
-		return( -1 );
+		ssize_t n = sendfile( hComm, fd, &pos, length-sent );
+		
+		if( n <= 0 )
+		{
+			if( n == 0 )
+			{
+				length = sent;	// End of file
+			}
+			break;
+		}
+		
+		sent += n;
+		tx_bytes += n;
 	}
 	
-#else
-	int bytesReceived;
-	struct timeval timeout;
+	if( timing )
+	{
+		io_nsec += nsecNow()-start;
+	}
 	
-	fd_set read_fds, write_fds, except_fds;
+	TRACE( TRACE_IO, "serial: sendfile %lld at %lld -> %lld", length, offset, sent );
 	
-	FD_ZERO(&read_fds);
-	FD_ZERO(&write_fds);
-	FD_ZERO(&except_fds);
-	FD_SET(hComm, &read_fds);
+#endif
 	
-	timeout.tv_sec = 1;
-	timeout.tv_usec = 0;
+	// Whatever is left goes through a buffer
+	char buff[SERIAL_FILE_CHUNK];
 	
-	if ( select(hComm+1, &read_fds, &write_fds, &except_fds, &timeout) == 1 ) {
+	while( sent < length )
+	{
+		int want = length-sent;
+		int n;
+		
+		if( want > SERIAL_FILE_CHUNK )
+		{
+			want = SERIAL_FILE_CHUNK;
+		}
+		
+#ifndef __WIN32__
+		n = pread( fd, buff, want, offset+sent );
+#else
+		if( _lseeki64( fd, offset+sent, SEEK_SET ) < 0 )
+		{
+			break;
+		}
+		n = _read( fd, buff, want );
+#endif
+		
+		if( ( n <= 0 ) || ( SendBytes( buff, n ) != n ) )
+		{
+			break;
+		}
+		
+		sent += n;
+	}
 	
-		bytesReceived = read(hComm, data, bytes);
+	return( sent );
+	
+} /* SerialClass::SendFile */
+
+int SerialClass::ReceiveBytes(void* data, int bytes)
+{
+	unsigned long long start = timing ? nsecNow() : 0;
+	int bytesReceived = -1;
 	
+	if ( replay ) {
+		
+		bytesReceived = replay->Receive(data, bytes);
+		
+	} else if ( ring ) {
+		
+		// Same as below, whatever is there or wait up to a second
+		if ( ( bytes > 0 ) && ( ring->Pending() || ring->Wait(1000) ) ) {
+			bytesReceived = ring->Read(data, bytes);
+		}
+		
+		if ( log && ( bytesReceived > 0 ) ) {
+			log->Write(SERIAL_LOG_RX, data, bytesReceived);
+		}
+		
 	} else {
+	
+#ifdef __WIN32__
+
+		DWORD got;
 		
-		return( -1 );
+		if( ReadFile( hComm, data, bytes, &got, NULL )  )
+		{
+			bytesReceived = got;
+		}
+	
+#else
+		struct timeval timeout;
 		
-	}
+		fd_set read_fds, write_fds, except_fds;
+		
+		FD_ZERO(&read_fds);
+		FD_ZERO(&write_fds);
+		FD_ZERO(&except_fds);
+		FD_SET(hComm, &read_fds);
+		
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
+		
+		if ( select(hComm+1, &read_fds, &write_fds, &except_fds, &timeout) == 1 ) {
+		
+			bytesReceived = read(hComm, data, bytes);
+		
+		}
 	
 #endif
+		
+		if ( log && ( bytesReceived > 0 ) ) {
+			log->Write(SERIAL_LOG_RX, data, bytesReceived);
+		}
+		
+	}
+	
+	if ( bytesReceived > 0 ) {
+		rx_bytes += bytesReceived;
+	}
+	
+	if ( ( bytesReceived <= 0 ) && ( bytes > 0 ) ) {
+		rx_timeouts++;
+		TRACE( TRACE_CMD, "serial: receive %lld timed out", bytes );
+	}
+	
+	if ( timing ) {
+		io_nsec += nsecNow()-start;
+	}
+	
+	TRACE( TRACE_IO, "serial: receive %lld -> %lld", bytes, bytesReceived );
 	
 	return( bytesReceived );
 	
 } /* SerialClass::ReceiveBytes */
 
+int SerialClass::ReceiveAll(void* data, int bytes)
+{
+	char* p = (char*)data;
+	int received = 0;
+	
+	while ( received < bytes ) {
+		
+		int ret = ReceiveBytes(p+received, bytes-received);
+		
+		if ( ret <= 0 ) {
+			break;
+		}
+		
+		received += ret;
+	}
+	
+	return( received );
+	
+} /* SerialClass::ReceiveAll */
+
 void SerialClass::ClosePort() {
 	
+	// The reader thread is joined on destruction, this can be called
+	// from a signal handler
+	stop = true;
+	
 #ifdef __WIN32__
 	if ( hComm != INVALID_HANDLE_VALUE ) {
 		CloseHandle( hComm );
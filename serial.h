@@ -2,10 +2,23 @@
 #define SERIALCLASS_H
 
 #include <string>
+#include <thread>
+#include <atomic>
 #ifdef __WIN32__
 #include <windows.h>
 #endif
 
+#define SERIAL_FILE_CHUNK	16384
+
+/* Received data waiting for the main thread, and how much the reader
+ * thread takes off the port at a time */
+#define SERIAL_RING_SIZE	(1024*1024)
+#define SERIAL_READ_CHUNK	4096
+
+class SerialLogClass;
+class SerialReplayClass;
+class RingClass;
+
 class SerialClass {
 public:
 	SerialClass();
@@ -24,17 +37,68 @@ public:
 	void ClosePort();
 	
 	int SendBytes(void* data, int bytes);
+	
+	/* Sends length bytes of the file fd from offset on, without touching
+	 * the file position. Uses sendfile() on Linux and falls back to
+	 * reading and sending when the kernel refuses. Returns the number of
+	 * bytes sent, short at end of file or on error. */
+	int SendFile(int fd, long long offset, int length);
 	int ReceiveBytes(void* data, int bytes);
+	
+	/* Keeps receiving until all bytes are in or a receive times out with
+	 * nothing, for payloads longer than a single read may return. Returns
+	 * the number of bytes received. */
+	int ReceiveAll(void* data, int bytes);
 	int PendingBytes();
 	
+	/* Logs everything sent and received from now on to file, see
+	 * seriallog.h */
+	int Record(const char* file);
+	
+	/* Plays a log back in place of a port, in real time if timed is set.
+	 * Returns the number of records in the log or -1 if it cannot be
+	 * read. */
+	int Replay(const char* file, int timed);
+	
+	/* Puts a SERIAL_LOG_SKIP or SERIAL_LOG_RESUME mark in the log around
+	 * traffic replays should leave out */
+	void Mark(int kind);
+	
+	/* Drains the port from a thread of its own into a ring that
+	 * ReceiveBytes and PendingBytes then read from, so the port keeps
+	 * being read while the caller is busy. Linux only, returns -1
+	 * elsewhere. */
+	int StartReader();
+	
 #ifdef __WIN32__
 	HANDLE hComm;
 #else
 	int hComm;
 #endif
+	std::string device;
+	
+	unsigned long long rx_bytes;
+	unsigned long long tx_bytes;
+	
+	/* Receives that timed out with nothing, and the time spent in
+	 * SendBytes, SendFile and ReceiveBytes while timing is set */
+	unsigned long long rx_timeouts;
+	unsigned long long io_nsec;
+	int timing;
+	
+	SerialReplayClass* replay;
+	
+	/* The reader thread's ring, nullptr without one */
+	RingClass*		ring;
 	
 private:
 
+	void Reader(int fd);
+	
+	SerialLogClass*	log;
+	std::thread		reader;
+	std::atomic<int> stop;
+
 };
 
 #endif /* SERIALCLASS_H */
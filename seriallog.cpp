@@ -0,0 +1,391 @@
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include "seriallog.h"
+
+/* How long sends the log expects are waited for before they count as
+ * missing (microseconds) */
+#define REPLAY_STALL	1000000
+
+static long long usecNow()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch() ).count();
+
+} /* usecNow */
+
+static int getNumber( FILE* fp, unsigned long long* value )
+{
+	int shift = 0;
+	int c;
+
+	*value = 0;
+
+	while( ( c = fgetc( fp ) ) != EOF )
+	{
+		*value |= (unsigned long long)( c&0x7f )<<shift;
+
+		if( !( c&0x80 ) )
+			return 0;
+
+		shift += 7;
+
+		if( shift > 63 )
+			break;
+	}
+
+	return -1;
+
+} /* getNumber */
+
+SerialLogClass::SerialLogClass()
+{
+	fp = nullptr;
+	last = 0;
+
+} /* SerialLogClass::SerialLogClass */
+
+SerialLogClass::~SerialLogClass()
+{
+	Close();
+
+} /* SerialLogClass::~SerialLogClass */
+
+int SerialLogClass::Create(const char* file)
+{
+	unsigned int version = SERIAL_LOG_VERSION;
+
+	Close();
+
+	fp = fopen( file, "wb" );
+
+	if( fp == nullptr )
+	{
+		return -1;
+	}
+
+	fwrite( "MCRL", 1, 4, fp );
+	fwrite( &version, 1, 4, fp );
+
+	last = usecNow();
+
+	return 0;
+
+} /* SerialLogClass::Create */
+
+void SerialLogClass::PutNumber(unsigned long long value)
+{
+	do
+	{
+		int c = value&0x7f;
+
+		value >>= 7;
+		fputc( value ? ( c|0x80 ) : c, fp );
+	}
+	while( value );
+
+} /* SerialLogClass::PutNumber */
+
+void SerialLogClass::Write(int kind, const void* data, int len)
+{
+	if( fp == nullptr )
+	{
+		return;
+	}
+
+	long long now = usecNow();
+
+	fputc( kind, fp );
+	PutNumber( now-last );
+	PutNumber( len );
+
+	if( len > 0 )
+	{
+		fwrite( data, 1, len, fp );
+	}
+
+	last = now;
+
+} /* SerialLogClass::Write */
+
+void SerialLogClass::Close()
+{
+	if( fp )
+	{
+		fclose( fp );
+		fp = nullptr;
+	}
+
+} /* SerialLogClass::Close */
+
+SerialReplayClass::SerialReplayClass()
+{
+	checked = 0;
+	differ = 0;
+	missing = 0;
+	extra = 0;
+	skipped = 0;
+	first_diff = -1;
+
+	cur = 0;
+	off = 0;
+	timing = false;
+	start = 0;
+	stall = 0;
+
+} /* SerialReplayClass::SerialReplayClass */
+
+SerialReplayClass::~SerialReplayClass()
+{
+} /* SerialReplayClass::~SerialReplayClass */
+
+int SerialReplayClass::Load(const char* file, int timing)
+{
+	char magic[4];
+	unsigned int version;
+	long long time = 0;
+	int c;
+
+	FILE* fp = fopen( file, "rb" );
+
+	if( fp == nullptr )
+	{
+		return -1;
+	}
+
+	if( ( fread( magic, 1, 4, fp ) != 4 ) || memcmp( magic, "MCRL", 4 ) ||
+		( fread( &version, 1, 4, fp ) != 4 ) || ( version != SERIAL_LOG_VERSION ) )
+	{
+		fclose( fp );
+		return -1;
+	}
+
+	records.clear();
+	data.clear();
+
+	// A record cut off at the end, as by a crash, ends the log
+	while( ( c = fgetc( fp ) ) != EOF )
+	{
+		unsigned long long delta, len;
+		RECORD rec;
+
+		if( getNumber( fp, &delta ) || getNumber( fp, &len ) ||
+			( len > 0x7fffffff ) )
+		{
+			break;
+		}
+
+		time += delta;
+
+		rec.kind = c;
+		rec.time = time;
+		rec.offset = data.size();
+		rec.length = len;
+
+		data.resize( rec.offset+len );
+
+		if( fread( data.data()+rec.offset, 1, len, fp ) != len )
+		{
+			data.resize( rec.offset );
+			break;
+		}
+
+		records.push_back( rec );
+	}
+
+	fclose( fp );
+
+	this->timing = timing;
+	cur = 0;
+	off = 0;
+	start = usecNow();
+	stall = 0;
+
+	return records.size();
+
+} /* SerialReplayClass::Load */
+
+void SerialReplayClass::Advance()
+{
+	while( cur < records.size() )
+	{
+		RECORD* rec = &records[cur];
+
+		if( rec->kind == SERIAL_LOG_SKIP )
+		{
+			// Everything up to the resume mark goes
+			for( cur++; cur < records.size(); cur++ )
+			{
+				if( records[cur].kind == SERIAL_LOG_RESUME )
+					break;
+
+				skipped += records[cur].length;
+			}
+		}
+		else if( ( ( rec->kind == SERIAL_LOG_RX ) || ( rec->kind == SERIAL_LOG_TX ) ) &&
+			( off < rec->length ) )
+		{
+			return;
+		}
+
+		cur++;
+		off = 0;
+	}
+
+} /* SerialReplayClass::Advance */
+
+void SerialReplayClass::Mismatch()
+{
+	if( first_diff < 0 )
+	{
+		first_diff = ( cur < records.size() ) ? records[cur].time :
+			( records.empty() ? 0 : records.back().time );
+	}
+
+} /* SerialReplayClass::Mismatch */
+
+int SerialReplayClass::Send(const void* data, int len)
+{
+	const char* p = (const char*)data;
+	int left = len;
+
+	stall = 0;
+
+	while( left > 0 )
+	{
+		Advance();
+
+		// The host says something the console never got
+		if( ( cur >= records.size() ) || ( records[cur].kind != SERIAL_LOG_TX ) )
+		{
+			Mismatch();
+			extra += left;
+			break;
+		}
+
+		RECORD* rec = &records[cur];
+		const char* expect = this->data.data()+rec->offset+off;
+		int n = rec->length-off;
+
+		if( n > left )
+		{
+			n = left;
+		}
+
+		for( int i=0; i<n; i++ )
+		{
+			if( p[i] != expect[i] )
+			{
+				Mismatch();
+				differ++;
+			}
+		}
+
+		checked += n;
+		off += n;
+		p += n;
+		left -= n;
+	}
+
+	return len;
+
+} /* SerialReplayClass::Send */
+
+int SerialReplayClass::Receive(void* data, int len)
+{
+	Advance();
+
+	// Whatever the host did not send before waiting on the console is
+	// not going to be sent anymore
+	while( ( cur < records.size() ) && ( records[cur].kind == SERIAL_LOG_TX ) )
+	{
+		Mismatch();
+		missing += records[cur].length-off;
+		cur++;
+		off = 0;
+		Advance();
+	}
+
+	if( cur >= records.size() )
+	{
+		return -1;
+	}
+
+	RECORD* rec = &records[cur];
+
+	if( timing )
+	{
+		long long wait = rec->time-( usecNow()-start );
+
+		if( wait > 0 )
+		{
+			std::this_thread::sleep_for( std::chrono::microseconds( wait ) );
+		}
+	}
+
+	// Never more than one record, the port handed it over in one read
+	int n = rec->length-off;
+
+	if( n > len )
+	{
+		n = len;
+	}
+
+	memcpy( data, this->data.data()+rec->offset+off, n );
+	off += n;
+
+	return n;
+
+} /* SerialReplayClass::Receive */
+
+int SerialReplayClass::Pending()
+{
+	Advance();
+
+	if( cur >= records.size() )
+	{
+		return 0;
+	}
+
+	RECORD* rec = &records[cur];
+
+	// Sends the host makes on its own, stream packets for one, are given
+	// some time to show up
+	if( rec->kind == SERIAL_LOG_TX )
+	{
+		long long now = usecNow();
+
+		if( stall == 0 )
+		{
+			stall = now;
+		}
+		else if( now-stall > REPLAY_STALL )
+		{
+			Mismatch();
+			missing += rec->length-off;
+			cur++;
+			off = 0;
+			stall = 0;
+		}
+
+		return 0;
+	}
+
+	stall = 0;
+
+	if( timing && ( usecNow()-start < rec->time ) )
+	{
+		return 0;
+	}
+
+	return rec->length-off;
+
+} /* SerialReplayClass::Pending */
+
+int SerialReplayClass::Done()
+{
+	Advance();
+
+	return( cur >= records.size() );
+
+} /* SerialReplayClass::Done */
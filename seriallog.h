@@ -0,0 +1,95 @@
+#ifndef _SERIALLOG_H
+#define _SERIALLOG_H
+
+#include <stdio.h>
+#include <vector>
+
+/* Capture of everything that went over a serial port, so a session can be
+ * replayed without the console. A log starts with "MCRL" and a u32
+ * version, followed by records of a kind byte, the time since the previous
+ * record in microseconds and the data length (both LEB128) and the data.
+ *
+ * Traffic between SKIP and RESUME marks, uploads and keystrokes, is kept
+ * in the log but not replayed since the host does not produce it on its
+ * own. */
+
+#define SERIAL_LOG_RX		0	// Console to host
+#define SERIAL_LOG_TX		1	// Host to console
+#define SERIAL_LOG_SKIP		2
+#define SERIAL_LOG_RESUME	3
+
+#define SERIAL_LOG_VERSION	1
+
+class SerialLogClass {
+public:
+	SerialLogClass();
+	virtual ~SerialLogClass();
+
+	int Create(const char* file);
+	void Write(int kind, const void* data, int len);
+	void Close();
+
+private:
+
+	void PutNumber(unsigned long long value);
+
+	FILE*		fp;
+	long long	last;
+};
+
+/* Plays a log back in place of the port: receives return what the console
+ * sent, sends are compared against what the host sent back then. With
+ * timing set received data only shows up once as much time has passed as
+ * in the log, otherwise as fast as the host takes it. */
+
+class SerialReplayClass {
+public:
+	SerialReplayClass();
+	virtual ~SerialReplayClass();
+
+	/* Reads a whole log, returns the number of records or -1 if the file
+	 * cannot be read or is not a log */
+	int Load(const char* file, int timing);
+
+	int Send(const void* data, int len);
+	int Receive(void* data, int len);
+	int Pending();
+
+	/* Every record was played */
+	int Done();
+
+	/* Bytes compared and how many of them differed, bytes the host did not
+	 * send although the log has them and bytes it sent that the log does
+	 * not have, and bytes in skipped spans */
+	unsigned long long checked;
+	unsigned long long differ;
+	unsigned long long missing;
+	unsigned long long extra;
+	unsigned long long skipped;
+
+	/* Time into the log of the first difference in microseconds, -1 if
+	 * there was none */
+	long long	first_diff;
+
+private:
+
+	typedef struct {
+		int			kind;
+		long long	time;
+		size_t		offset;
+		int			length;
+	} RECORD;
+
+	void Advance();
+	void Mismatch();
+
+	std::vector<RECORD> records;
+	std::vector<char> data;
+	size_t		cur;
+	int			off;
+	int			timing;
+	long long	start;
+	long long	stall;
+};
+
+#endif // _SERIALLOG_H
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <string.h>
+#include "session.h"
+#include "upload.h"
+#include "seriallog.h"
+
+SessionClass::SessionClass()
+{
+	uploads = 0;
+	upload_errors = 0;
+	line_start = true;
+	hex_offset = 0;
+	
+} /* SessionClass::SessionClass */
+
+SessionClass::~SessionClass()
+{
+	Close();
+	
+} /* SessionClass::~SessionClass */
+
+SerialClass::ErrorType SessionClass::Open(const char* device, int rate, int handshake)
+{
+	return serial.OpenPort( device, rate, handshake );
+	
+} /* SessionClass::Open */
+
+void SessionClass::Close()
+{
+	serial.ClosePort();
+	
+} /* SessionClass::Close */
+
+int SessionClass::Service(char* buffer, int size)
+{
+	memset( buffer, 0, size );
+	
+	siofs.Poll();
+	
+	if ( !serial.PendingBytes() )
+	{
+		return 0;
+	}
+	
+	// Leave room for the terminator strchr relies on
+	int len = serial.ReceiveBytes( buffer, size-1 );
+	
+	if( len <= 0 )
+	{
+		return 0;
+	}
+	
+	// if it contains a tilde, check if it is a SIOFS command
+	if( strchr( buffer, '~' ) )
+	{
+		if( siofs.Query( strchr( buffer, '~' ), &serial ) )
+		{
+			// if command was recognized, trim off the command
+			*strchr( buffer, '~' ) = 0x0;
+			len -= 4;
+		}
+	}
+	
+	return len;
+	
+} /* SessionClass::Service */
+
+int SessionClass::Upload(int type, const char* file, unsigned int addr)
+{
+	int ret;
+	
+	// Replays cannot redo uploads, they do not come from SIOFS
+	serial.Mark( SERIAL_LOG_SKIP );
+	
+	switch( type )
+	{
+	case UPLOAD_EXE:
+		ret = uploadEXE( file, &serial );
+		break;
+	case UPLOAD_PATCH:
+		ret = uploadBIN( file, 0, &serial, 1 );
+		break;
+	default:
+		ret = uploadBIN( file, addr, &serial, 0 );
+		break;
+	}
+	
+	serial.Mark( SERIAL_LOG_RESUME );
+	
+	uploads++;
+	if( ret < 0 )
+	{
+		upload_errors++;
+	}
+	
+	return ret;
+	
+} /* SessionClass::Upload */
@@ -0,0 +1,43 @@
+#ifndef _SESSION_H
+#define _SESSION_H
+
+#include <string>
+#include "serial.h"
+#include "siofs.h"
+
+/* Everything that belongs to one serial port: the port itself, its SIOFS
+ * state (handles, directory iterator and working directory) and stats.
+ * Several sessions can be served from the same process. */
+
+#define UPLOAD_EXE		0
+#define UPLOAD_BIN		1
+#define UPLOAD_PATCH	2
+
+class SessionClass {
+public:
+	SessionClass();
+	virtual ~SessionClass();
+	
+	SerialClass::ErrorType Open(const char* device, int rate, int handshake = 0);
+	void Close();
+	
+	/* Receives pending bytes from the port, servicing any SIOFS command
+	 * found in them. Console text is left in buffer (NUL terminated),
+	 * returns its length or 0 if there is nothing to show. */
+	int Service(char* buffer, int size);
+	
+	/* Uploads a PS-EXE, binary or patch binary to this port */
+	int Upload(int type, const char* file, unsigned int addr = 0);
+	
+	SerialClass		serial;
+	SiofsClass		siofs;
+	
+	unsigned int	uploads;
+	unsigned int	upload_errors;
+	int				line_start;
+	
+	/* Bytes shown in -hexdump so far */
+	unsigned long long hex_offset;
+};
+
+#endif // _SESSION_H
@@ -0,0 +1,27 @@
+#ifndef __WIN32__
+#include <pthread.h>
+#endif
+#include "sigblock.h"
+
+SignalBlockClass::SignalBlockClass()
+{
+#ifndef __WIN32__
+	sigset_t set;
+	
+	sigemptyset( &set );
+	sigaddset( &set, SIGINT );
+	sigaddset( &set, SIGTERM );
+	sigaddset( &set, SIGUSR1 );
+	
+	pthread_sigmask( SIG_BLOCK, &set, &old );
+#endif
+	
+} /* SignalBlockClass::SignalBlockClass */
+
+SignalBlockClass::~SignalBlockClass()
+{
+#ifndef __WIN32__
+	pthread_sigmask( SIG_SETMASK, &old, nullptr );
+#endif
+	
+} /* SignalBlockClass::~SignalBlockClass */
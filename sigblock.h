@@ -0,0 +1,26 @@
+#ifndef _SIGBLOCK_H
+#define _SIGBLOCK_H
+
+#ifndef __WIN32__
+#include <signal.h>
+#endif
+
+/* Blocks SIGINT, SIGTERM and SIGUSR1 in the calling thread for as long as
+ * it is in scope. Threads start with the signal mask of the thread that
+ * creates them, so helper threads created under one never run the
+ * handlers, which print through the console ring and close sessions and
+ * are only safe on the main thread. */
+
+class SignalBlockClass {
+public:
+	SignalBlockClass();
+	virtual ~SignalBlockClass();
+	
+private:
+	
+#ifndef __WIN32__
+	sigset_t		old;
+#endif
+};
+
+#endif // _SIGBLOCK_H
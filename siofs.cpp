@@ -1,19 +1,72 @@
 #ifdef __WIN32__
 #include <windows.h>
-#include <shlwapi.h>
 #endif
 
 #include <sys/stat.h>
+#include <stdlib.h>
 #include <string.h>
-#include <malloc.h>
 #include <time.h>
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <set>
+#include <future>
+#include <chrono>
 #include <unistd.h>
+#ifndef __WIN32__
+#include <sys/mman.h>
+#endif
 #include "serial.h"
 #include "siofs.h"
+#include "trace.h"
+#include "sigblock.h"
 
 int fs_messages = false;
+int fs_sync = FS_SYNC_NONE;
+
+// Metrics are kept in this order. Commands that go by file name must see
+// writes still held back.
+static const struct {
+	const char*	name;
+	int			by_name;
+} siofsCommands[] = {
+	{ "~FRS", false }, { "~FOP", true }, { "~FCL", false }, { "~FRQ", true },
+	{ "~FMR", true }, { "~FCR", false }, { "~FSO", true }, { "~FSC", false },
+	{ "~FWR", false }, { "~FRD", false }, { "~FGS", false }, { "~FSK", false },
+	{ "~FTL", false }, { "~FLF", true }, { "~FLN", false }, { "~FLS", true },
+	{ "~FST", true }, { "~FSM", true }, { "~FCD", false }, { "~FWD", false }
+};
+
+#define SIOFS_COMMANDS	( sizeof(siofsCommands)/sizeof(siofsCommands[0]) )
+
+static long long msecNow() {
+	
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+	
+}
+
+static long long usecNow() {
+	
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+	
+}
+
+static long long nsecNow() {
+	
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+	
+}
+
+static int metricBucket(unsigned long long usec) {
+	
+	int n = usec ? 64-__builtin_clzll(usec) : 0;
+	
+	return ( n < SIOFS_METRIC_BUCKETS ) ? n : SIOFS_METRIC_BUCKETS-1;
+	
+}
 
 #ifndef __WIN32__
 void Sleep(int msec) {
@@ -67,57 +120,38 @@ static unsigned short crc16(void* buff, int bytes, unsigned short crc) {
 
 }
 
-static int testPattern(const char* name, const char* pattern) {
-	
-#ifdef __WIN32__
-	const char *pos = pattern;
-	char ext_temp[32];
-	int c=0;
-	
-	while(1) {
-		
-		const char* npos = strchr(pos, ';');
-		
-		if ( npos == nullptr ) {
-			if ( c == 0 ) {
-
-				return PathMatchSpec(name, pattern);
-
-			} else {
-				
-				return PathMatchSpec(name, pos);
-				
-			}
-		}
-		
-		memset(ext_temp, 0x0, 32);
-		strncpy(ext_temp, pos, (int)(npos-pos));
-		
-		if ( PathMatchSpec(name, ext_temp) ) {
-			return 1;
-		}
-				
-		pos = npos+1;
-		c++;
-		
-	}
-#endif
-	
-	return 0;
-	
-}
-
 SiofsClass::SiofsClass() {
 	
 	memset(handles, 0x00, sizeof(FILE*)*SIOFS_HANDLES);
 	hDir = nullptr;
+	cache = nullptr;
+	index = nullptr;
+	pack = nullptr;
+	writer = nullptr;
+	write_bytes = 0;
+	write_calls = 0;
+	
+	memset(wtime, 0x0, sizeof(wtime));
+	memset(werr, 0x0, sizeof(werr));
+	queries = 0;
+	
+	stream.fp = nullptr;
+	stream.mem = nullptr;
+	stream.count = 0;
+	stream_packets = 0;
+	stream_late = 0;
+	stream_late_max = 0;
+	retries = 0;
 	
 }
 
 SiofsClass::~SiofsClass() {
 	
+	StreamClose();
+	
 	for(int i=0; i<SIOFS_HANDLES; i++) {
 		if ( handles[i] ) {
+			FlushHandle(i);
 			fclose(handles[i]);
 		}
 	}
@@ -128,10 +162,161 @@ SiofsClass::~SiofsClass() {
 	
 }
 
+int SiofsClass::SetRoot(const char* path) {
+	
+	return this->path.SetRoot(path);
+	
+}
+
+int SiofsClass::SetDir(const char* path) {
+	
+	return this->path.SetDir(path);
+	
+}
+
+void SiofsClass::SetCache(AssetCacheClass* assets) {
+	
+	cache = assets;
+	
+}
+
+void SiofsClass::SetIndex(DirIndexClass* dirs) {
+	
+	index = dirs;
+	path.SetIndex(dirs);
+	
+}
+
+void SiofsClass::SetPack(PackClass* packs) {
+	
+	pack = packs;
+	
+}
+
+void SiofsClass::SetWriter(WriteBehindClass* writes) {
+	
+	writer = writes;
+	
+}
+
+void SiofsClass::EnableMetrics() {
+	
+	metrics.resize(SIOFS_COMMANDS);
+	memset(metrics.data(), 0x0, sizeof(METRIC)*metrics.size());
+	
+}
+
+void SiofsClass::Metrics(std::vector<std::string>& lines) {
+	
+	char line[512];
+	
+	for(int i=0; i<metrics.size(); i++) {
+		
+		const METRIC* m = &metrics[i];
+		
+		if ( m->count == 0 ) {
+			continue;
+		}
+		
+		snprintf(line, sizeof(line), "%s count %llu in %llu out %llu "
+			"retries %llu timeouts %llu disk_us %llu wire_us %llu",
+			siofsCommands[i].name+1, m->count, m->bytes_in, m->bytes_out,
+			m->retries, m->timeouts, m->disk_usec, m->wire_usec);
+		lines.push_back(line);
+		
+		// Buckets go by their upper bound in microseconds
+		for(int h=0; h<2; h++) {
+			
+			const unsigned int* hist = h ? m->wire_hist : m->disk_hist;
+			int len = snprintf(line, sizeof(line), "%s %s_hist",
+				siofsCommands[i].name+1, h ? "wire" : "disk");
+			
+			for(int b=0; b<SIOFS_METRIC_BUCKETS; b++) {
+				if ( hist[b] == 0 ) {
+					continue;
+				}
+				if ( b < SIOFS_METRIC_BUCKETS-1 ) {
+					len += snprintf(line+len, sizeof(line)-len, " %llu:%u",
+						1ULL<<b, hist[b]);
+				} else {
+					len += snprintf(line+len, sizeof(line)-len, " inf:%u",
+						hist[b]);
+				}
+			}
+			lines.push_back(line);
+		}
+	}
+	
+}
+
 int SiofsClass::Query(const char* cmd, SerialClass* comm) {
 	
 	serial = comm;
 	
+	int num = -1;
+	long long start = 0;
+	unsigned long long rx = 0, tx = 0, io = 0, lost = 0, retried = 0;
+	
+	for(int i=0; i<SIOFS_COMMANDS; i++) {
+		if ( strcmp(cmd, siofsCommands[i].name) == 0 ) {
+			num = i;
+			break;
+		}
+	}
+	
+	if ( !metrics.empty() ) {
+		start = nsecNow();
+		rx = serial->rx_bytes;
+		tx = serial->tx_bytes;
+		io = serial->io_nsec;
+		lost = serial->rx_timeouts;
+		retried = retries;
+	}
+	
+	TRACE_STR( TRACE_CMD, "FS: %s", cmd );
+	
+	if ( ( num >= 0 ) && siofsCommands[num].by_name ) {
+		for(int i=0; i<SIOFS_HANDLES; i++) {
+			FlushBuffer(i);
+		}
+		if ( writer ) {
+			writer->FlushAll();
+		}
+	}
+	
+	if ( Dispatch(cmd) ) {
+		
+		queries++;
+		TRACE_STR( TRACE_CMD, "FS: %s done", cmd );
+		
+		if ( ( num >= 0 ) && !metrics.empty() ) {
+			
+			METRIC* m = &metrics[num];
+			unsigned long long wire = ( serial->io_nsec-io )/1000;
+			unsigned long long total = ( nsecNow()-start )/1000;
+			unsigned long long disk = ( total > wire ) ? total-wire : 0;
+			
+			m->count++;
+			m->bytes_in += serial->rx_bytes-rx;
+			m->bytes_out += serial->tx_bytes-tx;
+			m->retries += retries-retried;
+			m->timeouts += serial->rx_timeouts-lost;
+			m->disk_usec += disk;
+			m->wire_usec += wire;
+			m->disk_hist[metricBucket(disk)]++;
+			m->wire_hist[metricBucket(wire)]++;
+			
+		}
+		
+		return 1;
+	}
+	
+	return 0;
+	
+}
+
+int SiofsClass::Dispatch(const char* cmd) {
+	
 	// File open
 	if ( strcmp(cmd, "~FRS") == 0 ) {
 		
@@ -171,6 +356,42 @@ int SiofsClass::Query(const char* cmd, SerialClass* comm) {
 		FsReadQuick();
 		return 1;
 		
+	// Read regions of several files at once
+	} else if ( strcmp(cmd, "~FMR") == 0 ) {
+		
+		if ( fs_messages ) {
+			printf( "FS: File read multiple.\n" );
+		}
+		
+		FsReadMulti();
+		return 1;
+		
+	// Read sectors off the mounted CD image
+	} else if ( strcmp(cmd, "~FCR") == 0 ) {
+		
+		if ( fs_messages ) {
+			printf( "FS: CD sector read.\n" );
+		}
+		
+		FsReadSectors();
+		return 1;
+		
+	// Open a rate controlled stream
+	} else if ( strcmp(cmd, "~FSO") == 0 ) {
+		
+		if ( fs_messages ) {
+			printf( "FS: Stream open.\n" );
+		}
+		
+		FsStreamOpen();
+		return 1;
+		
+	// Stream acknowledge, throttle and resync
+	} else if ( strcmp(cmd, "~FSC") == 0 ) {
+		
+		FsStreamControl();
+		return 1;
+		
 	// File write
 	} else if ( strcmp(cmd, "~FWR") == 0 ) {
 
@@ -261,6 +482,16 @@ int SiofsClass::Query(const char* cmd, SerialClass* comm) {
 		FsStat();
 		return 1;
 		
+	// Stat several files at once
+	} else if ( strcmp(cmd, "~FSM") == 0 ) {
+		
+		if ( fs_messages ) {
+			printf( "FS: File stat multiple.\n" );
+		}
+		
+		FsStatMulti();
+		return 1;
+		
 	} else if ( strcmp(cmd, "~FCD") == 0 ) {
 		
 		if ( fs_messages ) {
@@ -299,6 +530,65 @@ int SiofsClass::TestHandle(int hnum) {
 	
 }
 
+int SiofsClass::FlushBuffer(int hnum) {
+	
+	std::vector<char>& pending = wbuf[hnum];
+	
+	if ( pending.empty() ) {
+		return 0;
+	}
+	
+	if ( writer ) {
+		writer->Write(handles[hnum], pending.data(), pending.size(), &write_calls);
+	} else {
+		write_calls++;
+		if ( fwrite(pending.data(), 1, pending.size(), handles[hnum]) != pending.size() ) {
+			werr[hnum] = 1;
+		}
+	}
+	
+	pending.clear();
+	
+	// Don't sit on the memory of one big write
+	if ( pending.capacity() > 2*SIOFS_COALESCE_SIZE ) {
+		std::vector<char>().swap(pending);
+	}
+	
+	return werr[hnum] ? -1 : 0;
+	
+}
+
+int SiofsClass::FlushHandle(int hnum) {
+	
+	if ( handles[hnum] == nullptr ) {
+		return 0;
+	}
+	
+	// Anything else done with a handle has to see its pending writes
+	FlushBuffer(hnum);
+	
+	if ( writer && ( writer->Flush(handles[hnum]) < 0 ) ) {
+		werr[hnum] = 1;
+	}
+	
+	return werr[hnum] ? -1 : 0;
+	
+}
+
+void SiofsClass::Poll() {
+	
+	long long now = msecNow();
+	
+	for(int i=0; i<SIOFS_HANDLES; i++) {
+		if ( !wbuf[i].empty() && ( now-wtime[i] >= SIOFS_COALESCE_IDLE ) ) {
+			FlushBuffer(i);
+		}
+	}
+	
+	StreamPush();
+	
+}
+
 void SiofsClass::FsInit() {
 	
 	int ver;
@@ -309,8 +599,13 @@ void SiofsClass::FsInit() {
 	
 	for(int i=0; i<SIOFS_HANDLES; i++) {
 		if ( handles[i] ) {
+			FlushHandle(i);
+			if ( fs_sync >= FS_SYNC_CLOSE ) {
+				WriteBehindClass::Sync(handles[i]);
+			}
 			fclose( handles[i] );
 			handles[i] = nullptr;
+			werr[i] = 0;
 		}
 	}
 	
@@ -319,6 +614,37 @@ void SiofsClass::FsInit() {
 		hDir = nullptr;
 	}
 	
+	StreamClose();
+	
+	path.Reset();
+	path.Flush();
+	
+}
+
+int SiofsClass::ReceiveName(char* name, int size, int length) {
+	
+	int keep = ( length < size ) ? length : size-1;
+	int received = serial->ReceiveAll(name, keep);
+	
+	name[( received > 0 ) ? received : 0] = 0;
+	
+	if ( received == keep ) {
+		char skip[256];
+		while ( received < length ) {
+			int n = length-received;
+			if ( n > (int)sizeof(skip) ) {
+				n = sizeof(skip);
+			}
+			n = serial->ReceiveAll(skip, n);
+			if ( n <= 0 ) {
+				break;
+			}
+			received += n;
+		}
+	}
+	
+	return( received );
+	
 }
 
 void SiofsClass::FsOpen() {
@@ -338,12 +664,12 @@ void SiofsClass::FsOpen() {
 	}
 	
 	// Receive file name
-	memset(file.filename, 0x0, 64);
-	serial->ReceiveBytes(file.filename, file.length);
+	ReceiveName(file.filename, sizeof(file.filename), file.length);
 	
 	if ( fs_messages ){
 		printf( "FS: File = %s\n", file.filename );
 	}
+	TRACE_STR( TRACE_STEP, "FS: open %s flags %lld", file.filename, file.flags );
 	
 	// Search for a vacant handle
 	int hnum = -1;
@@ -373,17 +699,30 @@ void SiofsClass::FsOpen() {
 	}
 	
 	if ( fs_messages ) {
-		printf( "FS: mode = %d\n", fparam );
+		printf( "FS: mode = %s\n", fparam );
 	}
 	
-	// File open
-	FILE* fp = fopen(file.filename, fparam);
+	// Packed files shadow host ones and are read-only
+	const PackClass::ENTRY* packed = PackFind(file.filename);
+	FILE* fp = nullptr;
+	
+	if ( packed == nullptr ) {
+		fp = path.Open(file.filename, fparam);
+	} else if ( !packed->dir && !(file.flags & SIOFS_WRITE) ) {
+#ifndef __WIN32__
+		const char* mem = pack->Data(packed);
+		if ( mem ) {
+			fp = fmemopen((void*)mem, packed->size, "rb");
+		}
+#endif
+	}
 	
 	if ( !fp ) {
 		
 		if ( fs_messages ) {
-			printf( "FS: ERROR - Cannot open file." );
+			printf( "FS: ERROR - Cannot open file.\n" );
 		}
+		TRACE_STR( TRACE_STEP, "FS: open %s failed", file.filename );
 		
 		fparam[0] = -1;
 		serial->SendBytes(fparam, 1);
@@ -393,130 +732,1092 @@ void SiofsClass::FsOpen() {
 	
 	// Set and send file handle number
 	if ( fs_messages ) {
-		printf( "FS: Handle = %s\n", hnum );
+		printf( "FS: Handle = %d\n", hnum );
+	}
+	TRACE( TRACE_STEP, "FS: open handle %lld", hnum );
+	
+	// Writes coalesced with -wb would only be split up again by stdio
+	// buffering, without it stdio is what merges them
+	if ( writer && ( fs_sync != FS_SYNC_WRITE ) &&
+		( ( file.flags & (SIOFS_READ|SIOFS_WRITE) ) == SIOFS_WRITE ) ) {
+		setvbuf(fp, nullptr, _IONBF, 0);
 	}
 	
 	handles[hnum] = fp;
+	werr[hnum] = 0;
 	serial->SendBytes(&hnum, 1);
 	
 }
 
-void SiofsClass::FsReadQuick() {
+static std::string crcKey(const struct stat* attr, long long start, int len) {
 	
-	int ret;
-	int len;
-	char filename[128];
-	SFS_QREADSTRUCT param;
+	char key[96];
 	
-	ret = 0;
-	memset(filename, 0, 128);
+	snprintf(key, sizeof(key), "%llx:%llx:%llx:%llx:%llx:%x", 
+		(long long)attr->st_dev, (long long)attr->st_ino, (long long)attr->st_size,
+		(long long)attr->st_mtime, start, len);
 	
-	// Send accept character
-	serial->SendBytes((void*)"K", 1);
+	return key;
 	
-	// Receive file name
-	serial->ReceiveBytes(&ret, 1);
-	serial->ReceiveBytes(filename, ret);
+}
+
+int SiofsClass::CrcLookup(const struct stat* attr, long long start, int len,
+	unsigned short* crc, int* avail) {
 	
-	if ( fs_messages ) {
-		printf( "FS: Filename = %s\n", filename );
-	}
+#ifndef __WIN32__
 	
-	// Open requested file
-	FILE* fp = fopen(filename, "rb");
+	auto it = crcs.find(crcKey(attr, start, len));
 	
-	// Send response code
-	if ( fp == nullptr ) {
-		ret = 1;
-	} else {
-		ret = 0;
+	if ( it != crcs.end() ) {
+		*crc = it->second.first;
+		*avail = it->second.second;
+		return 0;
 	}
 	
-	serial->SendBytes(&ret, 1);
+#endif
 	
-	if ( ret > 0 ) {
-		return;
-	}
+	return -1;
 	
-	if ( serial->ReceiveBytes(&param, sizeof(SFS_READSTRUCT)) 
-		!= sizeof(SFS_READSTRUCT) ) {
-		
-		if ( fs_messages ) {
-			printf( "FS: Timeout.\n" );
-		}
-		
-		return;
-		
-	}
+}
+
+void SiofsClass::CrcStore(const struct stat* attr, long long start, int len,
+	unsigned short crc, int avail) {
 	
-	printf( "FS: Length = %d\n", param.length );
-	printf( "FS: Offset = %d\n", param.offset );
+	// No inode numbers to tell files apart on Win32
+#ifndef __WIN32__
 	
-	if ( fseek(fp, param.offset, SEEK_SET) ) {
-		ret = 2;
-		serial->SendBytes(&ret, 2);
-		ret = 0;
-		serial->SendBytes(&ret, 2);
-		fclose(fp);
+	// Files touched within the last couple of seconds could change again
+	// without their size or timestamp showing it
+	if ( time(nullptr)-attr->st_mtime < 2 ) {
 		return;
 	}
 	
-	char* buffer = (char*)malloc(param.length);
-	len = fread(buffer, 1, param.length, fp);
+	std::string key = crcKey(attr, start, len);
 	
-	if ( len == 0 ) {
-		ret = 1;
-		serial->SendBytes(&ret, 2);
-		ret = 0;
-		serial->SendBytes(&ret, 2);
-		free(buffer);
-		fclose(fp);
+	if ( crcs.find(key) != crcs.end() ) {
 		return;
 	}
 	
-	ret = 0;
-	serial->SendBytes(&ret, 2);
-	ret = crc16(buffer, len, 0);
-	serial->SendBytes(&ret, 2);
-	serial->SendBytes(&len, 4);
+	if ( crcs.size() >= SIOFS_CRC_MEMO ) {
+		crcs.erase(crc_order.front());
+		crc_order.pop_front();
+	}
 	
-	if ( serial->ReceiveBytes(&ret, 1) != 1 ) {
-		
-		if ( fs_messages ) {
-			printf( "FS: Timeout.\n" );
+	crcs[key] = std::make_pair(crc, avail);
+	crc_order.push_back(key);
+	
+#endif
+	
+}
+
+int SiofsClass::RangeCrc(FILE* fp, long long start, int len, unsigned short* crc) {
+	
+	struct stat attr;
+	int avail;
+	
+	int known = ( fstat(fileno(fp), &attr) == 0 );
+	
+	if ( known && ( CrcLookup(&attr, start, len, crc, &avail) == 0 ) ) {
+		return avail;
+	}
+	
+	*crc = 0;
+	avail = 0;
+	
+#ifndef __WIN32__
+	
+	// Pre-pass over a mapping of the range, nothing gets copied out
+	if ( known && S_ISREG(attr.st_mode) ) {
+		
+		if ( start >= attr.st_size ) {
+			return 0;
+		}
+		
+		avail = ( attr.st_size-start < len ) ? attr.st_size-start : len;
+		
+		long long base = start&~((long long)sysconf(_SC_PAGESIZE)-1);
+		size_t size = avail+(start-base);
+		
+		fflush(fp);
+		
+		void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fileno(fp), base);
+		
+		if ( map != MAP_FAILED ) {
+			
+			madvise(map, size, MADV_SEQUENTIAL);
+			*crc = crc16((char*)map+(start-base), avail, 0);
+			munmap(map, size);
+			
+			CrcStore(&attr, start, len, *crc, avail);
+			
+			return avail;
+		}
+		
+		avail = 0;
+	}
+	
+#endif
+	
+	// Pre-pass, the data is read again as it is sent
+	BufferPoolClass::Lease lease = buffers.Get(SIOFS_CHUNK);
+	
+	if ( fseeko(fp, start, SEEK_SET) ) {
+		return 0;
+	}
+	
+	while( avail < len ) {
+		
+		int want = ( len-avail > SIOFS_CHUNK ) ? SIOFS_CHUNK : len-avail;
+		int got = fread(lease.Data(), 1, want, fp);
+		
+		if ( got <= 0 ) {
+			break;
+		}
+		
+		*crc = crc16(lease.Data(), got, *crc);
+		avail += got;
+		
+	}
+	
+	if ( known ) {
+		CrcStore(&attr, start, len, *crc, avail);
+	}
+	
+	return avail;
+	
+}
+
+int SiofsClass::StreamRange(FILE* fp, long long start, int len) {
+	
+#ifndef __WIN32__
+	
+	// The kernel moves it from the page cache to the port, stdio must not
+	// be holding anything back for the file. Packed files have no fd.
+	if ( fileno(fp) >= 0 ) {
+		fflush(fp);
+		return ( serial->SendFile(fileno(fp), start, len) == len ) ? 0 : -1;
+	}
+	
+#endif
+	
+	BufferPoolClass::Lease chunk[2];
+	int sent = 0;
+	int cur = 0;
+	
+	chunk[0] = buffers.Get(SIOFS_CHUNK);
+	chunk[1] = buffers.Get(SIOFS_CHUNK);
+	
+	auto readChunk = [fp, len](char* buffer, int offset) {
+		int want = ( len-offset > SIOFS_CHUNK ) ? SIOFS_CHUNK : len-offset;
+		return (int)fread(buffer, 1, want, fp);
+	};
+	
+	if ( fseeko(fp, start, SEEK_SET) ) {
+		return -1;
+	}
+	
+	int got = readChunk(chunk[0].Data(), 0);
+	
+	while( got > 0 ) {
+		
+		std::future<int> next;
+		
+		// The next chunk comes off the disk while this one is on the wire
+		if ( sent+got < len ) {
+			SignalBlockClass block;
+			next = std::async(std::launch::async, readChunk, 
+				chunk[cur^1].Data(), sent+got);
+		}
+		
+		serial->SendBytes(chunk[cur].Data(), got);
+		sent += got;
+		
+		got = next.valid() ? next.get() : 0;
+		cur ^= 1;
+		
+	}
+	
+	return ( sent == len ) ? 0 : -1;
+	
+}
+
+void SiofsClass::StreamRead(FILE* fp, long long start, int len, int quick) {
+	
+	SFS_READREPLY response;
+	unsigned short crc;
+	int ret;
+	
+	int avail = RangeCrc(fp, start, len, &crc);
+	
+	// ~FRQ fails with just the return code and a zero short, the way
+	// shorter reads do
+	if ( quick && ( avail == 0 ) ) {
+		ret = 1;
+		serial->SendBytes(&ret, 2);
+		ret = 0;
+		serial->SendBytes(&ret, 2);
+		return;
+	}
+	
+	// Same header for both otherwise, ~FRQ just has no EOF code
+	response.ret = 0;
+	if ( ( avail < len ) && !quick ) {
+		response.ret = 4;
+	}
+	response.crc16 = ( avail > 0 ) ? crc : 0;
+	response.length = avail;
+	
+	serial->SendBytes(&response, sizeof(SFS_READREPLY));
+	
+	if ( avail > 0 ) {
+		
+		ret = 0;
+		if ( serial->ReceiveBytes(&ret, 1) != 1 ) {
+			if ( fs_messages ) {
+				printf( "FS: Timeout.\n" );
+			}
+			avail = 0;
+		}
+		
+		while( avail > 0 ) {
+			
+			StreamRange(fp, start, avail);
+			
+			// ~FRQ answers with a short, ~FRD with a byte
+			ret = 0;
+			if ( serial->ReceiveBytes(&ret, quick ? 2 : 1) != ( quick ? 2 : 1 ) ) {
+				if ( fs_messages ) {
+					printf( "FS: Timeout.\n" );
+				}
+				break;
+			}
+			
+			if ( ret == 0 ) {
+				break;
+			}
+			
+			retries++;
+			
+			if ( fs_messages ) {
+				printf( "FS: Data incomplete or CRC16 mismatch on client. Retrying.\n" );
+			}
+			TRACE( TRACE_STEP, "FS: read at %lld retried, client returned %lld", start, ret );
+			
+		}
+		
+	}
+	
+	// Leave the file where a single read would have
+	fseeko(fp, start+avail, SEEK_SET);
+	
+}
+
+void SiofsClass::FsReadQuick() {
+	
+	int ret;
+	int len;
+	char filename[256];
+	SFS_QREADSTRUCT param;
+	AssetCacheClass::Data data;
+	BufferPoolClass::Lease lease;
+	
+	ret = 0;
+	memset(filename, 0, 256);
+	
+	// Send accept character
+	serial->SendBytes((void*)"K", 1);
+	
+	// Receive file name
+	serial->ReceiveBytes(&ret, 1);
+	serial->ReceiveAll(filename, ret);
+	
+	if ( fs_messages ) {
+		printf( "FS: Filename = %s\n", filename );
+	}
+	TRACE_STR( TRACE_STEP, "FS: quick read %s", filename );
+	
+	// Quick reads are whole asset loads most of the time, serve them from
+	// the pack or the shared cache when possible
+	const PackClass::ENTRY* packed = PackFind(filename);
+	const char* mem = nullptr;
+	size_t memsize = 0;
+	struct stat attr;
+	
+	if ( packed ) {
+		if ( !packed->dir ) {
+			mem = pack->Data(packed);
+			memsize = packed->size;
+		}
+	} else if ( cache && ( path.Stat(filename, &attr) == 0 ) ) {
+		data = cache->Get(path.HostPath(filename), attr, [&]() {
+			return path.Open(filename, "rb");
+		});
+		if ( data ) {
+			mem = data->data();
+			memsize = data->size();
+		}
+	}
+	
+	// Open requested file, closed on every way out
+	std::unique_ptr<FILE, int(*)(FILE*)> fp(nullptr, fclose);
+	
+	if ( !mem && !packed ) {
+		fp.reset(path.Open(filename, "rb"));
+	}
+	
+	// Send response code
+	if ( !fp && !mem ) {
+		ret = 1;
+	} else {
+		ret = 0;
+	}
+	
+	serial->SendBytes(&ret, 1);
+	
+	if ( ret > 0 ) {
+		return;
+	}
+	
+	if ( serial->ReceiveBytes(&param, sizeof(SFS_READSTRUCT)) 
+		!= sizeof(SFS_READSTRUCT) ) {
+		
+		if ( fs_messages ) {
+			printf( "FS: Timeout.\n" );
+		}
+		return;
+		
+	}
+	
+	if ( fs_messages ) {
+		printf( "FS: Length = %d\n", param.length );
+		printf( "FS: Offset = %d\n", param.offset );
+	}
+	TRACE( TRACE_STEP, "FS: quick read %lld at %lld", param.length, param.offset );
+	
+	// Longer requests just come up short
+	if ( param.length > buffers.max_request ) {
+		param.length = buffers.max_request;
+	}
+	
+	// Big reads are sent chunk by chunk as they come off the disk
+	if ( fp && ( param.length > SIOFS_CHUNK ) ) {
+		StreamRead(fp.get(), param.offset, param.length, true);
+		return;
+	}
+	
+	if ( fp && fseek(fp.get(), param.offset, SEEK_SET) ) {
+		ret = 2;
+		serial->SendBytes(&ret, 2);
+		ret = 0;
+		serial->SendBytes(&ret, 2);
+		return;
+	}
+	
+	char* buffer;
+	
+	if ( mem ) {
+		
+		len = 0;
+		if ( param.offset < memsize ) {
+			len = memsize-param.offset;
+			if ( len > param.length ) {
+				len = param.length;
+			}
+		}
+		buffer = (char*)mem+param.offset;
+		
+	} else {
+		
+		lease = buffers.Get(( param.length > 0 ) ? param.length : 1);
+		buffer = lease.Data();
+		len = fread(buffer, 1, param.length, fp.get());
+		
+	}
+	
+	if ( len == 0 ) {
+		ret = 1;
+		serial->SendBytes(&ret, 2);
+		ret = 0;
+		serial->SendBytes(&ret, 2);
+		return;
+	}
+	
+	// Whole asset loads repeat, so do their checksums
+	unsigned short crc;
+	int known;
+	
+	if ( !data || ( CrcLookup(&attr, param.offset, len, &crc, &known) < 0 ) ) {
+		crc = crc16(buffer, len, 0);
+		if ( data ) {
+			CrcStore(&attr, param.offset, len, crc, len);
+		}
+	}
+	
+	ret = 0;
+	serial->SendBytes(&ret, 2);
+	serial->SendBytes(&crc, 2);
+	serial->SendBytes(&len, 4);
+	
+	if ( serial->ReceiveBytes(&ret, 1) != 1 ) {
+		if ( fs_messages ) {
+			printf( "FS: Timeout.\n" );
+		}
+		return;
+	}
+	
+	while( 1 ) {
+		
+		serial->SendBytes(buffer, len);
+		
+		if ( serial->ReceiveBytes(&ret, 2) != 2 ) {
+			if ( fs_messages ) {
+				printf( "FS: Timeout H.\n" );
+			}
+			return;
+		}
+		
+		if ( ret == 0 ) {
+			break;
+		}
+		
+		retries++;
+		
+	}
+	
+}
+
+void SiofsClass::LoadRegion(MREGION* region) {
+	
+	region->status = 0;
+	region->ptr = nullptr;
+	region->len = 0;
+	
+	if ( ( region->fp == nullptr ) && ( region->packed == nullptr ) ) {
+		region->status = 1;
+		region->crc = 0;
+		return;
+	}
+	
+	long long length = region->length;
+	
+	if ( region->offset > region->attr.st_size ) {
+		region->status = 2;
+		region->crc = 0;
+		return;
+	}
+	
+	// Zero length reads up to the end of the file
+	if ( ( length == 0 ) || ( region->offset+length > region->attr.st_size ) ) {
+		length = region->attr.st_size-region->offset;
+	}
+	
+	// Longer regions just come up short, like ~FRD and ~FRQ
+	if ( length > (long long)buffers.max_request ) {
+		length = buffers.max_request;
+	}
+	
+	if ( region->packed ) {
+		
+		const char* mem = pack->Data(region->packed);
+		
+		if ( mem == nullptr ) {
+			region->status = 1;
+			region->crc = 0;
+			return;
+		}
+		
+		region->ptr = mem+region->offset;
+		region->len = length;
+		
+	} else if ( cache ) {
+		
+		FILE* fp = region->fp;
+		
+		region->data = cache->Get(region->host, region->attr, [&]() {
+			region->fp = nullptr;
+			return fp;
+		});
+		
+		if ( region->data ) {
+			region->ptr = region->data->data()+region->offset;
+			region->len = length;
+		}
+		
+	}
+	
+	if ( ( region->ptr == nullptr ) && region->fp ) {
+		
+		region->buffer.resize(length);
+		
+		if ( ( length > 0 ) && ( fseek(region->fp, region->offset, SEEK_SET) == 0 ) ) {
+			region->len = fread(region->buffer.data(), 1, length, region->fp);
+		}
+		region->ptr = region->buffer.data();
+		
+	}
+	
+	if ( region->len < length ) {
+		region->status = 3;
+	}
+	
+	region->crc = crc16((void*)region->ptr, region->len, 0);
+	
+}
+
+void SiofsClass::SendRegion(MREGION* region) {
+	
+	SFS_READREPLY reply;
+	
+	reply.ret = region->status;
+	reply.crc16 = region->crc;
+	reply.length = region->len;
+	
+	serial->SendBytes(&reply, sizeof(SFS_READREPLY));
+	
+	if ( region->len > 0 ) {
+		serial->SendBytes((void*)region->ptr, region->len);
+	}
+	
+	// Resends read the region again, don't hold on to it
+	region->data.reset();
+	std::vector<char>().swap(region->buffer);
+	region->ptr = nullptr;
+	
+}
+
+void SiofsClass::FsReadMulti() {
+	
+	unsigned short count, length;
+	int ret;
+	
+	// Send accept character
+	serial->SendBytes((void*)"K", 1);
+	
+	// Receive entry count and manifest length
+	if ( ( serial->ReceiveBytes(&count, 2) != 2 ) || 
+		( serial->ReceiveBytes(&length, 2) != 2 ) ) {
+		if ( fs_messages ) {
+			printf( "FS: Timeout.\n" );
+		}
+		return;
+	}
+	
+	std::vector<char> manifest(length);
+	
+	if ( serial->ReceiveAll(manifest.data(), length) != length ) {
+		if ( fs_messages ) {
+			printf( "FS: Timeout.\n" );
+		}
+		return;
+	}
+	
+	// Unpack offset, length and length prefixed name of every entry
+	std::vector<MREGION> regions;
+	const char* p = manifest.data();
+	const char* end = p+length;
+	
+	while( ( count <= SIOFS_MREAD_MAX ) && ( regions.size() < count ) && ( p+9 <= end ) ) {
+		
+		MREGION region;
+		int len = (unsigned char)p[8];
+		
+		memcpy(&region.offset, p, 4);
+		memcpy(&region.length, p+4, 4);
+		p += 9;
+		
+		if ( ( len == 0 ) || ( p+len > end ) ) {
+			break;
+		}
+		
+		region.name.assign(p, len);
+		region.fp = nullptr;
+		region.packed = nullptr;
+		p += len;
+		
+		regions.push_back(region);
+		
+	}
+	
+	if ( ( count > SIOFS_MREAD_MAX ) || ( regions.size() != count ) || ( p != end ) ) {
+		if ( fs_messages ) {
+			printf( "FS: ERROR: Malformed manifest.\n" );
+		}
+		TRACE( TRACE_STEP, "FS: read multiple malformed manifest" );
+		ret = 1;
+		serial->SendBytes(&ret, 2);
+		ret = 0;
+		serial->SendBytes(&ret, 2);
+		return;
+	}
+	
+	// Files are opened here, the read-ahead only does the reading
+	for(int i=0; i<regions.size(); i++) {
+		
+		MREGION* region = &regions[i];
+		
+		if ( fs_messages ) {
+			printf( "FS: %s (%u bytes at %u)\n", region->name.c_str(),
+				region->length, region->offset );
+		}
+		TRACE_STR( TRACE_STEP, "FS: region %s, %lld at %lld", region->name.c_str(),
+			region->length, region->offset );
+		
+		const PackClass::ENTRY* packed = PackFind(region->name.c_str());
+		
+		if ( packed ) {
+			if ( !packed->dir ) {
+				region->packed = packed;
+				PackClass::Stat(packed, &region->attr);
+			}
+		} else if ( path.Stat(region->name.c_str(), &region->attr) == 0 ) {
+			region->host = path.HostPath(region->name.c_str());
+			region->fp = path.Open(region->name.c_str(), "rb");
+		}
+		
+	}
+	
+	std::vector<std::future<void> > loads(regions.size());
+	int next = 0;
+	
+	auto readAhead = [&](int upto) {
+		SignalBlockClass block;
+		for(; ( next < regions.size() ) && ( next <= upto ); next++) {
+			loads[next] = std::async(std::launch::async, 
+				&SiofsClass::LoadRegion, this, &regions[next]);
+		}
+	};
+	
+	// Get the first entries going while the target gets ready
+	readAhead(SIOFS_MREAD_AHEAD-1);
+	
+	ret = 0;
+	serial->SendBytes(&ret, 2);
+	serial->SendBytes(&count, 2);
+	
+	ret = 0;
+	if ( ( serial->ReceiveBytes(&ret, 1) != 1 ) || ( ret != 'K' ) ) {
+		
+		if ( fs_messages ) {
+			printf( "FS: Timeout.\n" );
+		}
+		
+	} else {
+		
+		for(int i=0; i<regions.size(); i++) {
+			readAhead(i+SIOFS_MREAD_AHEAD);
+			loads[i].wait();
+			SendRegion(&regions[i]);
+		}
+		
+		// The target names the entries that came out bad
+		while( 1 ) {
+			
+			unsigned short resend = 0;
+			
+			if ( serial->ReceiveBytes(&resend, 2) != 2 ) {
+				if ( fs_messages ) {
+					printf( "FS: Timeout.\n" );
+				}
+				break;
+			}
+			
+			if ( resend == 0 ) {
+				break;
+			}
+			
+			std::vector<unsigned short> list(resend);
+			retries += resend;
+			
+			if ( serial->ReceiveAll(list.data(), resend*2) != resend*2 ) {
+				if ( fs_messages ) {
+					printf( "FS: Timeout.\n" );
+				}
+				break;
+			}
+			
+			for(int i=0; i<resend; i++) {
+				
+				if ( list[i] >= regions.size() ) {
+					continue;
+				}
+				
+				MREGION* region = &regions[list[i]];
+				
+				// The cache may have closed the file already
+				if ( ( region->fp == nullptr ) && !region->host.empty() ) {
+					region->fp = path.Open(region->name.c_str(), "rb");
+				}
+				
+				LoadRegion(region);
+				SendRegion(region);
+				
+			}
+			
+		}
+		
+	}
+	
+	for(int i=0; i<next; i++) {
+		loads[i].wait();
+	}
+	
+	for(int i=0; i<regions.size(); i++) {
+		if ( regions[i].fp ) {
+			fclose(regions[i].fp);
+		}
+	}
+	
+}
+
+void SiofsClass::FsReadSectors() {
+	
+	SFS_SECTORSTRUCT param;
+	SFS_READREPLY reply;
+	BufferPoolClass::Lease lease;
+	const char* data = nullptr;
+	int len = 0;
+	int ret;
+	
+	// Send accept character
+	serial->SendBytes((void*)"K", 1);
+	
+	if ( serial->ReceiveBytes(&param, sizeof(SFS_SECTORSTRUCT)) 
+		!= sizeof(SFS_SECTORSTRUCT) ) {
+		if ( fs_messages ) {
+			printf( "FS: Timeout.\n" );
+		}
+		return;
+	}
+	
+	if ( fs_messages ) {
+		printf( "FS: LBA = %u, sectors = %d%s\n", param.lba, param.count, 
+			param.raw ? " (raw)" : "" );
+	}
+	TRACE( TRACE_STEP, "FS: %lld sectors at lba %lld raw %lld", param.count, param.lba,
+		param.raw );
+	
+	memset(&reply, 0x0, sizeof(SFS_READREPLY));
+	
+	if ( ( param.count == 0 ) || ( param.count > SIOFS_SECTOR_MAX ) ) {
+		reply.ret = 4;
+	} else if ( pack == nullptr ) {
+		reply.ret = 1;
+	} else {
+		// Only used when the sectors have to be picked out of a raw image
+		lease = buffers.Get(param.count*2048);
+		len = pack->Sectors(param.lba, param.count, param.raw, lease.Data(), &data);
+		if ( len < 0 ) {
+			reply.ret = -len;
+			len = 0;
+		}
+	}
+	
+	if ( len > 0 ) {
+		reply.crc16 = crc16((void*)data, len, 0);
+		reply.length = len;
+	}
+	
+	serial->SendBytes(&reply, sizeof(SFS_READREPLY));
+	
+	if ( len == 0 ) {
+		return;
+	}
+	
+	ret = 0;
+	if ( ( serial->ReceiveBytes(&ret, 1) != 1 ) || ( ret != 'K' ) ) {
+		if ( fs_messages ) {
+			printf( "FS: Timeout.\n" );
+		}
+		return;
+	}
+	
+	while( 1 ) {
+		
+		serial->SendBytes((void*)data, len);
+		
+		ret = 0;
+		if ( serial->ReceiveBytes(&ret, 2) != 2 ) {
+			if ( fs_messages ) {
+				printf( "FS: Timeout.\n" );
+			}
 			return;
 		}
-		
-		free(buffer);
-		fclose(fp);
+		
+		if ( ret == 0 ) {
+			break;
+		}
+		
+	}
+	
+}
+
+void SiofsClass::FsStreamOpen() {
+	
+	SFS_STREAMSTRUCT param;
+	unsigned char length;
+	char filename[256];
+	long long size = 0;
+	int ret;
+	
+	// Send accept character
+	serial->SendBytes((void*)"K", 1);
+	
+	if ( ( serial->ReceiveBytes(&param, sizeof(SFS_STREAMSTRUCT)) 
+		!= sizeof(SFS_STREAMSTRUCT) ) || ( serial->ReceiveBytes(&length, 1) != 1 ) ) {
+		if ( fs_messages ) {
+			printf( "FS: Timeout.\n" );
+		}
 		return;
 	}
 	
-	while( 1 ) {
+	memset(filename, 0x0, 256);
+	if ( serial->ReceiveAll(filename, length) != length ) {
+		if ( fs_messages ) {
+			printf( "FS: Timeout.\n" );
+		}
+		return;
+	}
+	
+	if ( fs_messages ) {
+		printf( "FS: File = %s\n", filename );
+		printf( "FS: Rate = %u, packet = %d, depth = %d\n", param.rate, 
+			param.packet, param.depth );
+	}
+	TRACE_STR( TRACE_STEP, "FS: stream %s rate %lld packet %lld", filename, param.rate,
+		param.packet );
+	
+	// A new stream replaces the current one
+	StreamClose();
+	
+	ret = 0;
+	
+	if ( ( param.packet == 0 ) || ( param.packet > SIOFS_STREAM_PACKET_MAX ) ||
+		( param.depth == 0 ) || ( param.depth > SIOFS_STREAM_DEPTH_MAX ) ) {
 		
-		serial->SendBytes(buffer, len);
+		ret = 2;
 		
-		if ( serial->ReceiveBytes(&ret, 2) != 2 ) {
+	} else {
 		
-			if ( fs_messages ) {
-				printf( "FS: Timeout H.\n" );
-				return;
+		const PackClass::ENTRY* packed = PackFind(filename);
+		struct stat attr;
+		
+		if ( packed ) {
+			if ( !packed->dir ) {
+				stream.mem = pack->Data(packed);
+				size = packed->size;
 			}
+		} else if ( ( path.Stat(filename, &attr) == 0 ) && S_ISREG(attr.st_mode) ) {
+			stream.fp = path.Open(filename, "rb");
+			size = attr.st_size;
+		}
+		
+		if ( ( stream.fp == nullptr ) && ( stream.mem == nullptr ) ) {
+			ret = 1;
+		} else if ( param.offset > size ) {
+			ret = 2;
+		}
+		
+	}
+	
+	if ( ret == 0 ) {
+		
+		stream.offset = param.offset;
+		stream.length = size-param.offset;
+		if ( ( param.length > 0 ) && ( param.length < stream.length ) ) {
+			stream.length = param.length;
+		}
+		
+		stream.rate = param.rate;
+		stream.packet = param.packet;
+		stream.depth = param.depth;
+		stream.count = (stream.length+stream.packet-1)/stream.packet;
+		stream.next = 0;
+		stream.acked = 0;
+		stream.paused = false;
+		stream.buffer.resize(stream.packet);
+		
+		StreamRestart(0);
+		
+	} else {
+		
+		StreamClose();
+		
+	}
+	
+	serial->SendBytes(&ret, 2);
+	serial->SendBytes(&stream.count, 4);
+	
+}
 
-			free(buffer);
-			fclose(fp);
-			return;
+void SiofsClass::FsStreamControl() {
+	
+	unsigned char op;
+	unsigned int arg;
+	
+	// Send accept character
+	serial->SendBytes((void*)"K", 1);
+	
+	if ( ( serial->ReceiveBytes(&op, 1) != 1 ) || ( serial->ReceiveBytes(&arg, 4) != 4 ) ) {
+		if ( fs_messages ) {
+			printf( "FS: Timeout.\n" );
+		}
+		return;
+	}
+	
+	if ( ( stream.fp == nullptr ) && ( stream.mem == nullptr ) ) {
+		return;
+	}
+	
+	switch( op ) {
+	case SIOFS_STREAM_ACK:
+		// arg is the number of packets the target is done with
+		if ( ( arg > stream.acked ) && ( arg <= stream.next ) ) {
+			stream.acked = arg;
+		}
+		break;
+	case SIOFS_STREAM_PAUSE:
+		stream.paused = true;
+		break;
+	case SIOFS_STREAM_RESUME:
+		if ( stream.paused ) {
+			stream.paused = false;
+			StreamRestart(stream.next);
+		}
+		break;
+	case SIOFS_STREAM_RESYNC:
+		// Whatever is in flight is dropped, carry on from packet arg
+		if ( arg <= stream.count ) {
+			stream.next = arg;
+			stream.acked = arg;
+			StreamRestart(arg);
+		}
+		break;
+	case SIOFS_STREAM_RATE:
+		stream.rate = arg;
+		StreamRestart(stream.next);
+		break;
+	case SIOFS_STREAM_CLOSE:
+		StreamClose();
+		break;
+	}
+	
+	if ( fs_messages && ( op != SIOFS_STREAM_ACK ) ) {
+		printf( "FS: Stream control %d (%u).\n", op, arg );
+	}
+	TRACE( TRACE_STEP, "FS: stream control %lld (%lld)", op, arg );
+	
+}
+
+void SiofsClass::StreamRestart(unsigned int index) {
+	
+	// The schedule counts from here on
+	stream.base = index;
+	stream.start = usecNow();
+	stream.stalled = false;
+	
+}
+
+void SiofsClass::StreamPush() {
+	
+	if ( ( stream.fp == nullptr ) && ( stream.mem == nullptr ) ) {
+		return;
+	}
+	
+	// Done once the target has taken everything
+	if ( stream.acked >= stream.count ) {
+		StreamClose();
+		return;
+	}
+	
+	while( !stream.paused && ( stream.next < stream.count ) ) {
 		
+		long long now = usecNow();
+		long long due = stream.start;
+		
+		if ( stream.rate > 0 ) {
+			due += (long long)(stream.next-stream.base)*stream.packet*1000000/stream.rate;
 		}
 		
-		if ( ret == 0 ) {
+		if ( now < due ) {
+			break;
+		}
+		
+		// A full target buffer means it plays slower than the rate asked
+		// for, go at its pace instead of bursting to catch up later
+		if ( stream.next-stream.acked >= stream.depth ) {
+			stream.stalled = true;
 			break;
 		}
 		
+		if ( stream.stalled ) {
+			StreamRestart(stream.next);
+			due = stream.start;
+		}
+		
+		long long late = now-due;
+		
+		if ( late > SIOFS_STREAM_SLACK ) {
+			stream_late++;
+		}
+		if ( late > stream_late_max ) {
+			stream_late_max = late;
+		}
+		
+		long long pos = (long long)stream.next*stream.packet;
+		int len = ( stream.length-pos > stream.packet ) ? stream.packet : stream.length-pos;
+		const char* data;
+		
+		if ( stream.mem ) {
+			data = stream.mem+stream.offset+pos;
+		} else {
+			int want = len;
+			len = 0;
+			if ( fseeko(stream.fp, stream.offset+pos, SEEK_SET) == 0 ) {
+				len = fread(stream.buffer.data(), 1, want, stream.fp);
+			}
+			data = stream.buffer.data();
+		}
+		
+		SFS_STREAMPACKET header;
+		
+		header.magic = SIOFS_STREAM_MAGIC;
+		header.seq = stream.next;
+		header.length = len;
+		header.crc16 = crc16((void*)data, len, 0);
+		header.flags = ( stream.next+1 == stream.count );
+		
+		serial->SendBytes(&header, sizeof(SFS_STREAMPACKET));
+		serial->SendBytes((void*)data, len);
+		TRACE( TRACE_STEP, "FS: stream packet %lld, %lld bytes, %lld us late", stream.next,
+			len, late );
+		
+		stream.next++;
+		stream_packets++;
+		
+	}
+	
+}
+
+void SiofsClass::StreamClose() {
+	
+	if ( ( stream.fp == nullptr ) && ( stream.mem == nullptr ) ) {
+		return;
+	}
+	
+	if ( fs_messages ) {
+		printf( "FS: Stream closed, %u of %u packets sent.\n", stream.next, stream.count );
+	}
+	TRACE( TRACE_STEP, "FS: stream closed, %lld of %lld packets sent", stream.next,
+		stream.count );
+	
+	if ( stream.fp ) {
+		fclose(stream.fp);
 	}
 	
-	free(buffer);
-	fclose(fp);
+	stream.fp = nullptr;
+	stream.mem = nullptr;
+	stream.count = 0;
+	std::vector<char>().swap(stream.buffer);
 	
 }
 
@@ -538,6 +1839,7 @@ void SiofsClass::FsClose() {
 	if ( fs_messages ) {
 		printf( "FS: File handle = %d\n", hnum );
 	}
+	TRACE( TRACE_STEP, "FS: close handle %lld", hnum );
 	
 	ret = TestHandle(hnum);
 	
@@ -555,10 +1857,18 @@ void SiofsClass::FsClose() {
 		
 	}
 	
+	// Deferred writes that failed are reported here
+	ret = FlushHandle(hnum);
+	
+	if ( ( ret == 0 ) && ( fs_sync >= FS_SYNC_CLOSE ) ) {
+		ret = WriteBehindClass::Sync(handles[hnum]);
+	}
+	
 	fclose(handles[hnum]);
 	handles[hnum] = nullptr;
+	werr[hnum] = 0;
 	
-	hnum = 0;
+	hnum = ( ret < 0 ) ? 3 : 0;
 	serial->SendBytes(&hnum, 1);
 	
 }
@@ -582,15 +1892,26 @@ void SiofsClass::FsWrite() {
 		printf( "FS: Chksum = %04x\n", info.crc16 );
 		printf( "FS: Length = %d\n", info.length );
 	}
+	TRACE( TRACE_STEP, "FS: write handle %lld, %lld bytes crc %llx", info.fd, info.length,
+		info.crc16 );
 	int ret = TestHandle(info.fd);
 	
+	BufferPoolClass::Lease lease;
+	
+	if ( ( ret == 0 ) && ( info.length > 0 ) ) {
+		lease = buffers.Get(info.length);
+		if ( !lease ) {
+			ret = 3;
+		}
+	}
+	
 	serial->SendBytes(&ret, 1);
 		
 	if ( ret ) {
 		return;
 	}
 	
-	char* buffer = (char*)malloc(info.length);
+	char* buffer = lease.Data();
 	
 	while(1) {
 		
@@ -620,9 +1941,11 @@ void SiofsClass::FsWrite() {
 		// Check if received data is complete
 		if ( received < info.length ) {
 			ret = -3;
+			retries++;
 			if ( fs_messages ) {
 				printf( "FS: Data incomplete. Retrying.\n" );
 			}
+			TRACE( TRACE_STEP, "FS: write data incomplete, retrying" );
 			serial->SendBytes(&ret, 4);
 			continue;
 		}
@@ -630,9 +1953,11 @@ void SiofsClass::FsWrite() {
 		// Checksum
 		if ( crc16(buffer, info.length, 0) != info.crc16 ) {
 			ret = -2;
+			retries++;
 			if ( fs_messages ) {
 				printf( "FS: CRC mismatch. Retrying.\n" );
 			}
+			TRACE( TRACE_STEP, "FS: write CRC mismatch, retrying" );
 			serial->SendBytes(&ret, 4);
 			continue;
 		}
@@ -641,10 +1966,45 @@ void SiofsClass::FsWrite() {
 		
 	}
 	
-	printf( "FS: Wrote %d bytes.\n", info.length );
+	if ( fs_messages ) {
+		printf( "FS: Wrote %d bytes.\n", info.length );
+	}
+	TRACE( TRACE_STEP, "FS: wrote %lld bytes", info.length );
+	
+	write_bytes += info.length;
 	
-	ret = fwrite(buffer, 1, info.length, handles[info.fd]);
-	free(buffer);
+	if ( writer && ( fs_sync != FS_SYNC_WRITE ) ) {
+		
+		// Small writes pile up per handle and go out together once enough
+		// has come in, or on seek, close or when the target goes quiet.
+		// Only with -wb, failures then show up at ~FCL.
+		std::vector<char>& pending = wbuf[info.fd];
+		
+		pending.insert(pending.end(), buffer, buffer+info.length);
+		wtime[info.fd] = msecNow();
+		ret = info.length;
+		
+		if ( ( pending.size() >= SIOFS_COALESCE_SIZE ) && ( FlushBuffer(info.fd) < 0 ) ) {
+			ret = 0;
+		}
+		
+	} else if ( writer ) {
+		
+		// Acknowledged right away, a failure shows up at ~FCL
+		writer->Write(handles[info.fd], buffer, info.length, &write_calls);
+		ret = info.length;
+		
+	} else {
+		
+		ret = fwrite(buffer, 1, info.length, handles[info.fd]);
+		write_calls++;
+		
+		if ( ( ret > 0 ) && ( fs_sync == FS_SYNC_WRITE ) &&
+			WriteBehindClass::Sync(handles[info.fd]) ) {
+			ret = 0;
+		}
+		
+	}
 	
 	if ( ret == 0 ) {
 		ret = -1;
@@ -658,7 +2018,6 @@ void SiofsClass::FsRead() {
 	
 	SFS_READSTRUCT info;
 	SFS_READREPLY response;
-	char* buffer;
 	
 	serial->SendBytes((void*)"K", 1);
 	
@@ -673,6 +2032,7 @@ void SiofsClass::FsRead() {
 		printf( "FS: Handle = %d\n", info.fd );
 		printf( "FS: Length = %d\n", info.length );
 	}
+	TRACE( TRACE_STEP, "FS: read handle %lld, %lld bytes", info.fd, info.length );
 	
 	int ret = TestHandle(info.fd);
 	
@@ -680,15 +2040,38 @@ void SiofsClass::FsRead() {
 		response.ret = ret;
 		response.crc16 = 0;
 		response.length = 0;
-		serial->SendBytes(&ret, sizeof(SFS_READREPLY));
+		serial->SendBytes(&response, sizeof(SFS_READREPLY));
 		return;
 	}
 	
+	FlushHandle(info.fd);
+	
+	// Longer requests just come up short
+	if ( info.length < 0 ) {
+		info.length = 0;
+	} else if ( info.length > buffers.max_request ) {
+		info.length = buffers.max_request;
+	}
+	
+	FILE* fp = handles[info.fd];
+	long long start = ftello(fp);
+	
+	// Big reads are sent chunk by chunk as they come off the disk
+	if ( ( info.length > SIOFS_CHUNK ) && ( start >= 0 ) ) {
+		StreamRead(fp, start, info.length, false);
+		return;
+	}
+	
+	BufferPoolClass::Lease lease = buffers.Get(( info.length > 0 ) ? info.length : 1);
+	char* buffer = lease.Data();
+	
 	response.ret = 0;
 	
-	buffer = (char*)malloc(info.length);
-	int read = fread(buffer, 1, info.length, handles[info.fd]);
-			
+	int read = 0;
+	if ( info.length > 0 ) {
+		read = fread(buffer, 1, info.length, handles[info.fd]);
+	}
+	
 	if ( feof(handles[info.fd]) ) {
 		response.ret = 4;
 	}
@@ -712,7 +2095,6 @@ void SiofsClass::FsRead() {
 		if ( fs_messages ) {
 			printf( "FS: Timeout.\n" );
 		}
-		free(buffer);
 		return;
 	}
 	
@@ -725,21 +2107,24 @@ void SiofsClass::FsRead() {
 			if ( fs_messages ) {
 				printf( "FS: Timeout.\n" );
 			}
-			free(buffer);
 			return;
 		}
 		
 		if ( ret == 1 ) {
+			retries++;
 			if ( fs_messages ) {
 				printf( "FS: Data incomplete on client. Retrying.\n" );
 			}
+			TRACE( TRACE_STEP, "FS: read data incomplete on client, retrying" );
 			continue;
 		}
 		
 		if ( ret == 2 ) {
+			retries++;
 			if ( fs_messages ) {
 				printf( "FS: CRC16 mismatch on client. Retrying.\n" );
 			}
+			TRACE( TRACE_STEP, "FS: read CRC mismatch on client, retrying" );
 			continue;
 		}
 		
@@ -747,15 +2132,12 @@ void SiofsClass::FsRead() {
 	
 	}
 	
-	free(buffer);
-	
 }
 
 void SiofsClass::FsGets() {
 	
 	SFS_READSTRUCT info;
 	SFS_READREPLY response;
-	char* buffer;
 	
 	serial->SendBytes((void*)"K", 1);
 	
@@ -770,6 +2152,7 @@ void SiofsClass::FsGets() {
 		printf( "FS: Handle = %d\n", info.fd );
 		printf( "FS: Length = %d\n", info.length );
 	}
+	TRACE( TRACE_STEP, "FS: gets handle %lld, %lld bytes", info.fd, info.length );
 	
 	int ret = TestHandle(info.fd);
 	
@@ -777,19 +2160,29 @@ void SiofsClass::FsGets() {
 		response.ret = ret;
 		response.crc16 = 0;
 		response.length = 0;
-		serial->SendBytes(&ret, sizeof(SFS_READREPLY));
+		serial->SendBytes(&response, sizeof(SFS_READREPLY));
 		return;
 	}
 	
-	response.ret = 0;
+	FlushHandle(info.fd);
+	
+	// Longer requests just come up short
+	if ( info.length < 0 ) {
+		info.length = 0;
+	} else if ( info.length > buffers.max_request ) {
+		info.length = buffers.max_request;
+	}
+	
+	BufferPoolClass::Lease lease = buffers.Get(( info.length > 0 ) ? info.length : 1);
+	char* buffer = lease.Data();
 	
-	buffer = (char*)malloc(info.length);
+	response.ret = 0;
 	
 	int read = 0;
-	if ( fgets(buffer, info.length, handles[info.fd]) ) {
+	if ( ( info.length > 0 ) && fgets(buffer, info.length, handles[info.fd]) ) {
 		read = strlen(buffer)+1;
 	}
-			
+	
 	if ( feof(handles[info.fd]) ) {
 		response.ret = 4;
 	}
@@ -813,7 +2206,6 @@ void SiofsClass::FsGets() {
 		if ( fs_messages ) {
 			printf( "FS: Timeout.\n" );
 		}
-		free(buffer);
 		return;
 	}
 	
@@ -826,21 +2218,24 @@ void SiofsClass::FsGets() {
 			if ( fs_messages ) {
 				printf( "FS: Timeout.\n" );
 			}
-			free(buffer);
 			return;
 		}
 		
 		if ( ret == 1 ) {
+			retries++;
 			if ( fs_messages ) {
 				printf( "FS: Data incomplete on client. Retrying.\n" );
 			}
+			TRACE( TRACE_STEP, "FS: gets data incomplete on client, retrying" );
 			continue;
 		}
 		
 		if ( ret == 2 ) {
+			retries++;
 			if ( fs_messages ) {
 				printf( "FS: CRC16 mismatch on client. Retrying.\n" );
 			}
+			TRACE( TRACE_STEP, "FS: gets CRC mismatch on client, retrying" );
 			continue;
 		}
 		
@@ -848,8 +2243,6 @@ void SiofsClass::FsGets() {
 	
 	}
 	
-	free(buffer);
-	
 }
 
 void SiofsClass::FsSeek() {
@@ -872,11 +2265,15 @@ void SiofsClass::FsSeek() {
 		return;
 	}
 	
+	FlushHandle(info.fd);
+	
 	if ( fs_messages ) {
 		printf( "FS: Handle = %d\n", info.fd );
 		printf( "FS: Pos    = %d\n", info.offs );
 		printf( "FS: Mode   = %d\n", info.mode);
 	}
+	TRACE( TRACE_STEP, "FS: seek handle %lld to %lld mode %lld", info.fd, info.offs,
+		info.mode );
 	
 	int mode = SEEK_SET;
 	switch(info.mode) {
@@ -921,6 +2318,7 @@ void SiofsClass::FsTell() {
 	if ( fs_messages ) {
 		printf( "FS: File handle = %d\n", hnum );
 	}
+	TRACE( TRACE_STEP, "FS: tell handle %lld", hnum );
 	
 	ret = TestHandle(hnum);
 	
@@ -938,20 +2336,79 @@ void SiofsClass::FsTell() {
 		
 	}
 	
+	FlushHandle(hnum);
+	
 	int pos = ftell(handles[hnum]);
 	serial->SendBytes(&pos, 4);
 	
 }
 
-void SiofsClass::FsDirFirst() {
+template<typename T> static void setDate(T& date, time_t mtime) {
 	
-	unsigned char length;
-	int ret;
+	tm* t = gmtime(&mtime);
 	
-	struct dirent*	dir;
-	struct stat		attr;
+	date.seconds	= t->tm_sec;
+	date.minutes	= t->tm_min;
+	date.hours		= t->tm_hour;
+	date.day		= t->tm_mday;
+	date.month		= t->tm_mon+1;
+	date.year		= (int)(t->tm_year-80);
 	
-	SFS_DIRSTRUCT entry;
+}
+
+int SiofsClass::EntryType(DIR* dir, struct dirent* ent, struct stat* attr) {
+	
+#ifdef _DIRENT_HAVE_D_TYPE
+	// Most filesystems say what an entry is without a stat
+	if ( ent->d_type == DT_DIR ) {
+		return 1;
+	}
+	if ( ( ent->d_type != DT_UNKNOWN ) && ( ent->d_type != DT_LNK ) ) {
+		return 0;
+	}
+#endif
+	
+	if ( path.StatEntry(dir, ent->d_name, attr) < 0 ) {
+		return -1;
+	}
+	
+	return S_ISDIR(attr->st_mode) ? 3 : 2;
+	
+}
+
+struct dirent* SiofsClass::DirMatch(struct stat* attr) {
+	
+	struct dirent* dir;
+	
+	while( ( dir = readdir(hDir) ) != nullptr ) {
+		
+		if ( strcmp(dir->d_name, ".") == 0 ) {
+			continue;
+		}
+		
+		// Directories always match, files only if the wildcard says so
+		int type = EntryType(hDir, dir, attr);
+		
+		if ( ( type < 0 ) || ( !(type&1) && !dMatch.Match(dir->d_name) ) ) {
+			continue;
+		}
+		
+		// Only the entry that goes out gets stat'ed
+		if ( ( type < 2 ) && ( path.StatEntry(hDir, dir->d_name, attr) < 0 ) ) {
+			continue;
+		}
+		
+		return dir;
+		
+	}
+	
+	return nullptr;
+	
+}
+
+void SiofsClass::FsDirFirst() {
+	
+	unsigned char length;
 	
 	// Send accept character
 	serial->SendBytes((void*)"K", 1);
@@ -963,61 +2420,63 @@ void SiofsClass::FsDirFirst() {
 		}
 		return;
 	}
-	memset(&entry, 0x0, sizeof(SFS_DIRSTRUCT));
 	
 	// Receive file name
-	memset(dPattern, 0x0, 128);
-	serial->ReceiveBytes(dPattern, length);
+	ReceiveName(dPattern, sizeof(dPattern), length);
 	
 	if ( fs_messages ) {
 		printf( "FS: Wildcard = %s\n", dPattern );
 	}
+	TRACE_STR( TRACE_STEP, "FS: list first %s", dPattern );
+	
+	dMatch.Compile(dPattern);
 	
 	if ( hDir ) {
 		closedir(hDir);
 	}
 	
-	hDir = opendir(".");
+	hDir = path.OpenDir();
 
 	if (hDir == nullptr) {
+		
+		SFS_DIRSTRUCT entry;
+		
 		if ( fs_messages ) {
 			printf( "FS: ERROR: Cannot open directory.\n" );
 		}
+		TRACE( TRACE_STEP, "FS: list cannot open directory" );
+		memset(&entry, 0x0, sizeof(SFS_DIRSTRUCT));
 		entry.size = -1;
 		serial->SendBytes(&entry, sizeof(SFS_DIRSTRUCT));
 		return;
 	}
+	
+	FsDirNext();
+	
+}
 
-	do {
-		
-		dir = readdir(hDir);
-		
-		if ( dir == nullptr ) {
-			closedir(hDir);
-			hDir = nullptr;
-			entry.size = -2;
-			serial->SendBytes(&entry, sizeof(SFS_DIRSTRUCT));
-			return;
-		}
-		
-	} while( (dir->d_name[0] == '.' && ( strlen(dir->d_name) == 1 )) );
+void SiofsClass::FsDirNext() {
 	
-	while ( dir != nullptr ) {
-		
-		stat(dir->d_name, &attr);
-		
-		if ( S_ISDIR(attr.st_mode) ) {
-			break;
-		}
-		
-		if ( !testPattern(dir->d_name, dPattern) ) {
-			dir = readdir(hDir);
+	int ret;
+	
+	struct dirent*	dir;
+	struct stat		attr;
+	
+	SFS_DIRSTRUCT entry;
+	
+	memset(&entry, 0x0, sizeof(SFS_DIRSTRUCT));
+	
+	if (hDir == nullptr) {
+		if ( fs_messages ) {
+			printf( "FS: ERROR: No directory open.\n" );
 		}
-		
-		break;
-		
+		entry.size = -1;
+		serial->SendBytes(&entry, sizeof(SFS_DIRSTRUCT));
+		return;
 	}
 	
+	dir = DirMatch(&attr);
+	
 	if ( dir == nullptr ) {
 		closedir(hDir);
 		hDir = nullptr;
@@ -1027,21 +2486,14 @@ void SiofsClass::FsDirFirst() {
 	}
 
 	entry.flags = 0;
-	if ( S_ISDIR(attr.st_mode) ) {
+	if (S_ISDIR(attr.st_mode)) {
 		entry.flags = 1;
 	}
 	
 	entry.size = attr.st_size;
 	entry.length = strlen(dir->d_name);
 	
-	tm* t = gmtime(&attr.st_mtime);
-	
-	entry.date.seconds	= t->tm_sec;
-	entry.date.minutes	= t->tm_min;
-	entry.date.hours	= t->tm_hour;
-	entry.date.day		= t->tm_mday;
-	entry.date.month	= t->tm_mon+1;
-	entry.date.year		= (int)(t->tm_year-80);
+	setDate(entry.date, attr.st_mtime);
 	
 	serial->SendBytes(&entry, sizeof(SFS_DIRSTRUCT));
 	
@@ -1058,98 +2510,183 @@ void SiofsClass::FsDirFirst() {
 		}
 		return;
 	}
-	
 	serial->SendBytes(dir->d_name, entry.length);
 	
 }
 
-void SiofsClass::FsDirNext() {
-	
-	int ret;
+DirIndexClass::Records SiofsClass::ListDir(const char* wildcard) {
 	
 	struct dirent*	dir;
 	struct stat		attr;
 	
-	SFS_DIRSTRUCT entry;
+	SFS_DIRSTRUCT2 entry;
+	std::vector<SFS_DIRSTRUCT2> entries;
+	WildcardClass match(wildcard);
 	
-	if (hDir == nullptr) {
-		if ( fs_messages ) {
-			printf( "FS: ERROR: No directory open.\n" );
-		}
-		entry.size = -1;
-		serial->SendBytes(&entry, sizeof(SFS_DIRSTRUCT));
-		return;
+	const std::vector<std::string>* packed = nullptr;
+	std::string dirname;
+	
+	if ( pack && !pack->Empty() && ( path.Relative(".", dirname) == 0 ) ) {
+		packed = pack->List(dirname);
+	}
+	
+	// Directories may only exist in a pack
+	DIR* hList = path.OpenDir();
+	
+	if ( ( hList == nullptr ) && ( packed == nullptr ) ) {
+		return DirIndexClass::Records();
 	}
+	
+	memset(&entry, 0x0, sizeof(SFS_DIRSTRUCT2));
+	
+	while( hList && ( ( dir = readdir(hList) ) != nullptr ) ) {
 		
-	dir = readdir(hDir);
+		if ( strcmp(dir->d_name, ".") == 0 ) {
+			continue;
+		}
 		
-	if ( dir == nullptr ) {
+		int type = EntryType(hList, dir, &attr);
 		
-		closedir(hDir);
-		hDir = nullptr;
-		entry.size = -2;
-		serial->SendBytes(&entry, sizeof(SFS_DIRSTRUCT));
+		if ( type < 0 ) {
+			continue;
+		}
 		
-		return;
-	}
-	
-	while ( dir != nullptr ) {
+		entry.flags = type&1;
 		
-		stat(dir->d_name, &attr);
+		if ( !entry.flags && !match.Match(dir->d_name) ) {
+			continue;
+		}
 		
-		if ( S_ISDIR(attr.st_mode) ) {
-			break;
+		// Records only keep 63 characters of the name, too few to stat
+		// the entry by later
+		if ( ( type < 2 ) && ( strlen(dir->d_name) > 63 ) &&
+			( path.StatEntry(hList, dir->d_name, &attr) == 0 ) ) {
+			type |= 2;
 		}
 		
-		if ( !testPattern(dir->d_name, dPattern) ) {
-			dir = readdir(hDir);
+		// Attributes are left for when the page is asked for, unless
+		// the entry had to be stat'ed already to tell what it is
+		entry.size = -1;
+		if ( type >= 2 ) {
+			entry.size = attr.st_size;
+			setDate(entry.date, attr.st_mtime);
 		}
 		
-		break;
+		memset(entry.filename, 0x0, 64);
+		strncpy(entry.filename, dir->d_name, 63);
+		entry.length = strlen(entry.filename);
+		
+		entries.push_back(entry);
 		
 	}
 	
-	if ( dir == nullptr ) {
-		closedir(hDir);
-		hDir = nullptr;
-		entry.size = 0;
-		serial->SendBytes(&entry, sizeof(SFS_DIRSTRUCT));
-		return;
+	if ( hList ) {
+		closedir(hList);
 	}
-
-	entry.flags = 0;
-	if (S_ISDIR(attr.st_mode)) {
-		entry.flags = 1;
+	
+	if ( packed ) {
+		
+		std::set<std::string> names(packed->begin(), packed->end());
+		
+		// Packed entries shadow host ones of the same name
+		entries.erase(std::remove_if(entries.begin(), entries.end(), 
+			[&](const SFS_DIRSTRUCT2& e) {
+			return names.count(e.filename) > 0;
+		}), entries.end());
+		
+		for(const std::string& name : *packed) {
+			
+			const PackClass::ENTRY* file = pack->Find(
+				dirname.empty() ? name : dirname+"/"+name);
+			
+			entry.flags = file->dir;
+			
+			if ( !entry.flags && !match.Match(name.c_str()) ) {
+				continue;
+			}
+			
+			entry.size = file->size;
+			setDate(entry.date, file->mtime);
+			
+			memset(entry.filename, 0x0, 64);
+			strncpy(entry.filename, name.c_str(), 63);
+			entry.length = strlen(entry.filename);
+			
+			entries.push_back(entry);
+			
+		}
+		
 	}
 	
-	entry.size = attr.st_size;
-	entry.length = strlen(dir->d_name);
+	// Sorted by name so pages stay put between requests
+	std::sort(entries.begin(), entries.end(),
+		[](const SFS_DIRSTRUCT2& a, const SFS_DIRSTRUCT2& b) {
+		return strcmp(a.filename, b.filename) < 0;
+	});
 	
-	tm* t = gmtime(&attr.st_mtime);
+	DirIndexClass::Records list = std::make_shared<DirIndexClass::List>();
 	
-	entry.date.seconds	= t->tm_sec;
-	entry.date.minutes	= t->tm_min;
-	entry.date.hours	= t->tm_hour;
-	entry.date.day		= t->tm_mday;
-	entry.date.month	= t->tm_mon+1;
-	entry.date.year		= (int)(t->tm_year-80);
+	list->ready.resize(entries.size());
 	
-	serial->SendBytes(&entry, sizeof(SFS_DIRSTRUCT));
+	for(int i=0; i<entries.size(); i++) {
+		list->ready[i] = ( entries[i].size >= 0 );
+		if ( !list->ready[i] ) {
+			entries[i].size = 0;
+		}
+	}
 	
-	ret = 0;
-	if ( serial->ReceiveBytes(&ret, 1) != 1 ) {
-		if ( fs_messages ) {
-			printf( "FS: Timeout.\n" );
+	const char* data = (const char*)entries.data();
+	list->records.assign(data, data+entries.size()*sizeof(SFS_DIRSTRUCT2));
+	
+	return list;
+	
+}
+
+void SiofsClass::StatRecords(DirIndexClass::List* list, int first, int count) {
+	
+	SFS_DIRSTRUCT2* records = (SFS_DIRSTRUCT2*)list->records.data();
+	std::vector<int> pending;
+	
+	for(int i=first; i<first+count; i++) {
+		if ( !list->ready[i] ) {
+			pending.push_back(i);
 		}
+	}
+	
+	if ( pending.empty() ) {
 		return;
 	}
-	if ( ret != 'K' ) {
-		if ( fs_messages ) {
-			printf( "FS: Timeout.\n" );
-		}
+	
+	DIR* hList = path.OpenDir();
+	
+	if ( hList == nullptr ) {
 		return;
 	}
-	serial->SendBytes(dir->d_name, entry.length);
+	
+	auto stat_one = [&](int n) {
+		
+		struct stat attr;
+		SFS_DIRSTRUCT2* entry = &records[pending[n]];
+		
+		if ( path.StatEntry(hList, entry->filename, &attr) == 0 ) {
+			entry->size = attr.st_size;
+			setDate(entry->date, attr.st_mtime);
+		}
+		
+		list->ready[pending[n]] = true;
+		
+	};
+	
+	// A cold page is stat'ed in parallel, a few entries are not worth it
+	if ( index && ( pending.size() >= SIOFS_STAT_BATCH ) ) {
+		index->pool.Run(pending.size(), stat_one);
+	} else {
+		for(int i=0; i<pending.size(); i++) {
+			stat_one(i);
+		}
+	}
+	
+	closedir(hList);
 	
 }
 
@@ -1159,11 +2696,7 @@ void SiofsClass::FsDirList() {
 	unsigned char length;
 	int ret;
 	
-	struct dirent*	dir;
-	struct stat		attr;
-	
 	SFS_DIRPARAM param,param2;
-	SFS_DIRSTRUCT2 entry;
 	
 	memset(wildcard, 0x0, 128);
 	
@@ -1187,110 +2720,70 @@ void SiofsClass::FsDirList() {
 	}
 	
 	// Receive wildcard string
-	serial->ReceiveBytes(wildcard, length);
+	ReceiveName(wildcard, sizeof(wildcard), length);
 	
 	if ( fs_messages ) {
 		printf( "FS: items    = %d\n", param.num );
 		printf( "FS: offset   = %d\n", param.offset );
 		printf( "FS: Wildcard = %s\n", wildcard );
 	}
+	TRACE_STR( TRACE_STEP, "FS: list %s, %lld from %lld", wildcard, param.num,
+		param.offset );
 	
-	// Close dir handle if opened previously
-	if ( hDir ) {
-		closedir(hDir);
-	}
-	
-	memset(&entry, 0x0, sizeof(SFS_DIRSTRUCT2));
+	// Listings are built once per directory and wildcard, later pages are
+	// served straight out of the index until the directory changes
+	std::string dirname = path.WorkDir();
+	DirIndexClass::Records list;
 	
-	// Open directory
-	hDir = opendir(".");
-
-	// If unable to open directory
-	if (hDir == nullptr) {
-		
-		if ( fs_messages ) {
-			printf( "FS: ERROR: Cannot open directory.\n" );
-		}
-		
-		param2.num = -1;
-		param2.offset = 0;
-		serial->SendBytes(&param2, sizeof(SFS_DIRPARAM));
-		
-		return;
+	if ( index ) {
+		list = index->Get(dirname, wildcard);
 	}
-
-	std::vector<SFS_DIRSTRUCT2> dir_entries;
 	
-	do {
+	if ( !list ) {
 		
-		dir = readdir(hDir);
+		list = ListDir(wildcard);
 		
-		if ( dir == nullptr ) {
+		// If unable to open directory
+		if ( !list ) {
 			
-			closedir(hDir);
-			hDir = nullptr;
+			if ( fs_messages ) {
+				printf( "FS: ERROR: Cannot open directory.\n" );
+			}
+			TRACE( TRACE_STEP, "FS: list cannot open directory" );
 			
-			param2.num = -2;
+			param2.num = -1;
 			param2.offset = 0;
-			serial->SendBytes(&entry, sizeof(SFS_DIRPARAM));
+			serial->SendBytes(&param2, sizeof(SFS_DIRPARAM));
 			
 			return;
 		}
 		
-	} while( (dir->d_name[0] == '.') && (strlen(dir->d_name) == 1) );
-	
-	int item_num = 0;
-	
-	while( dir != nullptr ) {
-		
-		stat(dir->d_name, &attr);
-
-		entry.flags = 0;
-		if (S_ISDIR(attr.st_mode)) {
-			
-			entry.flags = 1;
-			
-		} else {
-			
-			if ( !testPattern(dir->d_name, wildcard) ) {
-				dir = readdir(hDir);
-				continue;
-			}
-			
-		}
-
-		entry.size = attr.st_size;
-		entry.length = strlen(dir->d_name);
-
-		tm* t = gmtime(&attr.st_mtime);
-
-		entry.date.seconds	= t->tm_sec;
-		entry.date.minutes	= t->tm_min;
-		entry.date.hours	= t->tm_hour;
-		entry.date.day		= t->tm_mday;
-		entry.date.month	= t->tm_mon+1;
-		entry.date.year		= (int)(t->tm_year-80);
-
-		memset(entry.filename, 0x0, 64);
-		strcpy(entry.filename, dir->d_name);
-		
-		if ( ( item_num >= param.offset ) && 
-		( item_num < ( ( param.offset+param.num ) ) ) ) {
-
-			dir_entries.push_back(entry);
-
+		if ( index ) {
+			index->Put(dirname, wildcard, list);
 		}
 		
-		item_num++;
-		
-		dir = readdir(hDir);
-		
 	}
 	
-	closedir(hDir);
+	std::lock_guard<std::mutex> guard(list->lock);
+	
+	int total = list->records.size()/sizeof(SFS_DIRSTRUCT2);
+	int first = param.offset;
+	int count = param.num;
+	
+	if ( first < 0 ) {
+		first = 0;
+	}
+	if ( first+count > total ) {
+		count = total-first;
+	}
+	if ( count < 0 ) {
+		count = 0;
+	}
+	
+	StatRecords(list.get(), first, count);
 	
-	param2.num = dir_entries.size();
-	param2.offset = item_num;
+	param2.num = count;
+	param2.offset = total;
 	serial->SendBytes(&param2, sizeof(SFS_DIRPARAM));
 	
 	if ( param2.num > 0 ) {
@@ -1309,21 +2802,68 @@ void SiofsClass::FsDirList() {
 			}
 			return;
 		}
+		
+		// The page is contiguous in the index, one write sends all of it
+		serial->SendBytes((void*)(list->records.data()+first*sizeof(SFS_DIRSTRUCT2)),
+			count*sizeof(SFS_DIRSTRUCT2));
+		
+	}
+	
+}
 
-		for(int i=0; i<dir_entries.size(); i++) {
-
-			serial->SendBytes(&dir_entries[i], sizeof(SFS_DIRSTRUCT2));
+const PackClass::ENTRY* SiofsClass::PackFind(const char* name) {
+	
+	std::string key;
+	
+	if ( ( pack == nullptr ) || pack->Empty() || path.Relative(name, key) ) {
+		return nullptr;
+	}
+	
+	return pack->Find(key);
+	
+}
 
+int SiofsClass::StatFile(const char* name, struct stat* attr) {
+	
+	const PackClass::ENTRY* packed = PackFind(name);
+	
+	if ( packed ) {
+		PackClass::Stat(packed, attr);
+		return 0;
+	}
+	
+	std::string host = path.HostPath(name);
+	size_t sep = host.find_last_of("/\\");
+	std::string dirname, leaf;
+	
+	if ( index && ( sep != std::string::npos ) && ( sep+1 < host.size() ) ) {
+		
+		dirname = host.substr(0, sep ? sep : 1);
+		leaf = host.substr(sep+1);
+		
+		switch( index->GetStat(dirname, leaf, attr) ) {
+		case DirIndexClass::STAT_FOUND:
+			return 0;
+		case DirIndexClass::STAT_NOTFOUND:
+			return -1;
 		}
 		
 	}
 	
+	int ret = path.Stat(name, attr);
+	
+	if ( !leaf.empty() ) {
+		index->PutStat(dirname, leaf, ( ret < 0 ) ? nullptr : attr);
+	}
+	
+	return ret;
+	
 }
 
 void SiofsClass::FsStat() {
 	
 	int ret;
-	char filename[64];
+	char filename[256];
 	struct stat	attr;
 	SFS_STATSTRUCT st;
 	
@@ -1340,8 +2880,8 @@ void SiofsClass::FsStat() {
 	}
 	
 	// Receive file name
-	memset(filename, 0x0, 64);
-	if ( serial->ReceiveBytes(filename, ret) != ret ) {
+	memset(filename, 0x0, 256);
+	if ( serial->ReceiveAll(filename, ret) != ret ) {
 		if ( fs_messages ) {
 			printf( "FS: Timeout.\n" );
 		}
@@ -1351,13 +2891,15 @@ void SiofsClass::FsStat() {
 	if ( fs_messages ) {
 		printf( "FS: File = %s\n", filename );
 	}
+	TRACE_STR( TRACE_STEP, "FS: stat %s", filename );
 	
 	memset(&st, 0, sizeof(SFS_STATSTRUCT));
 	
-	if ( stat(filename, &attr) < 0 ) {
+	if ( StatFile(filename, &attr) < 0 ) {
 		if ( fs_messages ) {
 			printf( "FS: ERROR: File not found.\n" );
 		}
+		TRACE_STR( TRACE_STEP, "FS: stat %s not found", filename );
 		st.size = -1;
 		serial->SendBytes(&st, 10);
 		return;
@@ -1369,23 +2911,135 @@ void SiofsClass::FsStat() {
 		st.flags = 1;
 	}
 	
-	tm* t = gmtime(&attr.st_mtime);
-
-	st.date.seconds	= t->tm_sec;
-	st.date.minutes	= t->tm_min;
-	st.date.hours	= t->tm_hour;
-	st.date.day		= t->tm_mday;
-	st.date.month	= t->tm_mon+1;
-	st.date.year	= (int)(t->tm_year-80);
+	setDate(st.date, attr.st_mtime);
 	
 	serial->SendBytes(&st, 10);
 	
 }
 
+void SiofsClass::FsStatMulti() {
+	
+	unsigned short count, length;
+	int ret;
+	
+	// Send accept character
+	serial->SendBytes((void*)"K", 1);
+	
+	// Receive file count and name list length
+	if ( ( serial->ReceiveBytes(&count, 2) != 2 ) || 
+		( serial->ReceiveBytes(&length, 2) != 2 ) ) {
+		if ( fs_messages ) {
+			printf( "FS: Timeout.\n" );
+		}
+		return;
+	}
+	
+	std::vector<char> names(length+1);
+	
+	if ( serial->ReceiveAll(names.data(), length) != length ) {
+		if ( fs_messages ) {
+			printf( "FS: Timeout.\n" );
+		}
+		return;
+	}
+	
+	if ( fs_messages ) {
+		printf( "FS: Files = %d\n", count );
+	}
+	TRACE( TRACE_STEP, "FS: stat %lld files", count );
+	
+	std::vector<SFS_STATSTRUCT> stats;
+	const char* p = names.data();
+	const char* end = p+length;
+	
+	// Unpack the length prefixed names
+	while( ( count <= SIOFS_STAT_MAX ) && ( stats.size() < count ) && ( p < end ) ) {
+		
+		int len = (unsigned char)*p++;
+		
+		if ( ( len == 0 ) || ( p+len > end ) ) {
+			break;
+		}
+		
+		std::string filename(p, len);
+		struct stat attr;
+		SFS_STATSTRUCT st;
+		
+		p += len;
+		
+		memset(&st, 0, sizeof(SFS_STATSTRUCT));
+		
+		if ( StatFile(filename.c_str(), &attr) < 0 ) {
+			st.size = -1;
+		} else {
+			st.size = attr.st_size;
+			if ( S_ISDIR(attr.st_mode) ) {
+				st.flags = 1;
+			}
+			setDate(st.date, attr.st_mtime);
+		}
+		
+		stats.push_back(st);
+		
+	}
+	
+	if ( ( count > SIOFS_STAT_MAX ) || ( stats.size() != count ) || ( p != end ) ) {
+		if ( fs_messages ) {
+			printf( "FS: ERROR: Malformed name list.\n" );
+		}
+		TRACE( TRACE_STEP, "FS: stat malformed name list" );
+		ret = 1;
+		serial->SendBytes(&ret, 2);
+		ret = 0;
+		serial->SendBytes(&ret, 2);
+		serial->SendBytes(&ret, 4);
+		return;
+	}
+	
+	int len = stats.size()*sizeof(SFS_STATSTRUCT);
+	
+	ret = 0;
+	serial->SendBytes(&ret, 2);
+	ret = crc16(stats.data(), len, 0);
+	serial->SendBytes(&ret, 2);
+	serial->SendBytes(&len, 4);
+	
+	if ( len == 0 ) {
+		return;
+	}
+	
+	ret = 0;
+	if ( ( serial->ReceiveBytes(&ret, 1) != 1 ) || ( ret != 'K' ) ) {
+		if ( fs_messages ) {
+			printf( "FS: Timeout.\n" );
+		}
+		return;
+	}
+	
+	while( 1 ) {
+		
+		serial->SendBytes(stats.data(), len);
+		
+		ret = 0;
+		if ( serial->ReceiveBytes(&ret, 2) != 2 ) {
+			if ( fs_messages ) {
+				printf( "FS: Timeout.\n" );
+			}
+			return;
+		}
+		
+		if ( ret == 0 ) {
+			break;
+		}
+		
+	}
+	
+}
+
 void SiofsClass::FsChangeDir() {
 	
 	int ret;
-	char path[128];
+	char dirname[128];
 	
 	// Send accept character
 	serial->SendBytes((void*)"K", 1);
@@ -1400,8 +3054,7 @@ void SiofsClass::FsChangeDir() {
 	}
 	
 	// Receive file name
-	memset(path, 0x0, 128);
-	if ( serial->ReceiveBytes(path, ret) != ret ) {
+	if ( ReceiveName(dirname, sizeof(dirname), ret) != ret ) {
 		if ( fs_messages ) {
 			printf( "FS: Timeout.\n" );
 		}
@@ -1409,10 +3062,16 @@ void SiofsClass::FsChangeDir() {
 	}
 	
 	if ( fs_messages ) {
-		printf( "FS: Path = %s\n", path );
+		printf( "FS: Path = %s\n", dirname );
 	}
+	TRACE_STR( TRACE_STEP, "FS: change directory %s", dirname );
+	
+	// Each session keeps its own directory, the process one is left alone
+	const PackClass::ENTRY* packed = PackFind(dirname);
 	
-	if ( chdir(path) ) {
+	if ( packed ) {
+		ret = ( packed->dir && ( path.ChangeDir(dirname, false) == 0 ) ) ? 0 : 1;
+	} else if ( path.ChangeDir(dirname) ) {
 		ret = 1;
 	} else {
 		ret = 0;
@@ -1427,10 +3086,12 @@ void SiofsClass::FsWorkDir() {
 	int ret;
 	char workdir[256];
 	
-	getcwd(workdir, 256);
+	memset(workdir, 0x0, 256);
+	strncpy(workdir, path.WorkDir().c_str(), 255);
 	
 	ret = strlen(workdir);
 	serial->SendBytes((void*)&ret, 1);
+	TRACE_STR( TRACE_STEP, "FS: working directory %s", workdir );
 	
 	if ( ret > 0 ) {
 		Sleep(20);
@@ -3,12 +3,67 @@
 
 #include <stdio.h>
 #include <dirent.h>
+#include <string>
+#include <map>
+#include <list>
+#include "serial.h"
+#include "assetcache.h"
+#include "dirindex.h"
+#include "siofspath.h"
+#include "wildcard.h"
+#include "writebehind.h"
+#include "bufpool.h"
+#include "pack.h"
 
 #define SIOFS_HANDLES	64
 #define SIOFS_READ		0x1
 #define SIOFS_WRITE		0x2
 #define SIOFS_BINARY	0x4
 
+/* Pages with at least this many entries left to stat are stat'ed in
+ * parallel */
+#define SIOFS_STAT_BATCH	8
+
+/* Most files a single ~FSM may ask for */
+#define SIOFS_STAT_MAX		256
+
+/* Most entries a single ~FMR may ask for, and how many entries are read
+ * ahead of the one being sent */
+#define SIOFS_MREAD_MAX		64
+#define SIOFS_MREAD_AHEAD	2
+
+/* ~FWR data is held per handle until this much has piled up or nothing
+ * was written for this many milliseconds */
+#define SIOFS_COALESCE_SIZE	65536
+#define SIOFS_COALESCE_IDLE	500
+
+/* Reads above this size are streamed in chunks of it, and how many read
+ * checksums are remembered */
+#define SIOFS_CHUNK			65536
+#define SIOFS_CRC_MEMO		256
+
+/* Most sectors a single ~FCR may ask for */
+#define SIOFS_SECTOR_MAX	256
+
+/* Stream packet size and window limits, and how late a packet may go out
+ * before it counts as late (microseconds) */
+#define SIOFS_STREAM_PACKET_MAX	4096
+#define SIOFS_STREAM_DEPTH_MAX	64
+#define SIOFS_STREAM_SLACK		2000
+#define SIOFS_STREAM_MAGIC		0x5053	/* "SP" */
+
+/* ~FSC operations */
+#define SIOFS_STREAM_ACK		0
+#define SIOFS_STREAM_PAUSE		1
+#define SIOFS_STREAM_RESUME		2
+#define SIOFS_STREAM_RESYNC		3
+#define SIOFS_STREAM_RATE		4
+#define SIOFS_STREAM_CLOSE		5
+
+/* Latency histogram buckets, bucket n counts commands that took less than
+ * 2^n microseconds and the last one everything slower */
+#define SIOFS_METRIC_BUCKETS	24
+
 #define SIOFS_MAJOR		1
 #define SIOFS_MINOR		0
 
@@ -20,6 +75,46 @@ public:
 	
 	int Query(const char* cmd, SerialClass* comm);
 	
+	/* Sets the jail root SIOFS paths cannot leave ("/" by default) and the
+	 * session's initial directory, which is also where ~FRS returns to */
+	int SetRoot(const char* path);
+	int SetDir(const char* path);
+	void SetCache(AssetCacheClass* assets);
+	void SetIndex(DirIndexClass* dirs);
+	
+	/* Serves files in the packs ahead of host files of the same name */
+	void SetPack(PackClass* packs);
+	
+	/* Hands ~FWR data to a writer thread instead of writing it before
+	 * replying, nullptr to write synchronously */
+	void SetWriter(WriteBehindClass* writes);
+	
+	/* Flushes coalesced writes that have been sitting for a while and
+	 * sends stream packets that are due, call as often as possible */
+	void Poll();
+	
+	/* Starts keeping count, bytes, retries, timeouts and latencies per
+	 * command. Latencies are split into time spent in the serial port and
+	 * everything else (disk, checksums) on the host, for the former the
+	 * port needs timing set too. */
+	void EnableMetrics();
+	
+	/* One line per command seen and one per histogram, nothing unless
+	 * metrics are enabled */
+	void Metrics(std::vector<std::string>& lines);
+	
+	unsigned int	queries;
+	
+	/* Bytes received through ~FWR and the writes they turned into */
+	unsigned long long write_bytes;
+	std::atomic<unsigned long long> write_calls;
+	
+	/* Stream packets sent, how many went out late and the worst lateness
+	 * in microseconds */
+	unsigned long long stream_packets;
+	unsigned long long stream_late;
+	unsigned int	stream_late_max;
+	
 private:
 	
 	typedef struct {
@@ -105,13 +200,106 @@ private:
 		unsigned int offset;
 	} SFS_QREADSTRUCT;
 	
+	typedef struct {
+		unsigned int lba;
+		unsigned short count;
+		unsigned short raw;
+	} SFS_SECTORSTRUCT;
+	
+	typedef struct {
+		unsigned int rate;
+		unsigned short packet;
+		unsigned short depth;
+		unsigned int offset;
+		unsigned int length;
+	} SFS_STREAMSTRUCT;
+	
+	typedef struct {
+		unsigned short magic;
+		unsigned short seq;
+		unsigned short length;
+		unsigned short crc16;
+		unsigned short flags;
+	} SFS_STREAMPACKET;
+	
+	typedef struct {
+		FILE*		fp;
+		const char*	mem;
+		long long	offset;
+		unsigned int length;
+		unsigned int rate;
+		int			packet;
+		int			depth;
+		unsigned int count;
+		unsigned int next;
+		unsigned int acked;
+		unsigned int base;
+		long long	start;
+		int			paused;
+		int			stalled;
+		std::vector<char> buffer;
+	} STREAM;
+	
+	typedef struct {
+		std::string name;
+		unsigned int offset;
+		unsigned int length;
+		std::string host;
+		struct stat attr;
+		FILE* fp;
+		int status;
+		unsigned short crc;
+		AssetCacheClass::Data data;
+		const PackClass::ENTRY* packed;
+		std::vector<char> buffer;
+		const char* ptr;
+		int len;
+	} MREGION;
+	
+	typedef struct {
+		unsigned long long count;
+		unsigned long long bytes_in;
+		unsigned long long bytes_out;
+		unsigned long long retries;
+		unsigned long long timeouts;
+		unsigned long long disk_usec;
+		unsigned long long wire_usec;
+		unsigned int disk_hist[SIOFS_METRIC_BUCKETS];
+		unsigned int wire_hist[SIOFS_METRIC_BUCKETS];
+	} METRIC;
+	
+	int Dispatch(const char* cmd);
 	int TestHandle(int hnum);
+	int FlushHandle(int hnum);
+	int FlushBuffer(int hnum);
+	
+	/* Receives a length byte name into a buffer of size bytes, anything
+	 * past size-1 bytes is received and dropped. Always NUL terminated,
+	 * returns the number of bytes received. */
+	int ReceiveName(char* name, int size, int length);
 	
 	void FsInit();
 	
 	void FsOpen();
 	void FsClose();
 	void FsReadQuick();
+	void FsReadMulti();
+	void FsReadSectors();
+	
+	void FsStreamOpen();
+	void FsStreamControl();
+	void StreamPush();
+	void StreamRestart(unsigned int index);
+	void StreamClose();
+	void StreamRead(FILE* fp, long long start, int len, int quick);
+	int StreamRange(FILE* fp, long long start, int len);
+	int RangeCrc(FILE* fp, long long start, int len, unsigned short* crc);
+	int CrcLookup(const struct stat* attr, long long start, int len,
+		unsigned short* crc, int* avail);
+	void CrcStore(const struct stat* attr, long long start, int len,
+		unsigned short crc, int avail);
+	void LoadRegion(MREGION* region);
+	void SendRegion(MREGION* region);
 	
 	void FsWrite();
 	void FsRead();
@@ -123,15 +311,40 @@ private:
 	void FsDirFirst();
 	void FsDirNext();
 	void FsDirList();
+	DirIndexClass::Records ListDir(const char* wildcard);
+	void StatRecords(DirIndexClass::List* list, int first, int count);
+	
+	/* 1 for a directory, 0 for anything else, plus 2 if attr had to be
+	 * filled in to tell, -1 if the entry is gone */
+	int EntryType(DIR* dir, struct dirent* ent, struct stat* attr);
+	struct dirent* DirMatch(struct stat* attr);
 	
 	void FsStat();
+	void FsStatMulti();
+	int StatFile(const char* name, struct stat* attr);
+	const PackClass::ENTRY* PackFind(const char* name);
 	void FsChangeDir();
 	void FsWorkDir();
 	
 	SerialClass*	serial;
+	AssetCacheClass* cache;
+	DirIndexClass*	index;
+	PackClass*		pack;
+	WriteBehindClass* writer;
+	std::vector<char> wbuf[SIOFS_HANDLES];
+	long long		wtime[SIOFS_HANDLES];
+	char			werr[SIOFS_HANDLES];
+	BufferPoolClass	buffers;
+	STREAM			stream;
+	std::vector<METRIC> metrics;
+	unsigned long long retries;
+	std::map<std::string, std::pair<unsigned short, int> > crcs;
+	std::list<std::string> crc_order;
 	FILE*			handles[SIOFS_HANDLES];
 	DIR*			hDir;
 	char			dPattern[128];
+	WildcardClass	dMatch;
+	SiofsPathClass	path;
 };
 
 #ifndef __WIN32__
@@ -0,0 +1,733 @@
+#ifdef __WIN32__
+#include <windows.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <errno.h>
+#ifndef __WIN32__
+#include <sys/syscall.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+#endif
+#include <algorithm>
+#include "siofspath.h"
+
+#ifdef __WIN32__
+#define PATH_SEP	"\\"
+#else
+#define PATH_SEP	"/"
+#endif
+
+#ifndef __WIN32__
+
+/* Lower-cased key for name matching, a trailing dot is dropped so FILE.
+ * matches file */
+static std::string foldName(const std::string& name) {
+
+	std::string ret = name;
+
+	if ( ( ret.size() > 1 ) && ( ret[ret.size()-1] == '.' ) ) {
+		ret.erase(ret.size()-1);
+	}
+
+	for(int i=0; i<ret.size(); i++) {
+		ret[i] = tolower((unsigned char)ret[i]);
+	}
+
+	return ret;
+
+}
+
+/* openat() that does not leave dir, not even through symlinks */
+static int openBeneath(int dir, const char* name, int flags, mode_t mode) {
+
+#ifdef SYS_openat2
+	struct open_how how;
+
+	memset(&how, 0, sizeof(how));
+	how.flags = flags;
+	how.mode = ( flags & O_CREAT ) ? mode : 0;
+	how.resolve = RESOLVE_BENEATH|RESOLVE_NO_MAGICLINKS;
+
+	int fd = syscall(SYS_openat2, dir, name, &how, sizeof(how));
+
+	if ( ( fd >= 0 ) || ( ( errno != ENOSYS ) && ( errno != EPERM ) ) ) {
+		return fd;
+	}
+#endif
+
+	// Without openat2() symlinks are not followed at all
+	return openat(dir, name, flags|O_NOFOLLOW, mode);
+
+}
+
+#endif
+
+static std::string Canonical(const char* path) {
+
+#ifdef __WIN32__
+	char full[MAX_PATH];
+
+	if ( _fullpath(full, path, MAX_PATH) ) {
+		return full;
+	}
+#else
+	char* full = realpath(path, nullptr);
+
+	if ( full ) {
+		std::string ret = full;
+		free(full);
+		return ret;
+	}
+#endif
+
+	return std::string();
+
+}
+
+SiofsPathClass::SiofsPathClass() {
+
+	char workdir[256];
+
+#ifndef __WIN32__
+	rootFd = -1;
+	jailed = false;
+#endif
+	index = nullptr;
+
+	SetRoot(PATH_SEP);
+
+	if ( getcwd(workdir, 256) ) {
+		SetDir(workdir);
+	}
+
+}
+
+SiofsPathClass::~SiofsPathClass() {
+
+	Flush();
+
+#ifndef __WIN32__
+	if ( rootFd >= 0 ) {
+		close(rootFd);
+	}
+#endif
+
+}
+
+int SiofsPathClass::SetRoot(const char* host_path) {
+
+	std::string path = Canonical(host_path);
+
+	if ( path.empty() ) {
+		return -1;
+	}
+
+#ifndef __WIN32__
+
+	int fd = open(path.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+	if ( fd < 0 ) {
+		return -1;
+	}
+
+	Flush();
+
+	if ( rootFd >= 0 ) {
+		close(rootFd);
+	}
+	rootFd = fd;
+	jailed = ( path != PATH_SEP );
+
+#else
+
+	struct stat attr;
+
+	if ( ( stat(path.c_str(), &attr) < 0 ) || !S_ISDIR(attr.st_mode) ) {
+		return -1;
+	}
+
+#endif
+
+	// Keep the trailing separator off so joins stay simple
+	if ( ( path.size() > 1 ) && ( path[path.size()-1] == PATH_SEP[0] ) ) {
+		path.erase(path.size()-1);
+	}
+
+	root = path;
+	home.clear();
+	cwd.clear();
+
+	return 0;
+
+}
+
+int SiofsPathClass::SetDir(const char* host_path) {
+
+	std::string path = Canonical(host_path);
+	std::string prefix = root;
+
+	if ( path.empty() ) {
+		return -1;
+	}
+
+	if ( prefix[prefix.size()-1] != PATH_SEP[0] ) {
+		prefix += PATH_SEP;
+	}
+
+	// Must be inside the jail
+	if ( path == root ) {
+		home.clear();
+	} else if ( path.compare(0, prefix.size(), prefix) == 0 ) {
+		PATH dir;
+		if ( Normalize((PATH_SEP+path.substr(prefix.size())).c_str(), dir) ) {
+			return -1;
+		}
+		home = dir;
+	} else {
+		return -1;
+	}
+
+	cwd = home;
+
+	return 0;
+
+}
+
+void SiofsPathClass::SetIndex(DirIndexClass* dirs) {
+
+	index = dirs;
+
+}
+
+void SiofsPathClass::Reset() {
+
+	cwd = home;
+
+}
+
+int SiofsPathClass::Normalize(const char* name, PATH& out) {
+
+	const char* p = name;
+
+	if ( ( *p == '/' ) || ( *p == '\\' ) ) {
+		out.clear();
+	} else {
+		out = cwd;
+	}
+
+	while( *p ) {
+
+		const char* end = p;
+		while( *end && ( *end != '/' ) && ( *end != '\\' ) ) {
+			end++;
+		}
+
+		std::string part(p, end-p);
+
+		// ISO version suffix
+		size_t semi = part.find_last_of(';');
+
+		if ( ( semi != std::string::npos ) && ( semi > 0 ) && ( semi+1 < part.size() ) &&
+			( part.find_first_not_of("0123456789", semi+1) == std::string::npos ) ) {
+			part.erase(semi);
+		}
+
+		if ( part == ".." ) {
+			// Stops at the jail root
+			if ( !out.empty() ) {
+				out.pop_back();
+			}
+		} else if ( !part.empty() && ( part != "." ) ) {
+			out.push_back(part);
+		}
+
+		p = *end ? end+1 : end;
+
+	}
+
+	return 0;
+
+}
+
+std::string SiofsPathClass::Join(const PATH& path, int count) {
+
+	std::string ret;
+
+	for(int i=0; i<count; i++) {
+		if ( i > 0 ) {
+			ret += PATH_SEP;
+		}
+		ret += path[i];
+	}
+
+	return ret;
+
+}
+
+std::string SiofsPathClass::HostDir(const PATH& path, int count) {
+
+	if ( count == 0 ) {
+		return root;
+	}
+
+	if ( root == PATH_SEP ) {
+		return root+Join(path, count);
+	}
+
+	return root+PATH_SEP+Join(path, count);
+
+}
+
+std::string SiofsPathClass::HostPath(const char* name) {
+
+	PATH path;
+
+	Normalize(name, path);
+
+	return HostDir(path, path.size());
+
+}
+
+int SiofsPathClass::Relative(const char* name, std::string& out) {
+
+	PATH path;
+
+	Normalize(name, path);
+
+	if ( ( path.size() < home.size() ) ||
+		!std::equal(home.begin(), home.end(), path.begin()) ) {
+		return -1;
+	}
+
+	out.clear();
+
+	for(int i=home.size(); i<path.size(); i++) {
+		if ( i > home.size() ) {
+			out += "/";
+		}
+		out += path[i];
+	}
+
+	return 0;
+
+}
+
+std::string SiofsPathClass::WorkDir() {
+
+	return HostPath(".");
+
+}
+
+#ifndef __WIN32__
+
+int SiofsPathClass::DirFd(const PATH& path, int count) {
+
+	if ( count == 0 ) {
+		return rootFd;
+	}
+
+	std::string key = Join(path, count);
+	const char* leaf = path[count-1].c_str();
+
+	int parent = DirFd(path, count-1);
+
+	if ( parent < 0 ) {
+		return -1;
+	}
+
+	auto it = fds.find(key);
+	struct stat attr;
+
+	if ( it != fds.end() ) {
+
+		// Still the directory the path leads to, checked against its
+		// parent's fd rather than walking the whole path again
+		if ( ( fstatat(parent, leaf, &attr, AT_SYMLINK_NOFOLLOW) == 0 ) &&
+			( !S_ISLNK(attr.st_mode) || ( fstatat(parent, leaf, &attr, 0) == 0 ) ) &&
+			( attr.st_dev == it->second.dev ) && ( attr.st_ino == it->second.ino ) ) {
+			lru.splice(lru.begin(), lru, it->second.lru);
+			return it->second.fd;
+		}
+
+		close(it->second.fd);
+		lru.erase(it->second.lru);
+		fds.erase(it);
+
+	}
+
+	int fd = OpenAt(parent, path, count-1, path[count-1], O_RDONLY|O_DIRECTORY);
+
+	if ( fd < 0 ) {
+		return -1;
+	}
+
+	if ( fstat(fd, &attr) < 0 ) {
+		close(fd);
+		return -1;
+	}
+
+	lru.push_front(key);
+	fds[key] = { fd, attr.st_dev, attr.st_ino, lru.begin() };
+
+	while( lru.size() > SIOFS_DIRFD_CACHE ) {
+		auto old = fds.find(lru.back());
+		close(old->second.fd);
+		fds.erase(old);
+		lru.pop_back();
+	}
+
+	return fd;
+
+}
+
+int SiofsPathClass::Lookup(const char* name, PATH& path, int fold) {
+
+	Normalize(name, path);
+
+	if ( path.empty() ) {
+		path.push_back(".");
+		return rootFd;
+	}
+
+	if ( fold && ( Resolve(path) < path.size()-1 ) ) {
+		return -1;
+	}
+
+	return DirFd(path, path.size()-1);
+
+}
+
+int SiofsPathClass::OpenAt(int dir, const PATH& path, int count,
+	const std::string& leaf, int flags, mode_t mode) {
+
+	if ( !jailed ) {
+		return openat(dir, leaf.c_str(), flags|O_CLOEXEC, mode);
+	}
+
+	int fd = openBeneath(dir, leaf.c_str(), flags|O_CLOEXEC, mode);
+
+	// A symlink leading out of dir may still land inside the jail
+	if ( ( fd < 0 ) && ( errno == EXDEV ) && ( count > 0 ) ) {
+		fd = openBeneath(rootFd, ( Join(path, count)+PATH_SEP+leaf ).c_str(),
+			flags|O_CLOEXEC, mode);
+	}
+
+	return fd;
+
+}
+
+int SiofsPathClass::StatAt(int dir, const PATH& path, int count,
+	const std::string& leaf, struct stat* attr) {
+
+	if ( !jailed ) {
+		return fstatat(dir, leaf.c_str(), attr, 0);
+	}
+
+	int fd = OpenAt(dir, path, count, leaf, O_PATH);
+
+	if ( fd < 0 ) {
+		return -1;
+	}
+
+	int ret = fstat(fd, attr);
+
+	close(fd);
+
+	// Only there without openat2(), the link itself was opened
+	if ( ( ret == 0 ) && S_ISLNK(attr->st_mode) ) {
+		errno = ELOOP;
+		return -1;
+	}
+
+	return ret;
+
+}
+
+int SiofsPathClass::Resolve(PATH& path) {
+
+	struct stat attr;
+	std::string name;
+
+	for(int i=0; i<path.size(); i++) {
+
+		int dir = DirFd(path, i);
+
+		if ( dir < 0 ) {
+			return i;
+		}
+
+		if ( fstatat(dir, path[i].c_str(), &attr, 0) == 0 ) {
+			continue;
+		}
+
+		if ( Fold(dir, path, i, name) ) {
+			return i;
+		}
+
+		path[i] = name;
+
+	}
+
+	return path.size();
+
+}
+
+int SiofsPathClass::Fold(int dir, const PATH& path, int count, std::string& name) {
+
+	std::string host = HostDir(path, count);
+	DirIndexClass::Names names;
+
+	if ( index ) {
+		names = index->GetNames(host);
+	}
+
+	if ( !names ) {
+
+		int fd = openat(dir, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		DIR* list = ( fd >= 0 ) ? fdopendir(fd) : nullptr;
+
+		if ( list == nullptr ) {
+			if ( fd >= 0 ) {
+				close(fd);
+			}
+			return -1;
+		}
+
+		auto folded = std::make_shared<std::unordered_map<std::string, std::string> >();
+		struct dirent* ent;
+
+		while( ( ent = readdir(list) ) != nullptr ) {
+
+			if ( ( strcmp(ent->d_name, ".") == 0 ) || ( strcmp(ent->d_name, "..") == 0 ) ) {
+				continue;
+			}
+
+			// Names that only differ in case resolve to the first in order
+			std::string& entry = (*folded)[foldName(ent->d_name)];
+
+			if ( entry.empty() || ( entry > ent->d_name ) ) {
+				entry = ent->d_name;
+			}
+
+		}
+
+		closedir(list);
+
+		names = folded;
+
+		if ( index ) {
+			index->PutNames(host, names);
+		}
+
+	}
+
+	auto it = names->find(foldName(path[count]));
+
+	if ( it == names->end() ) {
+		return -1;
+	}
+
+	name = it->second;
+
+	return 0;
+
+}
+
+#endif
+
+void SiofsPathClass::Flush() {
+
+#ifndef __WIN32__
+	for(auto it = fds.begin(); it != fds.end(); it++) {
+		close(it->second.fd);
+	}
+	fds.clear();
+	lru.clear();
+#endif
+
+}
+
+int SiofsPathClass::ChangeDir(const char* name, int check) {
+
+	PATH path;
+
+	Normalize(name, path);
+
+#ifndef __WIN32__
+
+	if ( check && ( DirFd(path, path.size()) < 0 ) &&
+		( ( Resolve(path) < path.size() ) || ( DirFd(path, path.size()) < 0 ) ) ) {
+		return -1;
+	}
+
+#else
+
+	struct stat attr;
+	std::string host = HostPath(name);
+
+	if ( check && ( ( stat(host.c_str(), &attr) < 0 ) || !S_ISDIR(attr.st_mode) ) ) {
+		return -1;
+	}
+
+#endif
+
+	cwd = path;
+
+	return 0;
+
+}
+
+FILE* SiofsPathClass::Open(const char* name, const char* mode) {
+
+#ifndef __WIN32__
+
+	PATH path;
+	int flags;
+
+	// Same rules fopen() goes by, first character picks the mode
+	switch( mode[0] ) {
+	case 'w':
+		flags = O_WRONLY|O_CREAT|O_TRUNC;
+		break;
+	case 'a':
+		flags = O_WRONLY|O_CREAT|O_APPEND;
+		break;
+	case 'r':
+		flags = O_RDONLY;
+		break;
+	default:
+		return nullptr;
+	}
+
+	if ( strchr(mode, '+') ) {
+		flags = (flags&~(O_WRONLY|O_RDONLY))|O_RDWR;
+	}
+
+	// Files about to be created may already exist spelled differently
+	int dir = Lookup(name, path, ( flags & O_CREAT ) != 0);
+	int fd = ( dir >= 0 ) ? OpenAt(dir, path, path.size()-1, path.back(), flags, 0666) : -1;
+
+	if ( ( fd < 0 ) && !( flags & O_CREAT ) ) {
+		dir = Lookup(name, path, true);
+		if ( dir >= 0 ) {
+			fd = OpenAt(dir, path, path.size()-1, path.back(), flags, 0666);
+		}
+	}
+
+	if ( fd < 0 ) {
+		return nullptr;
+	}
+
+	FILE* fp = fdopen(fd, mode);
+
+	if ( fp == nullptr ) {
+		close(fd);
+	}
+
+	return fp;
+
+#else
+
+	return fopen(HostPath(name).c_str(), mode);
+
+#endif
+
+}
+
+int SiofsPathClass::Stat(const char* name, struct stat* attr) {
+
+#ifndef __WIN32__
+
+	PATH path;
+
+	int dir = Lookup(name, path);
+
+	if ( ( dir >= 0 ) && ( StatAt(dir, path, path.size()-1, path.back(), attr) == 0 ) ) {
+		return 0;
+	}
+
+	dir = Lookup(name, path, true);
+
+	if ( dir < 0 ) {
+		return -1;
+	}
+
+	return StatAt(dir, path, path.size()-1, path.back(), attr);
+
+#else
+
+	return stat(HostPath(name).c_str(), attr);
+
+#endif
+
+}
+
+DIR* SiofsPathClass::OpenDir() {
+
+#ifndef __WIN32__
+
+	int dir = DirFd(cwd, cwd.size());
+
+	if ( dir < 0 ) {
+		return nullptr;
+	}
+
+	// The listing gets its own fd, cached ones may be closed under it
+	int fd = openat(dir, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+	if ( fd < 0 ) {
+		return nullptr;
+	}
+
+	DIR* ret = fdopendir(fd);
+
+	if ( ret == nullptr ) {
+		close(fd);
+	}
+
+	return ret;
+
+#else
+
+	return opendir(WorkDir().c_str());
+
+#endif
+
+}
+
+int SiofsPathClass::StatEntry(DIR* dir, const char* name, struct stat* attr) {
+
+#ifndef __WIN32__
+
+	struct statx st;
+
+	// Entries are in the current directory, see OpenDir()
+	if ( jailed ) {
+		return StatAt(dirfd(dir), cwd, cwd.size(), name, attr);
+	}
+
+	// Only ask for what directory entries carry
+	if ( statx(dirfd(dir), name, 0, STATX_TYPE|STATX_MODE|STATX_SIZE|STATX_MTIME, &st) < 0 ) {
+		return -1;
+	}
+
+	memset(attr, 0x0, sizeof(struct stat));
+	attr->st_mode = st.stx_mode;
+	attr->st_size = st.stx_size;
+	attr->st_mtime = st.stx_mtime.tv_sec;
+
+	return 0;
+
+#else
+
+	return stat(HostPath(name).c_str(), attr);
+
+#endif
+
+}
@@ -0,0 +1,118 @@
+#ifndef SIOFSPATHCLASS_H
+#define SIOFSPATHCLASS_H
+
+#include <stdio.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include "dirindex.h"
+
+#define SIOFS_DIRFD_CACHE	32
+
+/* Path resolution for a SIOFS session. Paths from the target are resolved
+ * against the session's current directory without touching the process
+ * working directory, and can never leave the jail root ("/" unless set
+ * otherwise), excess ".." components simply stop at the root. Absolute
+ * target paths are relative to the jail root.
+ *
+ * On Linux every lookup goes through openat() and friends relative to a
+ * directory fd, and the fds of recently used directories are kept open so
+ * hot subdirectories are not walked from the root again. A kept fd is only
+ * used while the path still leads to the same directory, so directories
+ * that were renamed, or removed and made again, are opened afresh. Below a
+ * jail root
+ * symlinks are resolved with openat2(RESOLVE_BENEATH) and may only lead to
+ * somewhere else inside the jail; kernels without openat2() do not follow
+ * them at all.
+ *
+ * Target code tends to ask for ISO style names like \DATA\LEVEL1.TIM;1.
+ * Version suffixes are dropped and, on Linux, a name that does not exist
+ * as spelled is matched against the directory's names case-insensitively
+ * (ignoring a trailing dot). The folded names of a directory are kept in
+ * the DirIndexClass given to SetIndex() until the directory changes. */
+
+class SiofsPathClass {
+public:
+
+	SiofsPathClass();
+	virtual ~SiofsPathClass();
+
+	int SetRoot(const char* host_path);
+	int SetDir(const char* host_path);
+	void SetIndex(DirIndexClass* dirs);
+
+	/* Back to the initial directory */
+	void Reset();
+
+	/* Only changes to directories that exist on the host unless told not
+	 * to check */
+	int ChangeDir(const char* name, int check = true);
+	std::string WorkDir();
+	std::string HostPath(const char* name);
+
+	/* Path of name below the initial directory with '/' separators, empty
+	 * for the directory itself. Returns -1 if name is not inside it. */
+	int Relative(const char* name, std::string& out);
+
+	FILE* Open(const char* name, const char* mode);
+	int Stat(const char* name, struct stat* attr);
+
+	/* Opens the current directory for listing, entries are then stat'ed
+	 * with StatEntry(), which is safe to call from several threads at
+	 * once on the same DIR and only fills in mode, size and mtime */
+	DIR* OpenDir();
+	int StatEntry(DIR* dir, const char* name, struct stat* attr);
+
+	/* Closes all cached directory fds */
+	void Flush();
+
+private:
+
+	typedef std::vector<std::string> PATH;
+
+	int Normalize(const char* name, PATH& out);
+	std::string Join(const PATH& path, int count);
+	std::string HostDir(const PATH& path, int count);
+
+#ifndef __WIN32__
+	int DirFd(const PATH& path, int count);
+
+	/* Normalizes name into path and returns the fd of the directory its
+	 * last component is in */
+	int Lookup(const char* name, PATH& path, int fold = false);
+
+	/* openat() of leaf in dir, the first count components of path, kept
+	 * inside the jail */
+	int OpenAt(int dir, const PATH& path, int count, const std::string& leaf,
+		int flags, mode_t mode = 0);
+	int StatAt(int dir, const PATH& path, int count, const std::string& leaf,
+		struct stat* attr);
+
+	/* Respells the components of path the way they exist on the host,
+	 * returns how many of them do */
+	int Resolve(PATH& path);
+	int Fold(int dir, const PATH& path, int count, std::string& name);
+
+	typedef struct {
+		int			fd;
+		dev_t		dev;
+		ino_t		ino;
+		std::list<std::string>::iterator lru;
+	} DIRFD;
+
+	int				rootFd;
+	int				jailed;
+	std::map<std::string, DIRFD> fds;
+	std::list<std::string> lru;
+#endif
+
+	DirIndexClass*	index;
+	std::string		root;
+	PATH			home;
+	PATH			cwd;
+};
+
+#endif /* SIOFSPATHCLASS_H */
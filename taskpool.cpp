@@ -0,0 +1,117 @@
+#include "taskpool.h"
+#include "sigblock.h"
+
+TaskPoolClass::TaskPoolClass(int threads)
+{
+	this->threads = threads;
+	count = 0;
+	next = 0;
+	finished = 0;
+	batch = 0;
+	quit = false;
+	
+} /* TaskPoolClass::TaskPoolClass */
+
+TaskPoolClass::~TaskPoolClass()
+{
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		quit = true;
+	}
+	wake.notify_all();
+	
+	for( int i=0; i<workers.size(); i++ )
+	{
+		workers[i].join();
+	}
+	
+} /* TaskPoolClass::~TaskPoolClass */
+
+int TaskPoolClass::Next()
+{
+	std::lock_guard<std::mutex> guard( lock );
+	
+	if( next >= count )
+	{
+		return -1;
+	}
+	
+	return next++;
+	
+} /* TaskPoolClass::Next */
+
+void TaskPoolClass::Worker()
+{
+	unsigned int seen = 0;
+	
+	while( 1 )
+	{
+		{
+			std::unique_lock<std::mutex> guard( lock );
+			wake.wait( guard, [&]() { return quit || ( batch != seen ); } );
+			
+			if( quit )
+			{
+				return;
+			}
+			
+			seen = batch;
+		}
+		
+		int i;
+		while( ( i = Next() ) >= 0 )
+		{
+			job( i );
+			
+			std::lock_guard<std::mutex> guard( lock );
+			if( ++finished == count )
+			{
+				done.notify_all();
+			}
+		}
+	}
+	
+} /* TaskPoolClass::Worker */
+
+void TaskPoolClass::Run(int count, std::function<void(int)> func)
+{
+	if( count <= 0 )
+	{
+		return;
+	}
+	
+	std::lock_guard<std::mutex> run_guard( run_lock );
+	
+	if( workers.empty() )
+	{
+		SignalBlockClass block;
+		
+		for( int i=0; i<threads; i++ )
+		{
+			workers.push_back( std::thread( &TaskPoolClass::Worker, this ) );
+		}
+	}
+	
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		job = func;
+		this->count = count;
+		next = 0;
+		finished = 0;
+		batch++;
+	}
+	wake.notify_all();
+	
+	int i;
+	while( ( i = Next() ) >= 0 )
+	{
+		func( i );
+		
+		std::lock_guard<std::mutex> guard( lock );
+		finished++;
+	}
+	
+	std::unique_lock<std::mutex> guard( lock );
+	done.wait( guard, [&]() { return finished == this->count; } );
+	
+} /* TaskPoolClass::Run */
@@ -0,0 +1,44 @@
+#ifndef _TASKPOOL_H
+#define _TASKPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/* Small fixed pool of worker threads for fanning out blocking calls such
+ * as a batch of stats on a cold directory. Workers are started on first
+ * use and the calling thread joins in on the work. */
+
+class TaskPoolClass {
+public:
+	TaskPoolClass(int threads = 4);
+	virtual ~TaskPoolClass();
+	
+	/* Calls func(0) .. func(count-1) across the pool, returns once all
+	 * of them have finished. Batches from different callers run one at
+	 * a time. */
+	void Run(int count, std::function<void(int)> func);
+	
+private:
+	
+	void Worker();
+	int Next();
+	
+	std::vector<std::thread> workers;
+	std::mutex		run_lock;
+	std::mutex		lock;
+	std::condition_variable wake;
+	std::condition_variable done;
+	
+	std::function<void(int)> job;
+	int				threads;
+	int				count;
+	int				next;
+	int				finished;
+	unsigned int	batch;
+	int				quit;
+};
+
+#endif // _TASKPOOL_H
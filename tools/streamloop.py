@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+# Loopback target for ~FSO/~FSC streaming
+#
+# Stands in for a PS1 that plays a stream out of a small buffer: mcomms is
+# started on one end of a pty, this script opens a stream on the other end,
+# plays one packet per period once half the buffer has filled and
+# acknowledges each packet it plays. At the end it prints how many packets
+# were played, how often the buffer ran dry and the inter-arrival times.
+#
+# Usage: streamloop.py [mcomms binary] [rate] [packet size] [depth] [count]
+# Defaults are ./mcomms 150000 2048 8 300.
+
+import os, pty, select, statistics, struct, subprocess, sys, tempfile, time, tty
+
+MCOMMS = sys.argv[1] if len(sys.argv) > 1 else './mcomms'
+RATE = int(sys.argv[2]) if len(sys.argv) > 2 else 150000
+PK = int(sys.argv[3]) if len(sys.argv) > 3 else 2048
+DEPTH = int(sys.argv[4]) if len(sys.argv) > 4 else 8
+N = int(sys.argv[5]) if len(sys.argv) > 5 else 300
+OFFSET = 4096
+
+def crc16(b):
+    crc = 0
+    for x in b:
+        t = (crc ^ x) & 0xff; c = 0
+        for j in range(8):
+            c = (c >> 1) ^ 0xA001 if (c ^ t) & 1 else c >> 1; t >>= 1
+        crc = (crc >> 8) ^ c
+    return crc
+
+m, s = pty.openpty(); tty.setraw(s)
+root = tempfile.mkdtemp()
+src = os.urandom(OFFSET + N * PK)
+open(os.path.join(root, 'stream.bin'), 'wb').write(src)
+proc = subprocess.Popen([MCOMMS, '-dev', os.ttyname(s), '-dir', root],
+    stdout=subprocess.DEVNULL)
+time.sleep(1.0)
+
+rxbuf = b''
+
+def send(b):
+    os.write(m, b)
+
+def pump(to):
+    global rxbuf
+    r, _, _ = select.select([m], [], [], max(0, to))
+    if r:
+        rxbuf += os.read(m, 65536)
+
+def recv(n, to=3.0):
+    end = time.time() + to
+    while len(rxbuf) < n and time.time() < end:
+        pump(0.1)
+    return take(n)
+
+def take(n):
+    global rxbuf
+    out, rxbuf = rxbuf[:n], rxbuf[n:]
+    return out
+
+def getpkt():
+    global rxbuf
+    while rxbuf[:1] == b'K':
+        rxbuf = rxbuf[1:]
+    if len(rxbuf) < 10:
+        return None
+    magic, seq, ln, crc, flags = struct.unpack('<HHHHH', rxbuf[:10])
+    assert magic == 0x5053, rxbuf[:20]
+    if len(rxbuf) < 10 + ln:
+        return None
+    d = rxbuf[10:10 + ln]; rxbuf = rxbuf[10 + ln:]
+    assert crc16(d) == crc, seq
+    return seq, d
+
+def fso(name, rate, pk, depth, off, length):
+    send(b'~FSO'); assert recv(1) == b'K'
+    send(struct.pack('<IHHII', rate, pk, depth, off, length) + bytes([len(name)]) + name)
+    return struct.unpack('<hI', recv(6))
+
+def fsc(op, arg):
+    send(b'~FSC'); time.sleep(0.002); send(struct.pack('<BI', op, arg))
+
+try:
+    ret, size = fso(b'stream.bin', RATE, PK, DEPTH, OFFSET, N * PK)
+    assert ret == 0, ret
+    period = PK / RATE; buf = []; arrivals = []
+    consumed = 0; under = 0; nextplay = None; t0 = time.time()
+    while consumed < N and time.time() - t0 < 30:
+        now = time.time()
+        pump(min((nextplay - now) if nextplay else 0.05, 0.05))
+        while True:
+            p = getpkt()
+            if not p:
+                break
+            arrivals.append(time.time()); buf.append(p)
+        now = time.time()
+        if nextplay is None and len(buf) >= DEPTH // 2:
+            nextplay = now
+        if nextplay and now >= nextplay:
+            if buf:
+                seq, d = buf.pop(0)
+                assert d == src[OFFSET + seq * PK:OFFSET + (seq + 1) * PK], seq
+                consumed += 1; fsc(0, consumed)
+            else:
+                under += 1
+            nextplay += period
+    fsc(5, 0)
+    ia = [b - a for a, b in zip(arrivals, arrivals[1:])]
+    print('played %d of %d, underruns %d' % (consumed, N, under))
+    print('inter-arrival mean %.2fms sd %.2fms max %.2fms (period %.2fms)' % (
+        statistics.mean(ia) * 1e3, statistics.pstdev(ia) * 1e3,
+        max(ia) * 1e3, period * 1e3))
+finally:
+    proc.terminate(); proc.wait()
+    os.remove(os.path.join(root, 'stream.bin')); os.rmdir(root)
@@ -0,0 +1,193 @@
+#include "trace.h"
+#include "sigblock.h"
+
+#if TRACE_LEVEL > 0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+/* A slot is free for the writer whose ticket equals seq and holds a record
+ * for the formatter once seq is one past that ticket */
+typedef struct {
+	std::atomic<unsigned int> seq;
+	int			thread;
+	long long	time;
+	const char*	fmt;
+	long long	args[3];
+	char		text[TRACE_TEXT];
+} RECORD;
+
+static RECORD ring[TRACE_RING];
+static std::atomic<unsigned int> head;
+static std::atomic<unsigned long long> dropped;
+static std::atomic<int> threads;
+static std::atomic<int> quit;
+static std::thread formatter;
+static long long started;
+
+static long long nsecNow()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch() ).count();
+
+} /* nsecNow */
+
+static int threadNumber()
+{
+	static thread_local int number = -1;
+
+	if( number < 0 )
+	{
+		number = threads++;
+	}
+
+	return number;
+
+} /* threadNumber */
+
+void traceRecord( const char* fmt, const char* text, long long a,
+	long long b, long long c )
+{
+	unsigned int pos = head.load( std::memory_order_relaxed );
+	RECORD* rec;
+
+	// Claim the slot at head unless the formatter has yet to get to it
+	while( 1 )
+	{
+		rec = &ring[pos&(TRACE_RING-1)];
+		int diff = (int)( rec->seq.load( std::memory_order_acquire )-pos );
+
+		if( diff == 0 )
+		{
+			if( head.compare_exchange_weak( pos, pos+1, std::memory_order_relaxed ) )
+				break;
+		}
+		else if( diff < 0 )
+		{
+			dropped++;
+			return;
+		}
+		else
+		{
+			pos = head.load( std::memory_order_relaxed );
+		}
+	}
+
+	rec->thread = threadNumber();
+	rec->time = nsecNow();
+	rec->fmt = fmt;
+	rec->args[0] = a;
+	rec->args[1] = b;
+	rec->args[2] = c;
+
+	if( text )
+	{
+		strncpy( rec->text, text, TRACE_TEXT-1 );
+		rec->text[TRACE_TEXT-1] = 0;
+	}
+	else
+	{
+		rec->text[0] = 0;
+	}
+
+	rec->seq.store( pos+1, std::memory_order_release );
+
+} /* traceRecord */
+
+static int drain( unsigned int* tail )
+{
+	int count = 0;
+
+	while( 1 )
+	{
+		RECORD* rec = &ring[*tail&(TRACE_RING-1)];
+
+		if( rec->seq.load( std::memory_order_acquire ) != *tail+1 )
+			break;
+
+		fprintf( stderr, "[%11.6f #%d] ", ( rec->time-started )/1e9, rec->thread );
+
+		if( strstr( rec->fmt, "%s" ) )
+		{
+			fprintf( stderr, rec->fmt, rec->text, rec->args[0], rec->args[1],
+				rec->args[2] );
+		}
+		else
+		{
+			fprintf( stderr, rec->fmt, rec->args[0], rec->args[1], rec->args[2] );
+		}
+		fputc( '\n', stderr );
+
+		rec->seq.store( *tail+TRACE_RING, std::memory_order_release );
+		(*tail)++;
+		count++;
+	}
+
+	return count;
+
+} /* drain */
+
+static void formatterMain()
+{
+	unsigned long long reported = 0;
+	unsigned int tail = 0;
+
+	while( 1 )
+	{
+		int done = quit.load();
+
+		if( drain( &tail ) == 0 )
+		{
+			if( dropped != reported )
+			{
+				reported = dropped;
+				fprintf( stderr, "trace: %llu records dropped so far\n", reported );
+			}
+
+			if( done )
+				break;
+
+			fflush( stderr );
+			std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+		}
+	}
+
+	fflush( stderr );
+
+} /* formatterMain */
+
+static void traceStop()
+{
+	quit = true;
+	formatter.join();
+
+} /* traceStop */
+
+void traceStart()
+{
+	if( formatter.joinable() )
+		return;
+
+	for( int i=0; i<TRACE_RING; i++ )
+	{
+		ring[i].seq.store( i, std::memory_order_relaxed );
+	}
+
+	started = nsecNow();
+	{
+		SignalBlockClass block;
+		formatter = std::thread( formatterMain );
+	}
+
+	// Whatever is still in the ring gets printed on the way out
+	atexit( traceStop );
+
+	fprintf( stderr, "trace: level %d\n", TRACE_LEVEL );
+
+} /* traceStart */
+
+#endif
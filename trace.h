@@ -0,0 +1,53 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/* Trace points, compiled in by building with a trace level (make TRACE=2
+ * after a make clean). At level 0, the default, they expand to nothing and
+ * their arguments are never evaluated. Otherwise every point at or below
+ * the level copies a fixed size record into a lock-free ring and a thread
+ * started by traceStart() formats the records to stderr, so the traced
+ * code only pays for a clock read and a handful of stores. Records are
+ * dropped, and counted, when the ring is full.
+ *
+ *	1	uploads, SIOFS commands and serial timeouts
+ *	2	every SIOFS step
+ *	3	every serial send and receive
+ *
+ * Numbers are passed as long long and printed with %lld or %llx. TRACE_STR
+ * adds one string, which must be the first conversion of the format and is
+ * cut off at TRACE_TEXT-1 characters. Formats must be string literals. */
+
+#define TRACE_CMD		1
+#define TRACE_STEP		2
+#define TRACE_IO		3
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL		0
+#endif
+
+/* Records in the ring, a power of two, and the longest string kept */
+#define TRACE_RING		8192
+#define TRACE_TEXT		40
+
+#if TRACE_LEVEL > 0
+
+void traceStart();
+void traceRecord( const char* fmt, const char* text, long long a = 0,
+	long long b = 0, long long c = 0 );
+
+#define TRACE( level, fmt, ... ) \
+	do { if( (level) <= TRACE_LEVEL ) traceRecord( fmt, nullptr, ##__VA_ARGS__ ); } while( 0 )
+
+#define TRACE_STR( level, fmt, text, ... ) \
+	do { if( (level) <= TRACE_LEVEL ) traceRecord( fmt, text, ##__VA_ARGS__ ); } while( 0 )
+
+#else
+
+inline void traceStart() {}
+
+#define TRACE( level, fmt, ... )			do {} while( 0 )
+#define TRACE_STR( level, fmt, text, ... )	do {} while( 0 )
+
+#endif
+
+#endif // _TRACE_H
@@ -1,11 +1,19 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <vector>
+#include <string>
+#include <chrono>
 #include "upload.h"
 #include "siofs.h"
+#include "compress.h"
+#include "trace.h"
 
 /* main.c */
 extern int old_protocol;
+extern int compress_upload;
+extern int delta_upload;
 
 #define CRC32_REMAINDER		0xFFFFFFFF
 
@@ -114,6 +122,426 @@ typedef struct {
     unsigned int crc32;
 } BINPARAM;
 
+typedef struct {
+	int size;
+	unsigned int crc32;
+} MLZPARAM;
+
+typedef struct {
+	unsigned int addr;
+	int blocks;
+} HASHPARAM;
+
+typedef struct {
+	int blocks;
+	int changed;
+} DELTAPARAM;
+
+#define BLOCKS_MAGIC		0x4b4c424d	/* MBLK */
+
+std::string cachePath( const char* name )
+{
+	std::string path;
+	
+	if( getenv( "MC_CACHE" ) )
+	{
+		path = getenv( "MC_CACHE" );
+	}
+#ifdef __WIN32__
+	else if( getenv( "LOCALAPPDATA" ) )
+	{
+		path = getenv( "LOCALAPPDATA" );
+		path += "\\mcomms";
+	}
+#else
+	else if( getenv( "XDG_CACHE_HOME" ) )
+	{
+		path = getenv( "XDG_CACHE_HOME" );
+		path += "/mcomms";
+	}
+	else if( getenv( "HOME" ) )
+	{
+		path = getenv( "HOME" );
+		mkdir( (path+"/.cache").c_str(), 0755 );
+		path += "/.cache/mcomms";
+	}
+#endif
+	else
+	{
+		return std::string();
+	}
+	
+#ifdef __WIN32__
+	mkdir( path.c_str() );
+	path += "\\";
+#else
+	mkdir( path.c_str(), 0755 );
+	path += "/";
+#endif
+	
+	return path+name;
+	
+} /* cachePath */
+
+static double timeNow()
+{
+	return std::chrono::duration<double>(
+		std::chrono::steady_clock::now().time_since_epoch() ).count();
+	
+} /* timeNow */
+
+static int waitReply( SerialClass* serial )
+{
+	char reply[4];
+	
+	for( int i=0; i<10; i++ )
+	{
+		if( serial->ReceiveBytes( reply, 1 ) > 0 )
+		{
+			TRACE( TRACE_CMD, "upload: reply %lld after %lld tries", reply[0], i+1 );
+			return reply[0];
+		}
+		Sleep( 10 );
+	}
+	
+	TRACE( TRACE_CMD, "upload: no reply" );
+	
+	return -1;
+	
+} /* waitReply */
+
+static void sendData( SerialClass* serial, char* buffer, int size )
+{
+	TRACE( TRACE_CMD, "upload: sending %lld bytes", size );
+	
+	/* draw the progress bar */
+	printf(" ");
+	for( int i=0; i<50; i++ )
+	{
+		printf(".");
+	}
+	
+	printf("]\r[");
+	fflush(stdout);
+	
+	int progress = 0,last_progress = 0;
+	int remain = size;
+	int bsize;
+	char *bpos = buffer;
+	
+	while( remain > 0 )
+	{
+		progress = (51*((1024*((size-remain)>>2))
+			/((size>>2)+1)))/1024;
+		if( progress > last_progress )
+		{
+			for( int i=0; i<(progress-last_progress); i++ )
+			{
+				printf( "#" );
+			}
+			fflush( stdout );
+			last_progress = progress;
+		}
+		bsize = remain;
+		if( bsize > 1024 )
+			bsize = 1024;
+		
+		serial->SendBytes( bpos, bsize );
+		TRACE( TRACE_STEP, "upload: sent %lld at %lld", bsize, bpos-buffer );
+		
+		bpos += bsize;
+		remain -= bsize;
+	}
+	
+	if( progress < 50 )
+	{
+		for( int i=0; i<(50-progress); i++ )
+			printf( "#" );
+	}
+	printf( "\n" );
+	
+	TRACE( TRACE_CMD, "upload: data sent" );
+	
+} /* sendData */
+
+static char* packData( char* buffer, int size, unsigned int crc, MLZPARAM* lz )
+{
+	int packed_size;
+	
+	char* packed = (char*)mlzCompressCached( buffer, size, crc, &packed_size );
+	TRACE( TRACE_CMD, "upload: compressed %lld to %lld", size, packed_size );
+	
+	if( packed_size >= size )
+	{
+		printf( "Data does not compress, using raw upload.\n" );
+		free( packed );
+		return nullptr;
+	}
+	
+	printf( "Compressed %d bytes to %d bytes (%d%%).\n", size, packed_size,
+		(int)((100.0*packed_size)/size) );
+	
+	lz->size = packed_size;
+	lz->crc32 = crc32( packed, packed_size, CRC32_REMAINDER );
+	
+	return packed;
+	
+} /* packData */
+
+static void printRate( int size, int sent, double start )
+{
+	double elapsed = timeNow()-start;
+	
+	if( elapsed <= 0 )
+	{
+		return;
+	}
+	
+	printf( "Uploaded %d bytes (%d sent) in %.2f seconds, %d bytes/s effective.\n",
+		size, sent, elapsed, (int)(size/elapsed) );
+	
+} /* printRate */
+
+static void blockHashes( char* buffer, int size, std::vector<unsigned int>& hashes )
+{
+	hashes.clear();
+	
+	for( int pos=0; pos<size; pos+=DELTA_BLOCK )
+	{
+		int len = size-pos;
+		if( len > DELTA_BLOCK )
+			len = DELTA_BLOCK;
+		
+		hashes.push_back( crc32( buffer+pos, len, CRC32_REMAINDER ) );
+	}
+	
+} /* blockHashes */
+
+static std::string blockCachePath( SerialClass* serial )
+{
+	std::string name = "blocks-"+serial->device;
+	
+	for( int i=0; i<name.size(); i++ )
+	{
+		if( ( name[i] == '/' ) || ( name[i] == '\\' ) || ( name[i] == ':' ) )
+			name[i] = '_';
+	}
+	
+	return cachePath( name.c_str() );
+	
+} /* blockCachePath */
+
+static void saveBlockHashes( SerialClass* serial, unsigned int addr,
+	std::vector<unsigned int>& hashes )
+{
+	std::string path = blockCachePath( serial );
+	
+	if( path.empty() )
+		return;
+	
+	FILE* fp = fopen( path.c_str(), "wb" );
+	
+	if( fp == nullptr )
+		return;
+	
+	unsigned int head[3] = { BLOCKS_MAGIC, addr, (unsigned int)hashes.size() };
+	
+	fwrite( head, 1, sizeof(head), fp );
+	fwrite( hashes.data(), 4, hashes.size(), fp );
+	fclose( fp );
+	
+} /* saveBlockHashes */
+
+static void forgetBlockHashes( SerialClass* serial )
+{
+	std::string path = blockCachePath( serial );
+	
+	if( !path.empty() )
+		remove( path.c_str() );
+	
+} /* forgetBlockHashes */
+
+static int loadBlockHashes( SerialClass* serial, unsigned int addr, int blocks,
+	std::vector<unsigned int>& hashes )
+{
+	unsigned int head[3];
+	std::string path = blockCachePath( serial );
+	
+	if( path.empty() )
+		return -1;
+	
+	FILE* fp = fopen( path.c_str(), "rb" );
+	
+	if( fp == nullptr )
+		return -1;
+	
+	if( ( fread( head, 1, sizeof(head), fp ) != sizeof(head) ) ||
+		( head[0] != BLOCKS_MAGIC ) || ( head[1] != addr ) )
+	{
+		fclose( fp );
+		return -1;
+	}
+	
+	// Blocks past the end of the last image count as changed
+	hashes.assign( blocks, 0 );
+	
+	int count = head[2];
+	if( count > blocks )
+		count = blocks;
+	
+	if( fread( hashes.data(), 4, count, fp ) != count )
+	{
+		fclose( fp );
+		return -1;
+	}
+	
+	fclose( fp );
+	
+	return 0;
+	
+} /* loadBlockHashes */
+
+static int queryBlockHashes( SerialClass* serial, unsigned int addr, int blocks,
+	std::vector<unsigned int>& hashes )
+{
+	HASHPARAM param;
+	
+	serial->SendBytes( (void*)"MHSH", 4 );
+	
+	if( waitReply( serial ) != 'K' )
+		return -1;
+	
+	param.addr = addr;
+	param.blocks = blocks;
+	serial->SendBytes( &param, sizeof(HASHPARAM) );
+	
+	hashes.assign( blocks, 0 );
+	
+	// The console hashes as it goes so allow a few idle timeouts
+	char* buff = (char*)hashes.data();
+	int received = 0;
+	int idle = 0;
+	
+	while( received < blocks*4 )
+	{
+		int ret = serial->ReceiveBytes( buff+received, (blocks*4)-received );
+		
+		if( ret <= 0 )
+		{
+			if( ++idle >= 5 )
+				return -1;
+			continue;
+		}
+		
+		idle = 0;
+		received += ret;
+	}
+	
+	return 0;
+	
+} /* queryBlockHashes */
+
+static int uploadDelta( SerialClass* serial, EXEPARAM* param, char* buffer,
+	std::vector<unsigned int>& hashes, double start )
+{
+	DELTAPARAM delta;
+	std::vector<unsigned int> last;
+	int blocks = hashes.size();
+	
+	if( delta_upload == DELTA_TRUST )
+	{
+		if( loadBlockHashes( serial, param->params.t_addr, blocks, last ) )
+		{
+			printf( "No previous upload recorded for %s, doing a full upload.\n",
+				serial->device.c_str() );
+			return 1;
+		}
+	}
+	else if( queryBlockHashes( serial, param->params.t_addr, blocks, last ) )
+	{
+		printf( "No response to block hash query, doing a full upload.\n" );
+		return 1;
+	}
+	
+	std::vector<unsigned char> bitmap( (blocks+7)/8, 0 );
+	std::vector<char> data;
+	
+	delta.blocks = blocks;
+	delta.changed = 0;
+	
+	for( int i=0; i<blocks; i++ )
+	{
+		if( hashes[i] == last[i] )
+			continue;
+		
+		int len = param->params.t_size-(i*DELTA_BLOCK);
+		if( len > DELTA_BLOCK )
+			len = DELTA_BLOCK;
+		
+		bitmap[i>>3] |= 1<<(i&7);
+		data.insert( data.end(), buffer+(i*DELTA_BLOCK), buffer+(i*DELTA_BLOCK)+len );
+		delta.changed++;
+	}
+	
+	// Not worth it past this point, the bitmap and extra round trip add up
+	if( delta.changed*4 > blocks*3 )
+	{
+		printf( "%d of %d blocks changed, doing a full upload.\n",
+			delta.changed, blocks );
+		return 1;
+	}
+	
+	printf( "%d of %d blocks changed.\n", delta.changed, blocks );
+	TRACE( TRACE_CMD, "upload: delta of %lld blocks, %lld changed", blocks, delta.changed );
+	
+	serial->SendBytes( (void*)"MEXD", 4 );
+	
+	if( waitReply( serial ) != 'K' )
+	{
+		printf( "ERROR: No valid response from console.\n" );
+		return -1;
+	}
+	
+	serial->SendBytes( param, sizeof(EXEPARAM) );
+	serial->SendBytes( &delta, sizeof(DELTAPARAM) );
+	serial->SendBytes( bitmap.data(), bitmap.size() );
+	
+	Sleep( 20 );
+	
+	if( delta.changed )
+	{
+		sendData( serial, data.data(), data.size() );
+	}
+	
+	// Console checks the CRC32 of the whole image before executing
+	char reply = 0;
+	for( int i=0; i<5; i++ )
+	{
+		if( serial->ReceiveBytes( &reply, 1 ) > 0 )
+			break;
+	}
+	
+	TRACE( TRACE_CMD, "upload: delta check reply %lld", reply );
+	
+	if( reply == 'C' )
+	{
+		printf( "Console reported CRC32 mismatch, doing a full upload.\n" );
+		forgetBlockHashes( serial );
+		return 1;
+	}
+	
+	if( reply != 'K' )
+	{
+		printf( "ERROR: No response from console after delta upload.\n" );
+		return -1;
+	}
+	
+	printRate( param->params.t_size, data.size(), start );
+	
+	return 0;
+	
+} /* uploadDelta */
+
 void* loadELF(FILE* fp, EXEC* param)
 {
 	ELF_HEADER head;
@@ -379,7 +807,9 @@ int uploadEXE( const char* exefile, SerialClass* serial )
 	
 	PSEXE exe;
 	EXEPARAM param;
+	MLZPARAM lz;
 	char* buffer;
+	char* packed = nullptr;
 	
 	FILE* fp = fopen(exefile, "rb");
 	
@@ -434,32 +864,63 @@ int uploadEXE( const char* exefile, SerialClass* serial )
 	
 	fclose( fp );
 	
+	TRACE_STR( TRACE_CMD, "upload: %s loaded, %lld bytes at %llx entry %llx", exefile,
+		param.params.t_size, param.params.t_addr, param.params.pc0 );
+	
+	double start = timeNow();
+	
 	param.crc32 = crc32( buffer, param.params.t_size, CRC32_REMAINDER );
 	param.flags = 0;
 	
-	serial->SendBytes( (void*)"MEXE", 4 );
+	std::vector<unsigned int> hashes;
+	blockHashes( buffer, param.params.t_size, hashes );
 	
-	char reply[4];
-	int timeout = true;
-	for( int i=0; i<10; i++ )
+	if( delta_upload && !old_protocol )
 	{
-		if( serial->ReceiveBytes( reply, 1 ) > 0 )
+		int ret = uploadDelta( serial, &param, buffer, hashes, start );
+		
+		if( ret <= 0 )
 		{
-			timeout = false;
-			break;
+			if( ret == 0 )
+				saveBlockHashes( serial, param.params.t_addr, hashes );
+			
+			free( buffer );
+			return ret;
 		}
-		Sleep(10);
 	}
 	
-	if( timeout )
+	// Compressed uploads need the LITELOAD 1.1+ parameter block
+	if( compress_upload && !old_protocol )
+	{
+		packed = packData( buffer, param.params.t_size, param.crc32, &lz );
+	}
+	
+	if( packed )
+	{
+		serial->SendBytes( (void*)"MEXZ", 4 );
+	}
+	else
+	{
+		serial->SendBytes( (void*)"MEXE", 4 );
+	}
+	
+	TRACE_STR( TRACE_CMD, "upload: %s sent", packed ? "MEXZ" : "MEXE" );
+	
+	int reply = waitReply( serial );
+	
+	if( reply < 0 )
 	{
 		printf( "ERROR: No response from console.\n" );
+		free( packed );
+		free( buffer );
 		return( -1 );
 	}
 	
-	if( reply[0] != 'K' )
+	if( reply != 'K' )
 	{
 		printf( "ERROR: No valid response from console.\n" );
+		free( packed );
+		free( buffer );
 		return -1;
 	}
 	
@@ -472,55 +933,31 @@ int uploadEXE( const char* exefile, SerialClass* serial )
 		serial->SendBytes( &param, sizeof(EXEPARAM)-4 );
 	}
 	
-	Sleep( 20 );
-	
-	/* draw the progress bar */
-	printf(" ");
-	for( int i=0; i<50; i++ )
+	if( packed )
 	{
-		printf(".");
+		serial->SendBytes( &lz, sizeof(MLZPARAM) );
 	}
 	
-	printf("]\r[");
-	fflush(stdout);
-	
-	int progress,last_progress = 0;
-	int remain = param.params.t_size;
-	int bsize;
-	char *bpos = buffer;
+	Sleep( 20 );
 	
-	while( remain > 0 )
+	if( packed )
 	{
-		progress = (51*((1024*((param.params.t_size-remain)>>2))
-			/(param.params.t_size>>2)))/1024;
-		if( progress > last_progress )
-		{
-			for( int i=0; i<(progress-last_progress); i++ )
-			{
-				printf( "#" );
-			}
-			fflush( stdout );
-			last_progress = progress;
-		}
-		bsize = remain;
-		if( bsize > 1024 )
-			bsize = 1024;
-		
-		serial->SendBytes( bpos, bsize );
-		
-		bpos += bsize;
-		remain -= bsize;
+		sendData( serial, packed, lz.size );
+		printRate( param.params.t_size, lz.size, start );
+		free( packed );
 	}
-	
-	if( progress < 50 )
+	else
 	{
-		for( int i=0; i<(50-progress); i++ )
-			printf( "#" );
+		sendData( serial, buffer, param.params.t_size );
+		printRate( param.params.t_size, param.params.t_size, start );
 	}
-	printf( "\n" );
+	
+	saveBlockHashes( serial, param.params.t_addr, hashes );
 	
 	free( buffer );
 	
+	TRACE( TRACE_CMD, "upload: executable done" );
+	
 	return( 0 );
 	
 } /* uploadEXE */
@@ -528,7 +965,9 @@ int uploadEXE( const char* exefile, SerialClass* serial )
 int uploadBIN( const char* file, unsigned int addr, SerialClass* serial, int patch )
 {
 	BINPARAM param;
+	MLZPARAM lz;
 	char* buffer;
+	char* packed = nullptr;
 	
 	FILE* fp = fopen( file, "rb" );
 	
@@ -554,88 +993,67 @@ int uploadBIN( const char* file, unsigned int addr, SerialClass* serial, int pat
 	
 	fclose( fp );
 	
+	TRACE_STR( TRACE_CMD, "upload: %s loaded, %lld bytes to %llx", file, param.size, addr );
+	
+	double start = timeNow();
+	
+	param.addr = addr;
+	param.crc32 = crc32( buffer, param.size, CRC32_REMAINDER );
+	
+	// Patch binaries are tiny, not worth compressing
+	if( compress_upload && !patch )
+	{
+		packed = packData( buffer, param.size, param.crc32, &lz );
+	}
+	
 	if( patch )
 	{
 		serial->SendBytes( (void*)"MPAT", 4 );
 	}
+	else if( packed )
+	{
+		serial->SendBytes( (void*)"MBNZ", 4 );
+	}
 	else
 	{
 		serial->SendBytes( (void*)"MBIN", 4 );
 	}
 	
-	char reply[4];
-	int timeout = true;
-	
-	for( int i=0; i<10; i++ )
-	{
-		if ( serial->ReceiveBytes( reply, 1 ) > 0 )
-		{
-			timeout = false;
-			break;
-		}
-		Sleep( 10 );
-	}
+	TRACE_STR( TRACE_CMD, "upload: %s sent", patch ? "MPAT" : ( packed ? "MBNZ" : "MBIN" ) );
 	
-	if( timeout )
+	if( waitReply( serial ) < 0 )
 	{
 		printf( "ERROR: No response from console.\n" );
+		free( packed );
+		free( buffer );
 		return( -1 );
 	}
 	
-	param.addr = addr;
-	param.crc32 = crc32( buffer, param.size, CRC32_REMAINDER );
-	
 	serial->SendBytes( &param, sizeof(BINPARAM) );
 	
-	Sleep( 20 );
-
-	/* draw the progress bar */
-	printf(" ");
-	for( int i=0; i<50; i++ )
+	if( packed )
 	{
-		printf(".");
+		serial->SendBytes( &lz, sizeof(MLZPARAM) );
 	}
 	
-	printf("]\r[");
-	fflush(stdout);
-	
-	int progress,last_progress = 0;
-	int remain = param.size;
-	int bsize;
-	char *bpos = buffer;
+	Sleep( 20 );
 	
-	while( remain > 0 )
+	if( packed )
 	{
-		progress = (51*((1024*((param.size-remain)>>2))
-			/(param.size>>2)))/1024;
-		if( progress > last_progress )
-		{
-			for( int i=0; i<(progress-last_progress); i++ )
-			{
-				printf( "#" );
-			}
-			fflush( stdout );
-			last_progress = progress;
-		}
-		bsize = remain;
-		if( bsize > 1024 )
-			bsize = 1024;
-		
-		serial->SendBytes( bpos, bsize );
-		
-		bpos += bsize;
-		remain -= bsize;
+		sendData( serial, packed, lz.size );
+		printRate( param.size, lz.size, start );
+		free( packed );
 	}
-	
-	if( progress < 50 )
+	else
 	{
-		for( int i=0; i<(50-progress); i++ )
-			printf( "#" );
+		sendData( serial, buffer, param.size );
+		printRate( param.size, param.size, start );
 	}
-	printf( "\n" );
 	
 	free( buffer );
 	
+	TRACE( TRACE_CMD, "upload: binary done" );
+	
 	return( 0 );
 	
 } /* uploadBIN */
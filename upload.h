@@ -1,8 +1,14 @@
 #ifndef _UPLOAD_H
 #define _UPLOAD_H
 
+#include <string>
 #include "serial.h"
 
+#define DELTA_BLOCK		2048
+
+#define DELTA_QUERY		1
+#define DELTA_TRUST		2
+
 typedef struct {
 	unsigned int pc0;
 	unsigned int gp0;
@@ -24,6 +30,8 @@ typedef struct {
 void initTable32(unsigned int* table);
 unsigned int crc32(void* buff, int bytes, unsigned int crc);
 
+std::string cachePath( const char* name );
+
 int uploadEXE( const char* exefile, SerialClass* serial );
 int uploadBIN( const char* file, unsigned int addr, SerialClass* serial, int patch );
 
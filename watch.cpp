@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <chrono>
+#ifndef __WIN32__
+#include <sys/inotify.h>
+#include <fcntl.h>
+#endif
+#include "watch.h"
+
+static long long timeMsec()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch() ).count();
+	
+} /* timeMsec */
+
+WatchClass::WatchClass()
+{
+	fd = -1;
+	wd = -1;
+	pending = false;
+	
+} /* WatchClass::WatchClass */
+
+WatchClass::~WatchClass()
+{
+	Close();
+	
+} /* WatchClass::~WatchClass */
+
+int WatchClass::Open(const char* file, int debounce_ms)
+{
+#ifndef __WIN32__
+	
+	const char* slash = strrchr( file, '/' );
+	
+	// Watch the directory rather than the file itself, linkers often
+	// replace the output with a rename which would orphan a file watch
+	if( slash )
+	{
+		dir.assign( file, slash-file );
+		name = slash+1;
+		if( dir.empty() )
+			dir = "/";
+	}
+	else
+	{
+		dir = ".";
+		name = file;
+	}
+	
+	Close();
+	
+	fd = inotify_init1( IN_NONBLOCK|IN_CLOEXEC );
+	
+	if( fd < 0 )
+	{
+		return -1;
+	}
+	
+	wd = inotify_add_watch( fd, dir.c_str(),
+		IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE|IN_MODIFY );
+	
+	if( wd < 0 )
+	{
+		Close();
+		return -1;
+	}
+	
+	debounce = debounce_ms;
+	pending = false;
+	last_size = -1;
+	
+	return 0;
+	
+#else
+	
+	return -1;
+	
+#endif
+	
+} /* WatchClass::Open */
+
+void WatchClass::Close()
+{
+	if( fd >= 0 )
+	{
+		close( fd );
+		fd = -1;
+	}
+	wd = -1;
+	
+} /* WatchClass::Close */
+
+int WatchClass::CheckEvents()
+{
+#ifndef __WIN32__
+	
+	char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int hit = false;
+	int len;
+	
+	while( ( len = read( fd, buff, sizeof(buff) ) ) > 0 )
+	{
+		for( char* p = buff; p < buff+len; )
+		{
+			struct inotify_event* ev = (struct inotify_event*)p;
+			
+			if( ( ev->len > 0 ) && ( name == ev->name ) )
+			{
+				hit = true;
+			}
+			
+			p += sizeof(struct inotify_event)+ev->len;
+		}
+	}
+	
+	return hit;
+	
+#else
+	
+	return false;
+	
+#endif
+	
+} /* WatchClass::CheckEvents */
+
+int WatchClass::Poll()
+{
+	struct stat attr;
+	
+	if( fd < 0 )
+	{
+		return 0;
+	}
+	
+	if( CheckEvents() )
+	{
+		pending = true;
+		last_event = timeMsec();
+	}
+	
+	if( !pending )
+	{
+		return 0;
+	}
+	
+	if( ( timeMsec()-last_event ) < debounce )
+	{
+		return 0;
+	}
+	
+	// Partially written files still grow between polls, wait it out
+	std::string path = dir+"/"+name;
+	
+	if( stat( path.c_str(), &attr ) || ( attr.st_size == 0 ) ||
+		( attr.st_size != last_size ) )
+	{
+		if( stat( path.c_str(), &attr ) == 0 )
+			last_size = attr.st_size;
+		last_event = timeMsec();
+		return 0;
+	}
+	
+	pending = false;
+	last_size = -1;
+	
+	return 1;
+	
+} /* WatchClass::Poll */
@@ -0,0 +1,33 @@
+#ifndef _WATCH_H
+#define _WATCH_H
+
+#include <string>
+
+class WatchClass {
+public:
+	WatchClass();
+	virtual ~WatchClass();
+	
+	int Open(const char* file, int debounce_ms = 250);
+	void Close();
+	
+	/* Returns 1 once the watched file has been rewritten and left alone
+	 * for the debounce period, 0 otherwise. Never blocks. */
+	int Poll();
+	
+	int fd;
+	
+private:
+	
+	int CheckEvents();
+	
+	std::string dir;
+	std::string name;
+	int wd;
+	int debounce;
+	int pending;
+	long long last_event;
+	long long last_size;
+};
+
+#endif // _WATCH_H
@@ -0,0 +1,222 @@
+#include <string.h>
+#include <ctype.h>
+#include "wildcard.h"
+
+#define WILDCARD_MAX	128
+
+static std::string lower(const char* text, int length) {
+
+	std::string ret(text, length);
+
+	for(int i=0; i<ret.size(); i++) {
+		ret[i] = tolower((unsigned char)ret[i]);
+	}
+
+	return ret;
+
+}
+
+static int equalsAt(const char* name, const std::string& text) {
+
+	for(int i=0; i<text.size(); i++) {
+		if ( tolower((unsigned char)name[i]) != text[i] ) {
+			return 0;
+		}
+	}
+
+	return 1;
+
+}
+
+WildcardClass::WildcardClass() {
+
+	any = true;
+
+}
+
+WildcardClass::WildcardClass(const char* spec) {
+
+	Compile(spec);
+
+}
+
+void WildcardClass::Compile(const char* spec) {
+
+	const char* pos = spec;
+
+	patterns.clear();
+	any = false;
+
+	while( 1 ) {
+
+		const char* end = strchr(pos, ';');
+
+		if ( end == nullptr ) {
+			end = pos+strlen(pos);
+		}
+
+		// Trim surrounding spaces
+		const char* start = pos;
+		const char* stop = end;
+
+		while( ( start < stop ) && ( *start == ' ' ) ) {
+			start++;
+		}
+		while( ( stop > start ) && ( stop[-1] == ' ' ) ) {
+			stop--;
+		}
+
+		if ( ( stop > start ) && ( stop-start < WILDCARD_MAX ) ) {
+
+			PATTERN pat;
+			std::string text = lower(start, stop-start);
+			size_t first = text.find_first_of("*?");
+			size_t last = text.find_last_of("*?");
+
+			pat.text = text;
+
+			if ( ( text == "*" ) || ( text == "*.*" ) ) {
+				pat.type = MATCH_ANY;
+			} else if ( first == std::string::npos ) {
+				pat.type = MATCH_LITERAL;
+			} else if ( ( first == text.size()-1 ) && ( text[first] == '*' ) ) {
+				pat.type = MATCH_PREFIX;
+				pat.text = text.substr(0, first);
+			} else if ( ( last == 0 ) && ( text[0] == '*' ) ) {
+				pat.type = MATCH_SUFFIX;
+				pat.text = text.substr(1);
+			} else {
+				pat.type = MATCH_NFA;
+				pat.prefix = text.substr(0, first);
+				pat.suffix = text.substr(last+1);
+			}
+
+			if ( pat.type == MATCH_ANY ) {
+				any = true;
+			}
+
+			patterns.push_back(pat);
+
+		}
+
+		if ( *end == 0 ) {
+			break;
+		}
+
+		pos = end+1;
+
+	}
+
+	if ( patterns.empty() ) {
+		any = true;
+	}
+
+}
+
+int WildcardClass::MatchNfa(const std::string& pattern, const char* name, int length) {
+
+	// State i means the first i pattern characters have been matched,
+	// a '*' state also holds on to any further characters
+	unsigned char states[2][WILDCARD_MAX+1];
+	int count = pattern.size();
+	int cur = 0;
+
+	memset(states[cur], 0x0, count+1);
+	states[cur][0] = 1;
+
+	for(int i=0; i<count && pattern[i] == '*'; i++) {
+		states[cur][i+1] = 1;
+	}
+
+	for(int n=0; n<length; n++) {
+
+		unsigned char* from = states[cur];
+		unsigned char* to = states[cur^1];
+		char c = tolower((unsigned char)name[n]);
+		int alive = false;
+
+		memset(to, 0x0, count+1);
+
+		for(int i=0; i<count; i++) {
+
+			if ( !from[i] ) {
+				continue;
+			}
+
+			if ( pattern[i] == '*' ) {
+				to[i] = 1;
+			} else if ( ( pattern[i] == '?' ) || ( pattern[i] == c ) ) {
+				to[i+1] = 1;
+			} else {
+				continue;
+			}
+
+			alive = true;
+
+		}
+
+		if ( !alive ) {
+			return 0;
+		}
+
+		// Close over stars that match nothing
+		for(int i=0; i<count; i++) {
+			if ( to[i] && ( pattern[i] == '*' ) ) {
+				to[i+1] = 1;
+			}
+		}
+
+		cur ^= 1;
+
+	}
+
+	return states[cur][count];
+
+}
+
+int WildcardClass::Match(const char* name) const {
+
+	if ( any ) {
+		return 1;
+	}
+
+	int length = strlen(name);
+
+	for(int i=0; i<patterns.size(); i++) {
+
+		const PATTERN& pat = patterns[i];
+
+		switch( pat.type ) {
+		case MATCH_LITERAL:
+			if ( ( length == pat.text.size() ) && equalsAt(name, pat.text) ) {
+				return 1;
+			}
+			break;
+		case MATCH_PREFIX:
+			if ( ( length >= pat.text.size() ) && equalsAt(name, pat.text) ) {
+				return 1;
+			}
+			break;
+		case MATCH_SUFFIX:
+			if ( ( length >= pat.text.size() ) &&
+				equalsAt(name+length-pat.text.size(), pat.text) ) {
+				return 1;
+			}
+			break;
+		case MATCH_NFA:
+			if ( ( length < pat.prefix.size()+pat.suffix.size() ) ||
+				!equalsAt(name, pat.prefix) ||
+				!equalsAt(name+length-pat.suffix.size(), pat.suffix) ) {
+				break;
+			}
+			if ( MatchNfa(pat.text, name, length) ) {
+				return 1;
+			}
+			break;
+		}
+
+	}
+
+	return 0;
+
+}
@@ -0,0 +1,49 @@
+#ifndef WILDCARDCLASS_H
+#define WILDCARDCLASS_H
+
+#include <string>
+#include <vector>
+
+/* Wildcard list as sent by ~FLF and ~FLS, e.g. "*.EXE;*.BIN;DATA?.DAT".
+ * Matching follows PathMatchSpec(): case insensitive, '*' matches any run
+ * of characters, '?' any single one, and "*.*" matches everything. An
+ * empty list matches everything as well.
+ *
+ * The list is compiled once and reused for every directory entry. Plain
+ * names, prefixes ("DATA*") and suffixes ("*.EXE") are compared directly,
+ * anything else runs through a small NFA after its literal ends have been
+ * checked. */
+
+class WildcardClass {
+public:
+
+	WildcardClass();
+	WildcardClass(const char* spec);
+
+	void Compile(const char* spec);
+	int Match(const char* name) const;
+
+private:
+
+	enum {
+		MATCH_ANY,
+		MATCH_LITERAL,
+		MATCH_PREFIX,
+		MATCH_SUFFIX,
+		MATCH_NFA
+	};
+
+	typedef struct {
+		int type;
+		std::string text;		// Whole pattern, or its literal part
+		std::string prefix;		// Literal ends checked before the NFA
+		std::string suffix;
+	} PATTERN;
+
+	static int MatchNfa(const std::string& pattern, const char* name, int length);
+
+	std::vector<PATTERN> patterns;
+	int any;
+};
+
+#endif /* WILDCARDCLASS_H */
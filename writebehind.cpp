@@ -0,0 +1,161 @@
+#include <unistd.h>
+#ifdef __WIN32__
+#include <io.h>
+#endif
+#include "writebehind.h"
+#include "sigblock.h"
+
+/* siofs.cpp */
+extern int fs_sync;
+
+/* Queued writes to one file are merged up to this size */
+#define WRITE_MERGE_MAX	(1024*1024)
+
+WriteBehindClass::WriteBehindClass()
+{
+	quit = false;
+	
+} /* WriteBehindClass::WriteBehindClass */
+
+WriteBehindClass::~WriteBehindClass()
+{
+	if( worker.joinable() )
+	{
+		FlushAll();
+		
+		{
+			std::lock_guard<std::mutex> guard( lock );
+			quit = true;
+		}
+		work.notify_all();
+		worker.join();
+	}
+	
+} /* WriteBehindClass::~WriteBehindClass */
+
+int WriteBehindClass::Sync(FILE* fp)
+{
+	if( fflush( fp ) )
+	{
+		return -1;
+	}
+	
+	// Nothing on disk behind memory streams
+	if( fileno( fp ) < 0 )
+	{
+		return 0;
+	}
+	
+#ifdef __WIN32__
+	return _commit( _fileno( fp ) );
+#else
+	return fsync( fileno( fp ) );
+#endif
+	
+} /* WriteBehindClass::Sync */
+
+void WriteBehindClass::Write(FILE* fp, const void* data, int len,
+	std::atomic<unsigned long long>* calls)
+{
+	const char* p = (const char*)data;
+	
+	std::lock_guard<std::mutex> guard( lock );
+	
+	if( !worker.joinable() )
+	{
+		SignalBlockClass block;
+		worker = std::thread( &WriteBehindClass::Worker, this );
+	}
+	
+	// The worker takes jobs off the queue before writing them, so the
+	// last one can still grow
+	if( !queue.empty() && ( queue.back().fp == fp ) &&
+		( queue.back().data.size()+len <= WRITE_MERGE_MAX ) )
+	{
+		queue.back().data.insert( queue.back().data.end(), p, p+len );
+		return;
+	}
+	
+	JOB job;
+	
+	job.fp = fp;
+	job.data.assign( p, p+len );
+	job.calls = calls;
+	queue.push_back( std::move( job ) );
+	pending[fp]++;
+	
+	work.notify_one();
+	
+} /* WriteBehindClass::Write */
+
+int WriteBehindClass::Flush(FILE* fp)
+{
+	std::unique_lock<std::mutex> guard( lock );
+	
+	done.wait( guard, [&]() { return pending.find( fp ) == pending.end(); } );
+	
+	auto it = errors.find( fp );
+	
+	if( it != errors.end() )
+	{
+		errors.erase( it );
+		return -1;
+	}
+	
+	return 0;
+	
+} /* WriteBehindClass::Flush */
+
+void WriteBehindClass::FlushAll()
+{
+	std::unique_lock<std::mutex> guard( lock );
+	
+	done.wait( guard, [&]() { return pending.empty(); } );
+	
+} /* WriteBehindClass::FlushAll */
+
+void WriteBehindClass::Worker()
+{
+	std::unique_lock<std::mutex> guard( lock );
+	
+	while( 1 )
+	{
+		work.wait( guard, [&]() { return quit || !queue.empty(); } );
+		
+		if( queue.empty() )
+		{
+			return;
+		}
+		
+		JOB job = std::move( queue.front() );
+		queue.pop_front();
+		
+		guard.unlock();
+		
+		int failed = ( fwrite( job.data.data(), 1, job.data.size(), job.fp ) != job.data.size() );
+		
+		if( job.calls )
+		{
+			(*job.calls)++;
+		}
+		
+		if( !failed && ( fs_sync == FS_SYNC_WRITE ) )
+		{
+			failed = ( Sync( job.fp ) != 0 );
+		}
+		
+		guard.lock();
+		
+		if( failed )
+		{
+			errors[job.fp] = 1;
+		}
+		
+		if( --pending[job.fp] == 0 )
+		{
+			pending.erase( job.fp );
+			done.notify_all();
+		}
+	}
+	
+} /* WriteBehindClass::Worker */
@@ -0,0 +1,62 @@
+#ifndef _WRITEBEHIND_H
+#define _WRITEBEHIND_H
+
+#include <stdio.h>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/* How hard SIOFS tries to get written data onto the disk */
+#define FS_SYNC_NONE	0		// Leave it to the OS
+#define FS_SYNC_CLOSE	1		// fsync() when a file is closed
+#define FS_SYNC_WRITE	2		// fsync() after every write
+
+/* Writer thread for ~FWR data that has already been acknowledged to the
+ * target. Writes are queued in order, back to back writes to the same
+ * file are merged into one, and Flush() waits until everything queued
+ * for a file is on its way. Writes that fail are remembered and reported
+ * by the next Flush() for that file. */
+
+class WriteBehindClass {
+public:
+	WriteBehindClass();
+	virtual ~WriteBehindClass();
+	
+	/* Queues len bytes for fp, calls counts the fwrite() calls they end
+	 * up in once merged */
+	void Write(FILE* fp, const void* data, int len,
+		std::atomic<unsigned long long>* calls);
+	
+	/* Waits for the queued writes of fp, returns -1 if any of them failed
+	 * since the last call */
+	int Flush(FILE* fp);
+	void FlushAll();
+	
+	/* Flushes stdio buffers and fsyncs the file */
+	static int Sync(FILE* fp);
+	
+private:
+	
+	typedef struct {
+		FILE*				fp;
+		std::vector<char>	data;
+		std::atomic<unsigned long long>* calls;
+	} JOB;
+	
+	void Worker();
+	
+	std::thread		worker;
+	std::mutex		lock;
+	std::condition_variable work;
+	std::condition_variable done;
+	std::deque<JOB>	queue;
+	std::map<FILE*, int> pending;
+	std::map<FILE*, int> errors;
+	int				quit;
+};
+
+#endif // _WRITEBEHIND_H